@@ -0,0 +1,13 @@
+#ifndef _CONFIG_H
+#define _CONFIG_H
+
+#define PROJECT "Stage"
+#define VERSION "4.1.1"
+#define APIVERSION "4.1"
+#define INSTALL_PREFIX "/usr/local"
+#define PLUGIN_PATH "/usr/local/lib64/Stage-4.1"
+
+/* #undef BUILD_GUI */
+
+#endif
+
@@ -5,6 +5,11 @@
    CVS: $Id: rangernoise.cc,v 1.1 2008-03-04 02:09:56 rtv Exp $
 */
 
+// Rangers can also add noise themselves, without a plugin, as part of
+// their own update: see the noise_* sensor properties of the ranger
+// model. This plugin shows how to post-process ranger data in a
+// callback.
+
 #include "stage.hh"
 using namespace Stg;
 
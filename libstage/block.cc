@@ -17,12 +17,39 @@ Block::Block(  BlockGroup* group,
   pts(pts),
   local_z( zrange ),
   global_z(),
-  rendered_cells() 
+  rendered_cells(),
+  raster(),
+  raster_width(0),
+  raster_height(0)
 {
   assert( group );
   //canonicalize_winding(this->pts);
 }
 
+Block::Block( BlockGroup* group,
+	      const std::vector<uint8_t>& raster,
+	      uint32_t width, uint32_t height,
+	      const Bounds& zrange ) :
+  group(group),
+  pts(4),
+  local_z( zrange ),
+  global_z(),
+  rendered_cells(),
+  raster(raster),
+  raster_width(width),
+  raster_height(height)
+{
+  assert( group );
+  assert( raster.size() == width * height );
+
+  // the same corner order as a traced outline, with the y axis
+  // inverted, so the block scales like one
+  pts[0] = point_t( 0, 0 );
+  pts[1] = point_t( width, 0 );
+  pts[2] = point_t( width, -(double)height );
+  pts[3] = point_t( 0, -(double)height );
+}
+
 /** A from-file  constructor */
 Block::Block( BlockGroup* group,  
 	      Worldfile* wf,
@@ -31,7 +58,10 @@ Block::Block( BlockGroup* group,
     pts(),
     local_z(),
     global_z(),
-    rendered_cells()
+    rendered_cells(),
+    raster(),
+    raster_width(0),
+    raster_height(0)
 {
   assert(group);
   assert(wf);
@@ -141,7 +171,7 @@ void Block::AppendTouchingModels( std::set<Model*>& touchers )
     }
 }
 
-Model* Block::TestCollision()
+Model* Block::TestCollision( bool narrow )
 {
   //printf( "model %s block %p test collision...\n", mod->Token(), this );
 
@@ -152,6 +182,10 @@ Model* Block::TestCollision()
     {
       if ( global_z.min < 0 )
 	return group->mod.world->GetGround();
+
+      // the broad phase found no nearby obstacles, so skip the cells
+      if( ! narrow )
+	return NULL;
 	  
       unsigned int layer = group->mod.world->updates % 2;
 
@@ -189,18 +223,184 @@ void Block::Map( unsigned int layer )
 {  
   // calculate the global pixel coords of the block vertices
   // and render this block's polygon into the world
-  group->mod.world->MapPoly( group->mod.LocalToPixels( pts ), this, layer );
+  MapPixels( group->mod.LocalToPixels( pts ), layer );
+}
+
+void Block::MapPixels( const std::vector<point_int_t>& pixels, unsigned int layer )
+{
+  World* world( group->mod.world );
+
+  // World::Load() renders every model once it is done
+  if( world->loading )
+    return;
+
+  // if we are already rendered, our old cells stay put, so the new
+  // bounding box must include the old one
+  const bool rendered( ! rendered_cells[layer].empty() );
+  if( rendered )
+    world->BroadPhaseRemove( this, layer );
+
+  if( raster.empty() )
+    world->MapPoly( pixels, this, layer );
+  else
+    MapRaster( pixels, layer );
+  rendered_pts[layer] = pixels;
   
+  // every rendered cell lies within the bounding box of the vertices
+  if( ! rendered_cells[layer].empty() )
+    {
+      if( ! rendered )
+	bbox_min[layer] = bbox_max[layer] = pixels[0];
+
+      FOR_EACH( it, pixels )
+	{
+	  bbox_min[layer].x = std::min( bbox_min[layer].x, it->x );
+	  bbox_min[layer].y = std::min( bbox_min[layer].y, it->y );
+	  bbox_max[layer].x = std::max( bbox_max[layer].x, it->x );
+	  bbox_max[layer].y = std::max( bbox_max[layer].y, it->y );
+	}
+      world->BroadPhaseInsert( this, layer );
+    }
+
   // update the block's absolute z bounds at this rendering
+  global_z = GlobalZ();
+}
+
+point_t Block::RasterPoint( double u, double v ) const
+{
+  // pts is the raster's bounding rectangle, scaled into model
+  // coordinates by BlockGroup::CalcSize()
+  const double fu( u / raster_width );
+  const double fv( v / raster_height );
+  return point_t( pts[0].x + fu * (pts[1].x-pts[0].x) + fv * (pts[3].x-pts[0].x),
+		  pts[0].y + fu * (pts[1].y-pts[0].y) + fv * (pts[3].y-pts[0].y) );
+}
+
+void Block::MapRaster( const std::vector<point_int_t>& pixels, unsigned int layer )
+{
+  World* world( group->mod.world );
+  const Pose gpose( group->mod.GetGlobalPose() + group->mod.geom.pose );
+
+  // the global position of the raster's top left corner and the
+  // steps across and down one raster pixel, all in cells
+  point_t corner[3];
+  const point_t local[3] = { RasterPoint( 0, 0 ), 
+			     RasterPoint( 1, 0 ), 
+			     RasterPoint( 0, 1 ) };
+  for( int i=0; i<3; i++ )
+    {
+      const Pose p( gpose + Pose( local[i].x, local[i].y, 0, 0 ) );
+      corner[i] = point_t( p.x * world->ppm, p.y * world->ppm );
+    }
+  
+  const point_t& origin( corner[0] );
+  const point_t across( corner[1].x - origin.x, corner[1].y - origin.y );
+  const point_t down( corner[2].x - origin.x, corner[2].y - origin.y );
+
+  // sample each dark pixel often enough that a pixel larger than a
+  // cell leaves no gaps, and a smaller one still marks the cell
+  // under its center
+  const int samples( std::max( 1.0, ceil( std::max( hypot( across.x, across.y ),
+						    hypot( down.x, down.y )))));
+
+  // every sample lies inside the rectangle of corner pixels
+  point_int_t lo( pixels[0] ), hi( pixels[0] );
+  FOR_EACH( it, pixels )
+    {
+      lo.x = std::min( lo.x, it->x );
+      lo.y = std::min( lo.y, it->y );
+      hi.x = std::max( hi.x, it->x );
+      hi.y = std::max( hi.y, it->y );
+    }
+  const int32_t w( hi.x - lo.x + 1 );
+  const int32_t h( hi.y - lo.y + 1 );
+
+  // the cells under the dark pixels, relative to lo
+  std::vector<uint8_t> occ( w * h, 0 );
+  size_t count( 0 );
+  
+  for( uint32_t y=0; y<raster_height; y++ )
+    {
+      const uint8_t* row( &raster[ y * raster_width ] );
+      for( uint32_t x=0; x<raster_width; x++ )
+	{
+	  if( ! row[x] )
+	    continue;
+	  
+	  for( int j=0; j<samples; j++ )
+	    for( int i=0; i<samples; i++ )
+	      {
+		const double u( x + (i + 0.5) / samples );
+		const double v( y + (j + 0.5) / samples );
+		
+		const int32_t cx( (int32_t)floor( origin.x + u * across.x + v * down.x ) - lo.x );
+		const int32_t cy( (int32_t)floor( origin.y + u * across.y + v * down.y ) - lo.y );
+		
+		if( cx < 0 || cx >= w || cy < 0 || cy >= h )
+		  continue; // rounding at the very edge
+		
+		uint8_t& cell( occ[ cx + cy * w ] );
+		if( ! cell )
+		  {
+		    cell = 1;
+		    ++count;
+		  }
+	      }
+	}
+    }
+
+  rendered_cells[layer].reserve( rendered_cells[layer].size() + count );
+  
+  // write each row of cells a run at a time
+  for( int32_t cy=0; cy<h; cy++ )
+    {
+      const uint8_t* row( &occ[ cy * w ] );
+      int32_t cx( 0 );
+      while( cx < w )
+	{
+	  if( ! row[cx] )
+	    {
+	      ++cx;
+	      continue;
+	    }
+	  
+	  const int32_t start( cx );
+	  while( cx < w && row[cx] )
+	    ++cx;
+	  
+	  world->MapRun( lo.y + cy, lo.x + start, lo.x + cx, this, layer );
+	}
+    }
+}
+
+Bounds Block::GlobalZ() const
+{
   Pose gpose( group->mod.GetGlobalPose() );
   gpose.z += group->mod.geom.pose.z;
-  global_z.min = local_z.min + gpose.z;
-  global_z.max = local_z.max + gpose.z;
+  return Bounds( local_z.min + gpose.z, local_z.max + gpose.z );
 }
 
+bool Block::Remap( unsigned int layer )
+{
+  const std::vector<point_int_t> pixels( group->mod.LocalToPixels( pts ) );
+  const Bounds z( GlobalZ() );
+  
+  // still on the same cells at the same height: nothing to do
+  if( ! rendered_cells[layer].empty() &&
+      pixels == rendered_pts[layer] &&
+      z.min == global_z.min && z.max == global_z.max )
+    return false;
+  
+  UnMap( layer );
+  MapPixels( pixels, layer );
+  return true;
+}
 
 void Block::UnMap( unsigned int layer )
 {
+  if( ! rendered_cells[layer].empty() )
+    group->mod.world->BroadPhaseRemove( this, layer );
+
   FOR_EACH( it, rendered_cells[layer] )
     (*it)->RemoveBlock(this, layer );
   
@@ -222,6 +422,22 @@ void Block::Rasterize( uint8_t* data,
 {
   //printf( "rasterize block %p : w: %u h: %u  scale %.2f %.2f  offset %.2f %.2f\n",
   //	 this, width, height, scalex, scaley, offsetx, offsety );
+
+  if( ! raster.empty() ) // a map block: mark the cells under its dark pixels
+    {
+      for( uint32_t y=0; y<raster_height; y++ )
+	for( uint32_t x=0; x<raster_width; x++ )
+	  if( raster[ x + y * raster_width ] )
+	    {
+	      const point_t mpt( RasterPoint( x + 0.5, y + 0.5 ) );
+	      const int cx( floor( (mpt.x + group->mod.geom.size.x/2.0) / cellwidth ));
+	      const int cy( floor( (mpt.y + group->mod.geom.size.y/2.0) / cellheight ));
+	      
+	      if( cx >= 0 && cx < (int)width && cy >= 0 && cy < (int)height )
+		data[ cx + cy * width ] = 1;
+	    }
+      return;
+    }
 	
   const size_t pt_count = pts.size();
   for( size_t i=0; i<pt_count; ++i )
@@ -290,11 +506,62 @@ void Block::Rasterize( uint8_t* data,
 
 
 
+void Block::DrawRaster( bool top, bool sides, meters_t z )
+{
+  glBegin( GL_QUADS );
+  
+  for( uint32_t y=0; y<raster_height; y++ )
+    {
+      const uint8_t* row( &raster[ y * raster_width ] );
+      uint32_t x( 0 );
+      while( x < raster_width )
+	{
+	  if( ! row[x] )
+	    {
+	      ++x;
+	      continue;
+	    }
+	  
+	  const uint32_t start( x );
+	  while( x < raster_width && row[x] )
+	    ++x;
+	  
+	  // the corners of a box around this run of dark pixels
+	  const point_t c[4] = { RasterPoint( start, y ),
+				 RasterPoint( x, y ),
+				 RasterPoint( x, y+1 ),
+				 RasterPoint( start, y+1 ) };
+	  if( top )
+	    for( int i=0; i<4; i++ )
+	      glVertex3f( c[i].x, c[i].y, z );
+	  
+	  if( sides )
+	    for( int i=0; i<4; i++ )
+	      {
+		const point_t& a( c[i] );
+		const point_t& b( c[(i+1)%4] );
+		glVertex3f( a.x, a.y, local_z.max );
+		glVertex3f( b.x, b.y, local_z.max );
+		glVertex3f( b.x, b.y, local_z.min );
+		glVertex3f( a.x, a.y, local_z.min );
+	      }
+	}
+    }
+  
+  glEnd();
+}
+
 void Block::DrawTop()
 {
   // draw the top of the block - a polygon at the highest vertical
   // extent
 
+  if( ! raster.empty() )
+    {
+      DrawRaster( true, false, local_z.max );
+      return;
+    }
+
   glBegin( GL_POLYGON);
   FOR_EACH( it, pts )
     glVertex3f( it->x, it->y, local_z.max );
@@ -303,6 +570,12 @@ void Block::DrawTop()
 
 void Block::DrawSides()
 {
+  if( ! raster.empty() )
+    {
+      DrawRaster( false, true, local_z.max );
+      return;
+    }
+
   // construct a strip that wraps around the polygon
   glBegin(GL_QUAD_STRIP);
 
@@ -319,6 +592,12 @@ void Block::DrawSides()
 
 void Block::DrawFootPrint()
 {
+  if( ! raster.empty() )
+    {
+      DrawRaster( true, false, 0 );
+      return;
+    }
+
   glBegin(GL_POLYGON);	
   FOR_EACH( it, pts )
     glVertex2f( it->x, it->y );
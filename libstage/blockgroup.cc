@@ -44,8 +44,12 @@ Model* BlockGroup::TestCollision()
 {
   Model* hitmod = NULL;
 
+  // broad phase: the per-cell tests can only find another model if
+  // some foreign obstacle's bounding box overlaps ours
+  const bool narrow( mod.world->BroadPhaseTest( &mod, mod.world->GetUpdateCount() % 2 ));
+
   FOR_EACH( it, blocks )
-  if( (hitmod = it->TestCollision()))
+  if( (hitmod = it->TestCollision( narrow )))
         break; // bail on the earliest collision
 
     return hitmod; // NULL if no collision
@@ -112,6 +116,48 @@ Model* BlockGroup::TestCollision()
  {
   FOR_EACH( it, blocks )
   it->Map(layer);
+
+  CacheBoundingBox( layer );
+}
+
+bool BlockGroup::Remap( unsigned int layer )
+{
+  bool moved( false );
+
+  FOR_EACH( it, blocks )
+  if( it->Remap(layer) )
+    moved = true;
+
+  if( moved )
+    CacheBoundingBox( layer );
+
+  return moved;
+}
+
+void BlockGroup::CacheBoundingBox( unsigned int layer )
+{
+  mod.bbox_empty[layer] = true;
+
+  FOR_EACH( it, blocks )
+  {
+    if( it->rendered_cells[layer].empty() )
+      continue;
+
+    // grow the model's cached bounding box to include this block
+    if( mod.bbox_empty[layer] )
+    {
+      mod.bbox_min[layer] = it->bbox_min[layer];
+      mod.bbox_max[layer] = it->bbox_max[layer];
+      mod.bbox_empty[layer] = false;
+    }
+    else
+    {
+      mod.bbox_min[layer].x = std::min( mod.bbox_min[layer].x, it->bbox_min[layer].x );
+      mod.bbox_min[layer].y = std::min( mod.bbox_min[layer].y, it->bbox_min[layer].y );
+      mod.bbox_max[layer].x = std::max( mod.bbox_max[layer].x, it->bbox_max[layer].x );
+      mod.bbox_max[layer].y = std::max( mod.bbox_max[layer].y, it->bbox_max[layer].y );
+    }
+  }
 }
 
 void BlockGroup::UnMap( unsigned int layer )
@@ -202,6 +248,9 @@ void BlockGroup::BuildDisplayList()
 
       FOR_EACH( blk, blocks )
       {      
+        if( ! blk->raster.empty() )
+          continue; // map blocks draw their own tops
+
         std::vector<GLdouble> verts;      
         FOR_EACH( it, blk->pts )
         {
@@ -236,7 +285,10 @@ void BlockGroup::BuildDisplayList()
    gluTessEndPolygon(tobj);
 
    FOR_EACH( blk, blocks )
-   blk->DrawSides();
+   if( blk->raster.empty() )
+     blk->DrawSides();
+   else
+     blk->DrawSolid( false ); // map blocks were left out of the tesselation
 
    mod.PopColor();
 
@@ -264,7 +316,10 @@ void BlockGroup::BuildDisplayList()
  gluTessEndPolygon(tobj);
 
  FOR_EACH( blk, blocks )
- blk->DrawSides();
+ if( blk->raster.empty() )
+   blk->DrawSides();
+ else
+   blk->DrawSolid( false );
 
  glDepthMask(GL_TRUE);
  glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
@@ -291,20 +346,60 @@ void BlockGroup::LoadBlock( Worldfile* wf, int entity )
   //CalcSize(); // adjust the blocks so they fit in our bounding box
 }				
 
-void BlockGroup::LoadBitmap( const std::string& bitmapfile, Worldfile* wf )
+std::string BlockGroup::BitmapPath( const std::string& bitmapfile, Worldfile* wf )
 {
-  PRINT_DEBUG1( "attempting to load bitmap \"%s\n", bitmapfile );
+  if( bitmapfile[0] == '/' )
+    return bitmapfile;
 
-  std::string full;
+  char* workaround_const = strdup(wf->filename.c_str());
+  const std::string full( std::string(dirname(workaround_const)) + "/" + bitmapfile );
+  free( workaround_const );
+  return full;
+}
 
-  if( bitmapfile[0] == '/' )
-    full = bitmapfile;
-  else
-  {
-    char* workaround_const = strdup(wf->filename.c_str());
-    full = std::string(dirname(workaround_const)) + "/" + bitmapfile;			
-    free( workaround_const );
-  }
+BlockGroup::BitmapMode BlockGroup::ReadBitmapMode( Worldfile* wf, int entity )
+{
+  if( wf->ReadInt( entity, "bitmap_cells", 0 ) )
+    return BITMAP_CELLS;
+  if( wf->ReadInt( entity, "bitmap_rects", 0 ) )
+    return BITMAP_RECTS;
+  return BITMAP_OUTLINES;
+}
+
+void BlockGroup::DecodeBitmap( const std::string& filename, BitmapMode mode,
+			       bool cache, BitmapShapes& shapes )
+{
+  const char* methods[3] = { "outlines", "rects", "cells" };
+
+  shapes.cached = cache && map_cache_read( filename, methods[mode], shapes.polys,
+					   shapes.raster, shapes.width, shapes.height );
+  if( shapes.cached )
+    return;
+
+  switch( mode )
+    {
+    case BITMAP_CELLS:
+      shapes.err = raster_from_image_file( filename, shapes.raster,
+					   shapes.width, shapes.height );
+      break;
+    case BITMAP_RECTS:
+      shapes.err = rects_from_image_file( filename, shapes.polys );
+      break;
+    default:
+      shapes.err = polys_from_image_file( filename, shapes.polys );
+    }
+
+  if( cache && ! shapes.err )
+    map_cache_write( filename, methods[mode], shapes.polys,
+		     shapes.raster, shapes.width, shapes.height );
+}
+
+void BlockGroup::LoadBitmap( const std::string& bitmapfile, Worldfile* wf, 
+			     BitmapMode mode, bool cache )
+{
+  PRINT_DEBUG1( "attempting to load bitmap \"%s\n", bitmapfile );
+
+  const std::string full( BitmapPath( bitmapfile, wf ) );
   
   char buf[512];
   snprintf( buf, 512, "[Image \"%s\"", bitmapfile.c_str() ); 
@@ -313,19 +408,32 @@ void BlockGroup::LoadBitmap( const std::string& bitmapfile, Worldfile* wf )
   
   PRINT_DEBUG1( "attempting to load image %s", full );
     
-  Color col( 1.0, 0.0, 1.0, 1.0 );
+  // the world may have decoded this bitmap already
+  BitmapShapes decoded;
+  const BitmapShapes* shapes( &decoded );
   
-  std::vector<std::vector<point_t> > polys;
+  std::map<std::pair<std::string,int>,BitmapShapes>::const_iterator it =
+    mod.world->decoded_bitmaps.find( std::make_pair( full, (int)mode ) );
+  
+  if( it != mod.world->decoded_bitmaps.end() )
+    shapes = &it->second;
+  else
+    DecodeBitmap( full, mode, cache, decoded );
   
-  if( polys_from_image_file( full,
-			     polys ) )
+  if( shapes->cached )
+    fputs( " cached", stdout );
+  
+  if( shapes->err )
     {
-      PRINT_ERR1( "failed to load polys from image file \"%s\"",
+      PRINT_ERR1( "failed to load image file \"%s\"",
 		  full.c_str() );
-      return;
+      exit(-1);
     }
   
-  FOR_EACH( it, polys )
+  if( shapes->width && shapes->height )
+    AppendBlock( Block( this, shapes->raster, shapes->width, shapes->height, Bounds(0,1) ));
+  
+  FOR_EACH( it, shapes->polys )
     AppendBlock( Block( this,
 			*it,
 			Bounds(0,1) ));
@@ -336,6 +444,22 @@ void BlockGroup::LoadBitmap( const std::string& bitmapfile, Worldfile* wf )
 }
 
 
+size_t BlockGroup::GetVertexCount() const
+{
+  size_t count( 0 );
+  FOR_EACH( it, blocks )
+    count += it->pts.size();
+  return count;
+}
+
+size_t BlockGroup::GetCellCount( unsigned int layer ) const
+{
+  size_t count( 0 );
+  FOR_EACH( it, blocks )
+    count += it->rendered_cells[layer].size();
+  return count;
+}
+
 void BlockGroup::Rasterize( uint8_t* data, 
 			    unsigned int width, 
 			    unsigned int height,
@@ -0,0 +1,251 @@
+/////////////////////////////////
+// File: checkpoint.cc
+// Desc: In-memory checkpoints of the dynamic state of a world, so a
+//       simulation can be wound back and run again from the same
+//       state.
+// License: GPL
+/////////////////////////////////
+
+#include "stage.hh"
+using namespace Stg;
+
+// Gives access to the array that holds the heap of a priority_queue,
+// so that a checkpoint copies the heap as it stands and events with
+// the same time come out in the same order after a restore.
+template <typename Q>
+class HeapAccess : public Q
+{
+public:
+  static typename Q::container_type& Get( Q& q )
+  { return q.*(&HeapAccess::c); }
+};
+
+// what the world saves about each model
+class ModelRecord
+{
+public:
+  Model* mod;
+  Model* parent;
+  Pose pose;
+  Pose map_pose[2];
+  int subs;
+  const uint8_t* state; ///< what the model's SaveState() wrote
+  uint32_t state_size;
+};
+
+// A checkpoint is the clock, then the drand48() state, then a
+// ModelRecord for each model, then the event queues, then what each
+// model's SaveState() wrote, in the order of the records, each
+// after its size. It holds pointers, so it is only good in the world
+// that made it.
+
+checkpoint_t World::Checkpoint()
+{
+  std::string buf;
+
+  snapshot_put( buf, sim_time );
+  snapshot_put( buf, updates );
+  snapshot_put( buf, sim_interval );
+
+  // seed48() is the only way to read the state of drand48()
+  unsigned short seed[3] = { 0, 0, 0 };
+  memcpy( seed, seed48( seed ), sizeof(seed) );
+  seed48( seed );
+  snapshot_put( buf, seed );
+
+  snapshot_put( buf, (uint32_t)models.size() );
+  FOR_EACH( it, models )
+    {
+      const Model* mod( *it );
+      snapshot_put( buf, mod );
+      snapshot_put( buf, mod->parent );
+      snapshot_put( buf, mod->pose );
+      snapshot_put( buf, mod->map_pose[0] );
+      snapshot_put( buf, mod->map_pose[1] );
+      snapshot_put( buf, mod->subs );
+    }
+
+  snapshot_put( buf, (uint32_t)event_queues.size() );
+  FOR_EACH( it, event_queues )
+    {
+      const std::vector<Event>& heap( HeapAccess<std::priority_queue<Event> >::Get( *it ) );
+      snapshot_put( buf, (uint32_t)heap.size() );
+      FOR_EACH( eit, heap )
+	{
+	  snapshot_put( buf, eit->time );
+	  snapshot_put( buf, eit->mod );
+	  snapshot_put( buf, eit->cb );
+	  snapshot_put( buf, eit->arg );
+	}
+    }
+
+  FOR_EACH( it, models )
+    {
+      // the size goes first, filled in once it is known
+      const size_t start( buf.size() );
+      snapshot_put( buf, (uint32_t)0 );
+      (*it)->SaveState( buf );
+      
+      const uint32_t size( buf.size() - start - sizeof(uint32_t) );
+      memcpy( &buf[start], &size, sizeof(size) );
+    }
+
+  const checkpoint_t handle( ++next_checkpoint );
+  checkpoints[handle].swap( buf );
+  return handle;
+}
+
+bool World::Restore( checkpoint_t handle )
+{
+  std::map<checkpoint_t,std::string>::const_iterator found( checkpoints.find( handle ) );
+  if( found == checkpoints.end() )
+    {
+      PRINT_WARN1( "no checkpoint %u to restore", handle );
+      return false;
+    }
+
+  const std::string& buf( found->second );
+  const uint8_t* pos( (const uint8_t*)buf.data() );
+  const uint8_t* end( pos + buf.size() );
+
+  // read and check everything, and find each model's own state,
+  // before changing anything
+  usec_t time( 0 ), interval( 0 );
+  uint64_t steps( 0 );
+  unsigned short seed[3] = { 0, 0, 0 };
+  uint32_t count( 0 );
+
+  snapshot_get( pos, end, time );
+  snapshot_get( pos, end, steps );
+  snapshot_get( pos, end, interval );
+  snapshot_get( pos, end, seed );
+  snapshot_get( pos, end, count );
+
+  bool ok( count == models.size() );
+
+  std::vector<ModelRecord> records( ok ? count : 0 );
+  FOR_EACH( it, records )
+    {
+      ok = ok &&
+	snapshot_get( pos, end, it->mod ) &&
+	snapshot_get( pos, end, it->parent ) &&
+	snapshot_get( pos, end, it->pose ) &&
+	snapshot_get( pos, end, it->map_pose[0] ) &&
+	snapshot_get( pos, end, it->map_pose[1] ) &&
+	snapshot_get( pos, end, it->subs ) &&
+	models.find( it->mod ) != models.end() &&
+	( it->parent == NULL || models.find( it->parent ) != models.end() ) &&
+	it->mod->subs == it->subs;
+    }
+
+  uint32_t queues( 0 );
+  ok = ok && snapshot_get( pos, end, queues ) && queues == event_queues.size();
+
+  std::vector<std::vector<Event> > heaps( ok ? queues : 0 );
+  FOR_EACH( it, heaps )
+    {
+      uint32_t events( 0 );
+      ok = ok && snapshot_get( pos, end, events );
+      for( uint32_t i=0; ok && i<events; i++ )
+	{
+	  Event ev( 0, NULL, NULL, NULL );
+	  ok = snapshot_get( pos, end, ev.time ) &&
+	    snapshot_get( pos, end, ev.mod ) &&
+	    snapshot_get( pos, end, ev.cb ) &&
+	    snapshot_get( pos, end, ev.arg );
+	  it->push_back( ev );
+	}
+    }
+
+  FOR_EACH( it, records )
+    {
+      ok = ok && snapshot_get( pos, end, it->state_size ) &&
+	it->state_size <= (size_t)(end - pos);
+      if( ! ok )
+	break;
+      it->state = pos;
+      pos += it->state_size;
+    }
+
+  ok = ok && pos == end;
+
+  if( ! ok )
+    {
+      PRINT_WARN1( "checkpoint %u does not match the models of the world, so it can't be restored",
+		   handle );
+      return false;
+    }
+
+  sim_time = time;
+  updates = steps;
+  sim_interval = interval;
+  seed48( seed );
+
+  for( size_t q(0); q<heaps.size(); ++q )
+    HeapAccess<std::priority_queue<Event> >::Get( event_queues[q] ).swap( heaps[q] );
+
+  // put back anything a gripper picked up or dropped
+  FOR_EACH( it, records )
+    if( it->mod->parent != it->parent )
+      it->mod->SetParent( it->parent );
+
+  // Each model reads back exactly what its SaveState() wrote, so
+  // this fails only if the two disagree, which is a bug in the
+  // model. The other models are restored anyway.
+  bool loaded( true );
+  FOR_EACH( it, records )
+    {
+      const uint8_t* state( it->state );
+      const uint8_t* state_end( it->state + it->state_size );
+      if( ! it->mod->LoadState( state, state_end ) || state != state_end )
+	{
+	  PRINT_ERR2( "model %s could not read back its state from checkpoint %u",
+		      it->mod->Token(), handle );
+	  loaded = false;
+	}
+    }
+
+  // Render again, in each layer, the models whose blocks are not
+  // where they were, with their children, at the poses they were
+  // rendered at: the two layers may have been rendered at different
+  // poses.
+  for( unsigned int layer(0); layer<2; ++layer )
+    {
+      std::set<Model*> moved;
+      FOR_EACH( it, records )
+	if( it->mod->map_pose[layer] != it->map_pose[layer] )
+	  moved.insert( it->mod );
+
+      if( moved.empty() )
+	continue;
+
+      // a child is rendered again with its ancestor
+      std::vector<Model*> roots;
+      FOR_EACH( it, moved )
+	{
+	  Model* anc( (*it)->parent );
+	  while( anc && moved.find( anc ) == moved.end() )
+	    anc = anc->parent;
+	  if( anc == NULL )
+	    roots.push_back( *it );
+	}
+
+      FOR_EACH( it, roots )
+	(*it)->UnMapWithChildren( layer );
+
+      FOR_EACH( it, records )
+	it->mod->pose = it->map_pose[layer];
+
+      FOR_EACH( it, roots )
+	{
+	  (*it)->MapWithChildren( layer );
+	  (*it)->NeedRedraw();
+	}
+    }
+
+  FOR_EACH( it, records )
+    it->mod->pose = it->pose;
+
+  dirty = true;
+  return loaded;
+}
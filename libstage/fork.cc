@@ -0,0 +1,176 @@
+/////////////////////////////////
+// File: fork.cc
+// Desc: Forking a running world into child processes, which share
+//       its memory until they write to it, to run what-if rollouts
+//       from the same state in parallel.
+// License: GPL
+/////////////////////////////////
+
+#include <errno.h>
+#include <sys/wait.h>
+
+#include "stage.hh"
+using namespace Stg;
+
+int World::Fork( unsigned int children )
+{
+  if( IsGUI() )
+    {
+      PRINT_ERR1( "world %s has a GUI, so it can't be forked", Token() );
+      return -1;
+    }
+
+  if( ! forks.empty() )
+    {
+      PRINT_ERR1( "world %s was forked before and its children have not been joined",
+		  Token() );
+      return -1;
+    }
+
+  // or the children print what was buffered here too
+  fflush( stdout );
+  fflush( stderr );
+
+  for( unsigned int i(1); i<=children; ++i )
+    {
+      int fds[2];
+      if( pipe( fds ) )
+	{
+	  PRINT_ERR2( "failed to fork world %s : %s", Token(), strerror(errno) );
+	  forks.push_back( std::make_pair( (pid_t)-1, -1 ) );
+	  continue;
+	}
+
+      // so that no worker thread holds the lock when we fork
+      pthread_mutex_lock( &sync_mutex );
+      const pid_t pid( fork() );
+
+      if( pid == 0 )
+	{
+	  // Only this thread made it into the child, holding the lock
+	  // it took above. The workers were idle, so no queue was half
+	  // done: release the lock, put their signals back to new and
+	  // start them again.
+	  pthread_mutex_unlock( &sync_mutex );
+	  pthread_cond_init( &threads_start_cond, NULL );
+	  pthread_cond_init( &jobs_cond, NULL );
+	  threads_working = 0;
+	  threads_started = 0;
+	  jobs.clear();
+
+	  // our siblings' pipes, and our parent's pipe to its parent
+	  close( fds[0] );
+	  FOR_EACH( it, forks )
+	    if( it->second >= 0 )
+	      close( it->second );
+	  forks.clear();
+	  if( fork_report >= 0 )
+	    close( fork_report );
+	  fork_report = fds[1];
+
+	  StartThreads();
+	  return i;
+	}
+
+      pthread_mutex_unlock( &sync_mutex );
+      close( fds[1] );
+
+      if( pid < 0 )
+	{
+	  PRINT_ERR2( "failed to fork world %s : %s", Token(), strerror(errno) );
+	  close( fds[0] );
+	  forks.push_back( std::make_pair( (pid_t)-1, -1 ) );
+	  continue;
+	}
+
+      forks.push_back( std::make_pair( pid, fds[0] ) );
+    }
+
+  return 0;
+}
+
+void World::ForkReturn( const std::string& report )
+{
+  if( fork_report < 0 )
+    {
+      PRINT_ERR1( "world %s is not a child made by Fork(), so it has nothing to return to",
+		  Token() );
+      return;
+    }
+
+  bool ok( true );
+  const char* data( report.data() );
+  size_t left( report.size() );
+  while( ok && left )
+    {
+      const ssize_t n( write( fork_report, data, left ) );
+      if( n < 0 && errno == EINTR )
+	continue;
+      ok = ( n > 0 );
+      if( ok )
+	{
+	  data += n;
+	  left -= n;
+	}
+    }
+
+  if( ! ok )
+    PRINT_ERR2( "failed to return a report from world %s : %s", Token(), strerror(errno) );
+
+  fflush( stdout );
+  fflush( stderr );
+
+  // not exit(): the destructors and atexit() handlers belong to the
+  // parent
+  _exit( ok ? 0 : 1 );
+}
+
+bool World::ForkJoin( std::vector<std::string>& reports )
+{
+  reports.assign( forks.size(), std::string() );
+
+  bool ok( true );
+  for( size_t i(0); i<forks.size(); ++i )
+    {
+      const pid_t pid( forks[i].first );
+      const int fd( forks[i].second );
+
+      if( pid < 0 )
+	{
+	  ok = false; // never started
+	  continue;
+	}
+
+      // read to the end before waiting, or a child with more to say
+      // than the pipe holds would never end
+      char chunk[4096];
+      for(;;)
+	{
+	  const ssize_t n( read( fd, chunk, sizeof(chunk) ) );
+	  if( n < 0 && errno == EINTR )
+	    continue;
+	  if( n <= 0 )
+	    break;
+	  reports[i].append( chunk, n );
+	}
+      close( fd );
+
+      int status( 0 );
+      while( waitpid( pid, &status, 0 ) < 0 )
+	if( errno != EINTR )
+	  {
+	    status = -1;
+	    break;
+	  }
+
+      if( ! WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+	{
+	  PRINT_WARN3( "child %lu of world %s failed (status %d)",
+		       (unsigned long)(i+1), Token(), status );
+	  ok = false;
+	}
+    }
+
+  forks.clear();
+  return ok;
+}
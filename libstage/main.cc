@@ -19,6 +19,13 @@
 
     -a \"str\"       : equivalent to --args "str"
 
+    --snapshot file : save a binary snapshot of the first world to
+                      file once it is loaded, and exit. The snapshot
+                      can be given in place of the worldfile, and
+                      loads much faster.
+
+    -s file        : equivalent to --snapshot file
+
     -h             : equivalent to --help"
 
     -?             : equivalent to --help
@@ -40,6 +47,8 @@ const char* USAGE =
   "  --help         : print this message\n"
   "  --args \"str\"   : define an argument string to be passed to all controllers\n"
   "  -a \"str\"       : equivalent to --args \"str\"\n"
+  "  --snapshot file : save a binary snapshot of the first world to file, and exit\n"
+  "  -s file        : equivalent to --snapshot file\n"
   "  -h             : equivalent to --help\n"
   "  -?             : equivalent to --help";
 
@@ -49,6 +58,7 @@ static struct option longopts[] = {
 	{ "clock",  optional_argument,   NULL,  'c' },
 	{ "help",  optional_argument,   NULL,  'h' },
 	{ "args",  required_argument,   NULL,  'a' },
+	{ "snapshot",  required_argument,   NULL,  's' },
 	{ NULL, 0, NULL, 0 }
 };
 
@@ -62,8 +72,9 @@ int main( int argc, char* argv[] )
   int ch=0, optindex=0;
   bool usegui = true;
   bool showclock = false;
+  const char* snapshot = NULL;
   
-  while ((ch = getopt_long(argc, argv, "cgh?", longopts, &optindex)) != -1)
+  while ((ch = getopt_long(argc, argv, "cghs:?", longopts, &optindex)) != -1)
 	 {
 		switch( ch )
 		  {
@@ -77,6 +88,9 @@ int main( int argc, char* argv[] )
 			 showclock = true;
 			 printf( "[Clock enabled]" );
 			 break;
+		  case 's':
+			 snapshot = optarg;
+			 break;
 		  case 'g': 
 			 usegui = false;
 			 printf( "[GUI disabled]" );
@@ -110,6 +124,12 @@ int main( int argc, char* argv[] )
 			 world->Load( worldfilename );
 			 world->ShowClock( showclock );
 
+			 if( snapshot )
+				{
+				  printf( "[Snapshot %s]\n", snapshot );
+				  return( world->SaveSnapshot( snapshot ) ? EXIT_SUCCESS : EXIT_FAILURE );
+				}
+
 			 if( ! world->paused ) 
 				world->Start();
 		  }
@@ -0,0 +1,229 @@
+/////////////////////////////////
+// File: mapcache.cc
+// Desc: Cache files that keep the polygons or raster made from a
+//       bitmap, so that later loads need not decode the image.
+// License: GPL
+/////////////////////////////////
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stage.hh"
+using namespace Stg;
+
+// bump whenever the layout below changes
+static const uint32_t MAPCACHE_VERSION( 1 );
+static const char MAPCACHE_MAGIC[8] = { 'S','T','G','M','A','P','C','\0' };
+
+// A cache file is this header, then the vertex count of each
+// polygon as a uint32_t, then the vertices as int32_t x,y pairs,
+// then the raster packed 8 pixels to a byte. All in the byte order
+// of the machine that wrote it: another machine just misses.
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t threshold;
+  uint64_t image_hash; ///< of the contents of the image file
+  uint64_t image_size;
+  uint64_t method_hash; ///< of the name of the method
+  uint32_t width, height; ///< of the raster
+  uint64_t polys; ///< number of polygons
+  uint64_t points; ///< total number of vertices
+} mapcache_header_t;
+
+// 64 bit FNV-1a
+static uint64_t hash_bytes( const uint8_t* data, size_t len,
+			    uint64_t h = 14695981039346656037ULL )
+{
+  for( size_t i=0; i<len; i++ )
+    {
+      h ^= data[i];
+      h *= 1099511628211ULL;
+    }
+  return h;
+}
+
+const uint8_t* Stg::map_file( const std::string& filename, size_t& len )
+{
+  const int fd( open( filename.c_str(), O_RDONLY ) );
+  if( fd < 0 )
+    return NULL;
+
+  struct stat st;
+  if( fstat( fd, &st ) || st.st_size == 0 )
+    {
+      close( fd );
+      return NULL;
+    }
+
+  len = st.st_size;
+  void* data( mmap( NULL, len, PROT_READ, MAP_PRIVATE, fd, 0 ) );
+  close( fd ); // the mapping keeps the file open
+
+  return( data == MAP_FAILED ? NULL : (const uint8_t*)data );
+}
+
+static std::string cache_filename( const std::string& filename, const char* method )
+{
+  return( filename + "." + method + ".cache" );
+}
+
+// fill in the key fields of a header for the image file. Returns
+// false if the image can't be read.
+static bool make_key( const std::string& filename, const char* method,
+		      mapcache_header_t& hdr )
+{
+  size_t len( 0 );
+  const uint8_t* image( map_file( filename, len ) );
+  if( image == NULL )
+    return false;
+
+  memset( &hdr, 0, sizeof(hdr) );
+  memcpy( hdr.magic, MAPCACHE_MAGIC, sizeof(hdr.magic) );
+  hdr.version = MAPCACHE_VERSION;
+  hdr.threshold = IMAGE_THRESHOLD;
+  hdr.image_hash = hash_bytes( image, len );
+  hdr.image_size = len;
+  hdr.method_hash = hash_bytes( (const uint8_t*)method, strlen(method) );
+
+  munmap( (void*)image, len );
+  return true;
+}
+
+bool Stg::map_cache_read( const std::string& filename, const char* method,
+			  std::vector<std::vector<point_t> >& polys,
+			  std::vector<uint8_t>& raster,
+			  uint32_t& width, uint32_t& height )
+{
+  mapcache_header_t key;
+  if( ! make_key( filename, method, key ) )
+    return false;
+
+  size_t len( 0 );
+  const uint8_t* data( map_file( cache_filename( filename, method ), len ) );
+  if( data == NULL )
+    return false;
+
+  bool ok( len >= sizeof(mapcache_header_t) );
+
+  mapcache_header_t hdr;
+  if( ok )
+    {
+      memcpy( &hdr, data, sizeof(hdr) );
+
+      ok = memcmp( hdr.magic, key.magic, sizeof(hdr.magic) ) == 0 &&
+	hdr.version == key.version &&
+	hdr.threshold == key.threshold &&
+	hdr.image_hash == key.image_hash &&
+	hdr.image_size == key.image_size &&
+	hdr.method_hash == key.method_hash;
+    }
+
+  const size_t raster_bytes( ok ? ((size_t)hdr.width * hdr.height + 7) / 8 : 0 );
+
+  ok = ok && len == sizeof(hdr) +
+    hdr.polys * sizeof(uint32_t) +
+    hdr.points * 2 * sizeof(int32_t) +
+    raster_bytes;
+
+  if( ok )
+    {
+      const uint32_t* counts( (const uint32_t*)(data + sizeof(hdr)) );
+      const int32_t* xy( (const int32_t*)(counts + hdr.polys) );
+      const uint8_t* bits( (const uint8_t*)(xy + 2 * hdr.points) );
+
+      uint64_t total( 0 );
+      for( uint64_t p=0; p<hdr.polys; p++ )
+	total += counts[p];
+      ok = ( total == hdr.points );
+
+      if( ok )
+	{
+	  polys.resize( hdr.polys );
+	  for( uint64_t p=0; p<hdr.polys; p++ )
+	    {
+	      std::vector<point_t>& poly( polys[p] );
+	      poly.resize( counts[p] );
+	      FOR_EACH( it, poly )
+		{
+		  *it = point_t( xy[0], xy[1] );
+		  xy += 2;
+		}
+	    }
+
+	  width = hdr.width;
+	  height = hdr.height;
+	  raster.resize( (size_t)width * height );
+	  for( size_t i=0; i<raster.size(); i++ )
+	    raster[i] = ( bits[i/8] >> (i%8) ) & 1;
+	}
+    }
+
+  munmap( (void*)data, len );
+  return ok;
+}
+
+void Stg::map_cache_write( const std::string& filename, const char* method,
+			   const std::vector<std::vector<point_t> >& polys,
+			   const std::vector<uint8_t>& raster,
+			   uint32_t width, uint32_t height )
+{
+  mapcache_header_t hdr;
+  if( ! make_key( filename, method, hdr ) )
+    return;
+
+  hdr.width = width;
+  hdr.height = height;
+  hdr.polys = polys.size();
+
+  std::vector<uint32_t> counts;
+  std::vector<int32_t> xy;
+  FOR_EACH( it, polys )
+    {
+      counts.push_back( it->size() );
+      FOR_EACH( pit, *it )
+	{
+	  // bitmap polygons have their vertices on pixel corners
+	  xy.push_back( (int32_t)floor( pit->x + 0.5 ) );
+	  xy.push_back( (int32_t)floor( pit->y + 0.5 ) );
+	}
+    }
+  hdr.points = xy.size() / 2;
+
+  std::vector<uint8_t> bits( ((size_t)width * height + 7) / 8, 0 );
+  for( size_t i=0; i<raster.size(); i++ )
+    if( raster[i] )
+      bits[i/8] |= 1 << (i%8);
+
+  // write a temporary file and rename it into place, so that a
+  // reader never sees half a cache file
+  const std::string cachefile( cache_filename( filename, method ) );
+  char tmpname[32];
+  snprintf( tmpname, sizeof(tmpname), ".%d.tmp", (int)getpid() );
+  const std::string tmpfile( cachefile + tmpname );
+
+  FILE* fp( fopen( tmpfile.c_str(), "wb" ) );
+  if( fp == NULL )
+    {
+      PRINT_WARN1( "can't write map cache file \"%s\"", cachefile.c_str() );
+      return;
+    }
+
+  bool ok( fwrite( &hdr, sizeof(hdr), 1, fp ) == 1 );
+  if( ok && counts.size() )
+    ok = fwrite( &counts[0], sizeof(uint32_t), counts.size(), fp ) == counts.size();
+  if( ok && xy.size() )
+    ok = fwrite( &xy[0], sizeof(int32_t), xy.size(), fp ) == xy.size();
+  if( ok && bits.size() )
+    ok = fwrite( &bits[0], 1, bits.size(), fp ) == bits.size();
+
+  ok = ( fclose( fp ) == 0 ) && ok;
+
+  if( ! ok || rename( tmpfile.c_str(), cachefile.c_str() ) )
+    {
+      PRINT_WARN1( "failed to write map cache file \"%s\"", cachefile.c_str() );
+      unlink( tmpfile.c_str() );
+    }
+}
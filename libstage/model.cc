@@ -28,6 +28,9 @@
     color "red"
     color_rgba [ 0.0 0.0 0.0 1.0 ]
     bitmap ""
+    bitmap_rects 0
+    bitmap_cells 0
+    bitmap_cache 0
     ctrl ""
 
     # determine how the model appears in various sensors
@@ -78,6 +81,31 @@
     opened and parsed into a set of lines.  The lines are scaled to
     fit inside the rectangle defined by the model's current size.
 
+    - bitmap_rects <int>\n if 1, the dark pixels of the bitmap are
+    instead covered with axis-aligned rectangles, found by greedily
+    merging runs of dark pixels, one block per rectangle. Every block
+    is then a simple 4-vertex box. Maps drawn with thick, straight
+    walls give few rectangles; diagonal and curved walls give one
+    rectangle per pixel step, so compare the counts printed by
+    worlds/benchmark/mapload.world before relying on it. Defaults to 0.
+
+    - bitmap_cells <int>\n if 1, no polygons are made from the bitmap.
+    Instead the model gets a single map block, and the dark pixels are
+    written straight into the world's occupancy cells, resampled from
+    the image's resolution to the world's. Unlike traced outlines,
+    this fills the inside of walls and obstacles, so rays and robots
+    started inside them collide too. Rendering is a pass over the
+    pixels, so it is fastest when the image resolution is close to
+    the world's; a model that moves has to repeat it. Overrides
+    bitmap_rects. Defaults to 0.
+
+    - bitmap_cache <int>\n if 1, the blocks made from the bitmap are
+    saved in a binary cache file next to it, named after the bitmap
+    and the method used, e.g. "hospital.png.outlines.cache". Later
+    loads read the cache file instead of decoding the image, for as
+    long as the image's contents are unchanged. The cache is skipped,
+    with a warning, if the directory can't be written. Defaults to 0.
+
     - ctrl <string>\n Specify the controller module for the model, and
     its argument string. For example, the string "foo bar bash" will
     load libfoo.so, which will have its Init() function called with
@@ -292,6 +320,9 @@ Model::Model( World* world,
 {
   assert( world );
   
+  // nothing rendered yet
+  bbox_empty[0] = bbox_empty[1] = true;
+
   PRINT_DEBUG3( "Constructing model world: %s parent: %s type: %s \n",
 		world->Token(), 
 		parent ? parent->Token() : "(null)",
@@ -569,6 +600,18 @@ void Model::MapWithChildren( unsigned int layer )
     (*it)->MapWithChildren(layer);
 }
 
+bool Model::RemapWithChildren( unsigned int layer )
+{
+  map_pose[layer] = pose;
+  bool moved( blockgroup.Remap( layer ) );
+  
+  FOR_EACH( it, children )
+    if( (*it)->RemapWithChildren( layer ) )
+      moved = true;
+  
+  return moved;
+}
+
 void Model::MapFromRoot( unsigned int layer )
 {
   Root()->MapWithChildren(layer);
@@ -722,8 +765,24 @@ void Model::AddToPose( const Pose& pose )
 void Model::PlaceInFreeSpace( meters_t xmin, meters_t xmax, 
 			      meters_t ymin, meters_t ymax )
 {
-  while( TestCollision() )
-    SetPose( Pose::Random( xmin,xmax, ymin, ymax ));		
+  // in open space a few random guesses are cheaper than building
+  // the free-space index
+  for( int i(0); i<32; ++i )
+    {
+      if( TestCollision() == NULL )
+	return;
+      
+      const Pose gpose( GetGlobalPose() );
+      const Pose guess( Pose::Random( xmin, xmax, ymin, ymax ) );
+      SetGlobalPose( Pose( guess.x, guess.y, gpose.z, guess.a ));
+    }
+  
+  if( TestCollision() == NULL )
+    return;
+  
+  if( world->PlaceInFreeSpace( std::vector<Model*>( 1, this ), 
+			       xmin, xmax, ymin, ymax ) == 0 )
+    PRINT_WARN1( "no free space found for model %s", token.c_str() );
 }
 
 void Model::AppendTouchingModels( std::set<Model*>& touchers )
@@ -748,6 +807,92 @@ Model* Model::TestCollision()
   return hitmod;  
 }  
 
+// z component of the cross product of (a-o) and (b-o)
+static inline int64_t cross( const point_int_t& o, const point_int_t& a, const point_int_t& b )
+{
+  return( (int64_t)(a.x - o.x) * (b.y - o.y) - (int64_t)(a.y - o.y) * (b.x - o.x) );
+}
+
+// replace pts with their convex hull, using Andrew's monotone chain
+static void convex_hull( std::vector<point_int_t>& pts )
+{
+  std::sort( pts.begin(), pts.end() );
+  pts.erase( std::unique( pts.begin(), pts.end() ), pts.end() );
+  
+  if( pts.size() < 3 )
+    return;
+  
+  std::vector<point_int_t> hull( 2 * pts.size() );
+  size_t k(0);
+  
+  // lower hull, then upper hull
+  for( size_t i(0); i<pts.size(); ++i )
+    {
+      while( k >= 2 && cross( hull[k-2], hull[k-1], pts[i] ) <= 0 ) --k;
+      hull[k++] = pts[i];
+    }
+  
+  for( size_t i(pts.size()-1), t(k+1); i>0; --i )
+    {
+      while( k >= t && cross( hull[k-2], hull[k-1], pts[i-1] ) <= 0 ) --k;
+      hull[k++] = pts[i-1];
+    }
+  
+  hull.resize( k-1 ); // the last point repeats the first
+  pts.swap( hull );
+}
+
+void Model::AppendFootprints( std::vector<const Block*>& blocks,
+			      std::vector<std::vector<point_int_t> >& pixels,
+			      size_t& index ) const
+{
+  FOR_EACH( it, blockgroup.blocks )
+    {
+      if( index == blocks.size() )
+	{
+	  blocks.push_back( &(*it) );
+	  pixels.push_back( std::vector<point_int_t>() );
+	}
+      
+      const std::vector<point_int_t> pts( LocalToPixels( it->pts ) );
+      pixels[index].insert( pixels[index].end(), pts.begin(), pts.end() );
+      ++index;
+    }
+  
+  FOR_EACH( it, children )
+    (*it)->AppendFootprints( blocks, pixels, index );
+}
+
+Model* Model::TestSweptCollision( const Pose& from, const Pose& to, unsigned int layer )
+{
+  std::vector<const Block*> blocks;
+  std::vector<std::vector<point_int_t> > pixels;
+  
+  // collect the footprint of every block at both ends of the move
+  const Pose savedpose( pose );
+  size_t index(0);
+  pose = from;
+  AppendFootprints( blocks, pixels, index );
+  index = 0;
+  pose = to;
+  AppendFootprints( blocks, pixels, index );
+  pose = savedpose;
+  
+  for( size_t i(0); i<blocks.size(); ++i )
+    {
+      if( ! blocks[i]->group->mod.vis.obstacle_return )
+	continue;
+      
+      convex_hull( pixels[i] );
+      
+      Model* hitmod( world->TestPolyCollision( pixels[i], blocks[i], layer ) );
+      if( hitmod )
+	return hitmod;
+    }
+  
+  return NULL;
+}
+
 void Model::UpdateCharge()
 {  
   PowerPack* mypp = FindPowerPack();
@@ -887,6 +1032,7 @@ kg_t Model::GetMassOfChildren() const
 // render all blocks in the group at my global pose and size
 void Model::Map( unsigned int layer )
 {
+  map_pose[layer] = pose;
   blockgroup.Map( layer );
 } 
 
@@ -1205,11 +1351,13 @@ void Model::SetStall( bool val )
 void Model::SetGripperReturn( bool val )
 {
   vis.gripper_return = val;
+  ++world->vis_epoch; // sensors may see us differently
 }
 
 void Model::SetFiducialReturn(  int val )
 {
   vis.fiducial_return = val;
+  ++world->vis_epoch; // sensors may see us differently
   
   // non-zero values mean we need to be in the world's set of
   // detectable models
@@ -1227,16 +1375,19 @@ void Model::SetFiducialKey( int val )
 void Model::SetObstacleReturn( bool val )
 {
   vis.obstacle_return = val;
+  ++world->vis_epoch; // sensors may see us differently
 }
 
 void Model::SetBlobReturn( bool val )
 {
   vis.blob_return = val;
+  ++world->vis_epoch; // sensors may see us differently
 }
 
 void Model::SetRangerReturn( double val )
 {
   vis.ranger_return = val;
+  ++world->vis_epoch; // sensors may see us differently
 }
 
 void Model::SetBoundary( bool val )
@@ -1469,7 +1620,9 @@ void Model::Load()
 	  has_default_block = false;
 	}
 		
-      blockgroup.LoadBitmap( bitmapfile, wf );
+      blockgroup.LoadBitmap( bitmapfile, wf,
+			     BlockGroup::ReadBitmapMode( wf, wf_entity ),
+			     wf->ReadInt( wf_entity, "bitmap_cache", 0 ) );
     }
   
   if( wf->PropertyExists( wf_entity, "boundary" ))
@@ -1603,12 +1756,65 @@ void Model::Save( void )
   PRINT_DEBUG1( "Model \"%s\" saving complete.", token.c_str() );
 }
 
+void Model::SaveState( std::string& buf ) const
+{
+  snapshot_put( buf, last_update );
+  snapshot_put( buf, stall );
+  snapshot_put( buf, disabled );
+  snapshot_put( buf, data_fresh );
+  
+  if( power_pack )
+    power_pack->SaveState( buf );
+  
+  snapshot_put( buf, (uint32_t)pps_charging.size() );
+  FOR_EACH( it, pps_charging )
+    snapshot_put( buf, *it );
+}
+
+bool Model::LoadState( const uint8_t*& pos, const uint8_t* end )
+{
+  uint32_t charging( 0 );
+  if( ! ( snapshot_get( pos, end, last_update ) &&
+	  snapshot_get( pos, end, stall ) &&
+	  snapshot_get( pos, end, disabled ) &&
+	  snapshot_get( pos, end, data_fresh ) ) )
+    return false;
+  
+  if( power_pack && ! power_pack->LoadState( pos, end ) )
+    return false;
+  
+  if( ! snapshot_get( pos, end, charging ) )
+    return false;
+  
+  pps_charging.clear();
+  while( charging-- )
+    {
+      PowerPack* pp( NULL );
+      if( ! snapshot_get( pos, end, pp ) )
+	return false;
+      pps_charging.push_back( pp );
+    }
+  
+  return true;
+}
+
 
 void Model::LoadControllerModule( const char* lib )
 {
   //printf( "[Ctrl \"%s\"", lib );
   //fflush(stdout);
 
+  // the library name is the first word in the string
+  char libname[256];
+  sscanf( lib, "%s %*s", libname );
+
+  std::map<std::string,model_callback_t>::iterator it = world->ctrl_initfuncs.find( libname );
+  if( it != world->ctrl_initfuncs.end() )
+    {
+      AddCallback( CB_INIT, it->second, new CtrlArgs(lib,World::ctrlargs) );
+      return;
+    }
+
   /* Initialise libltdl. */
   int errors = lt_dlinit();
   if (errors)
@@ -1632,10 +1838,6 @@ void Model::LoadControllerModule( const char* lib )
 
   lt_dlhandle handle = NULL;
   
-  // the library name is the first word in the string
-  char libname[256];
-  sscanf( lib, "%s %*s", libname );
-  
   if(( handle = lt_dlopenext( libname ) ))
     {
       //printf( "]" );
@@ -1650,6 +1852,7 @@ void Model::LoadControllerModule( const char* lib )
 	  exit(-1);
 	}
 		
+      world->ctrl_initfuncs[libname] = initfunc;
       AddCallback( CB_INIT, initfunc, new CtrlArgs(lib,World::ctrlargs) ); // pass complete string into initfunc
     }
   else
@@ -14,6 +14,7 @@
 //#define DEBUG 
 
 #include <sys/time.h>
+#include <algorithm>
 
 #include "stage.hh"
 #include "option.hh"
@@ -58,6 +59,8 @@ static const unsigned int DEFAULT_BLOBFINDERSCANHEIGHT = 60;
    range 12.0
    fov 3.14159/3.0
    pan 0.0
+   ranger -1
+   lazy 0
 
    # model properties
    size [ 0.0 0.0 0.0 ]
@@ -75,6 +78,26 @@ static const unsigned int DEFAULT_BLOBFINDERSCANHEIGHT = 60;
    dimensions of the image in pixels. This determines the blobfinder's resolution
    - range <float>\n
    maximum range of the sensor in meters.
+   - fov <float>\n
+   horizontal field of view, centred on pan.
+   - pan <float>\n
+   direction of the center of view, relative to the blobfinder's heading.
+   - ranger <int>\n
+   if non-negative, the index of a sensor on a ranger model with the
+   same parent as this blobfinder. Instead of tracing its own rays,
+   the blobfinder then finds blobs along that sensor's beams, which
+   the ranger traces for both of them in one pass. The image width,
+   fov and pan are taken from the sensor, and the data may be one
+   ranger update old. Colors are matched to 8 bits per channel.
+   - lazy <int>\n
+   if 1, an update only records the blobfinder's pose, and the rays
+   are traced from that pose when the blobs are first read with
+   GetBlobs(), e.g. in a controller's update callback, in the
+   occupancy grid as it was when the update came due. Blobs read
+   before the next update moves any model are the same as an eager
+   update would give; read later, they see the world as those moves
+   left it. Updates nobody reads cost nothing. A blobfinder reading a
+   ranger's beams has nothing to defer and ignores this.
 
 */
 
@@ -86,6 +109,10 @@ ModelBlobfinder::ModelBlobfinder( World* world,
   vis( world ),
   blobs(),
   colors(),
+  color_keys(),
+  ranger_sensor( -1 ),
+  ranger( NULL ),
+  lazy(),
   fov( DEFAULT_BLOBFINDERFOV ),
   pan( DEFAULT_BLOBFINDERPAN ),
   range( DEFAULT_BLOBFINDERRANGE ),
@@ -114,27 +141,34 @@ static bool blob_match( Model* candidate,
 }	
 
 
-static bool ColorMatchIgnoreAlpha( Color a, Color b )
+uint32_t ModelBlobfinder::ColorKey( const Color& col )
 {
-  double epsilon = 1e-5; // small
-  return( fabs(a.r - b.r) < epsilon &&
-	  fabs(a.g - b.g) < epsilon &&
-	  fabs(a.b - b.b) < epsilon );
+  return( (uint32_t(col.r * 255.0 + 0.5) << 16) |
+	  (uint32_t(col.g * 255.0 + 0.5) << 8) |
+	  uint32_t(col.b * 255.0 + 0.5) );
+}
+
+void ModelBlobfinder::UpdateColorKeys()
+{
+  color_keys.clear();
+
+  FOR_EACH( it, colors )
+    color_keys.push_back( ColorKey( *it ) );
+
+  std::sort( color_keys.begin(), color_keys.end() );
 }
 
 void ModelBlobfinder::ModelBlobfinder::AddColor( Color col )
 {
   colors.push_back( col );
+  UpdateColorKeys();
 }
 
 /** Stop tracking blobs with this color */
 void ModelBlobfinder::RemoveColor( Color col )
 {
-  FOR_EACH( it, colors )
-    {
-      if( (*it) ==  col  )
-	it = colors.erase(it);
-    }
+  colors.erase( std::remove( colors.begin(), colors.end(), col ), colors.end() );
+  UpdateColorKeys();
 }
 
 /** Stop tracking all colors. Call this to clear the defaults, then
@@ -142,6 +176,61 @@ void ModelBlobfinder::RemoveColor( Color col )
 void ModelBlobfinder::RemoveAllColors()
 {
   colors.clear();
+  color_keys.clear();
+}
+
+bool ModelBlobfinder::AttachRanger()
+{
+  if( parent )
+    FOR_EACH( it, parent->GetChildren() )
+      {
+	ModelRanger* rgr( dynamic_cast<ModelRanger*>( *it ) );
+	
+	if( rgr == NULL )
+	  continue;
+	
+	std::vector<ModelRanger::Sensor>& sensors( rgr->GetSensorsMutable() );
+
+	if( ranger_sensor >= (int)sensors.size() )
+	  {
+	    PRINT_WARN3( "blobfinder %s: ranger %s has no sensor %d",
+			 Token(), rgr->Token(), ranger_sensor );
+	    break;
+	  }
+
+	ModelRanger::Sensor& sensor( sensors[ranger_sensor] );
+	sensor.blob_range = std::max( sensor.blob_range, range );
+	++sensor.blob_subs;
+
+	// our image is made of the sensor's beams
+	scan_width = sensor.sample_count;
+	fov = sensor.fov;
+	pan = sensor.pose.a;
+
+	ranger = rgr;
+	ranger->Subscribe();
+	return true;
+      }
+  
+  PRINT_WARN1( "blobfinder %s: no ranger to share, tracing our own rays", Token() );
+  ranger_sensor = -1;
+  return false;
+}
+
+void ModelBlobfinder::DetachRanger()
+{
+  if( ranger == NULL )
+    return;
+  
+  ModelRanger::Sensor& sensor( ranger->GetSensorsMutable()[ranger_sensor] );
+  if( --sensor.blob_subs == 0 )
+    {
+      sensor.blob_range = 0;
+      sensor.blob_hits.clear();
+    }
+  
+  ranger->Unsubscribe();
+  ranger = NULL;
 }
 
 void ModelBlobfinder::Load( void )
@@ -155,6 +244,8 @@ void ModelBlobfinder::Load( void )
   range = wf->ReadFloat( wf_entity, "range", range );
   fov = wf->ReadAngle( wf_entity, "fov", fov );
   pan = wf->ReadAngle( wf_entity, "pan", pan );
+  ranger_sensor = wf->ReadInt( wf_entity, "ranger", ranger_sensor );
+  lazy.enabled = wf->ReadInt( wf_entity, "lazy", lazy.enabled );
   
   if( wf->PropertyExists( wf_entity, "colors" ) )
     {
@@ -178,10 +269,41 @@ void ModelBlobfinder::Load( void )
 
 void ModelBlobfinder::Update( void )
 {     
-  // generate a scan for post-processing into a blob image
-  std::vector<RaytraceResult> samples(scan_width);
+  // a ranger's beams are read now, as they will be replaced in its
+  // next update
+  const bool shared( ranger_sensor >= 0 && ( ranger || AttachRanger() ) );
+
+  if( ! lazy.Defer( GetGlobalPose(), (world->GetUpdateCount()+1) % 2, ! shared ) )
+    Detect( lazy.pose, -1 );
+
+  Model::Update();
+}
+
+void ModelBlobfinder::Detect( const Pose& gpose, int layer )
+{
+  // generate a scan for post-processing into a blob image, or use the
+  // one our ranger made for us
+  std::vector<RaytraceResult> own;
+  const std::vector<RaytraceResult>* scan( &own );
   
-  Raytrace( Pose(0,0,0,pan), range, fov, blob_match, NULL, false, samples );
+  if( ranger_sensor >= 0 && ranger )
+    scan = &ranger->GetSensors()[ranger_sensor].blob_hits;
+  else
+    {
+      // as Model::Raytrace(), but from our pose gpose
+      own.resize( scan_width );
+      world->Raytrace( (gpose + geom.pose) + Pose(0,0,0,pan), range, fov, 
+		       blob_match, this, NULL, false, own, layer );
+    }
+  
+  const std::vector<RaytraceResult>& samples( *scan );
+  const unsigned int width( samples.size() );
+
+  // pack the sample colors once, so that matching is integer compares
+  std::vector<uint32_t> keys( width );
+  for( unsigned int s=0; s < width; s++ )
+    if( samples[s].mod )
+      keys[s] = ColorKey( samples[s].color );
 
   // now the colors and ranges are filled in - time to do blob detection
   double yRadsPerPixel = fov / scan_height;
@@ -189,42 +311,25 @@ void ModelBlobfinder::Update( void )
   blobs.clear();
 
   // scan through the samples looking for color blobs
-  for(unsigned int s=0; s < scan_width; s++ )
+  for(unsigned int s=0; s < width; s++ )
     {
       if( samples[s].mod == NULL  )
 	continue; // we saw nothing
 		 
       unsigned int right = s;
       Color blobcol = samples[s].color;
-		 
-      //printf( "blob start %d color %X\n", blobleft, blobcol );
+      const uint32_t blobkey( keys[s] );
 		 
       // loop until we hit the end of the blob
-      // there has to be a gap of >1 pixel to end a blob
-      // this avoids getting lots of crappy little blobs
-      while( s < scan_width && samples[s].mod && 
-	     ColorMatchIgnoreAlpha( samples[s].color, blobcol) )
-	{
-	  //printf( "%u blobcol %X block %p %s color %X\n", s, blobcol, samples[s].block, samples[s].block->Model()->Token(), samples[s].block->Color() );
-	  s++;
-	}
+      while( s < width && samples[s].mod && keys[s] == blobkey )
+	s++;
 		 
       unsigned int left = s - 1;
 
       //if we have color filters in place, check to see if we're looking for this color
-      if( colors.size() )
-	{
-	  bool found = false;
-
-	  for( unsigned int c=0; c<colors.size(); c++ )
-	    if( ColorMatchIgnoreAlpha( blobcol, colors[c]))
-	      {
-		found = true;
-		break;
-	      }
-	  if( ! found )
-	    continue; // continue scanning array for next blob
-	}
+      if( color_keys.size() && 
+	  ! std::binary_search( color_keys.begin(), color_keys.end(), blobkey ) )
+	continue; // continue scanning array for next blob
 
       //printf( "blob end %d %X\n", blobright, blobcol );
 
@@ -247,9 +352,9 @@ void ModelBlobfinder::Update( void )
       // fill in an array entry for this blob
       Blob blob;
       blob.color = blobcol;
-      blob.left = scan_width - left - 1;
+      blob.left = width - left - 1;
       blob.top = blobtop;
-      blob.right = scan_width - right - 1;;
+      blob.right = width - right - 1;
       blob.bottom = blobbottom;
       blob.range = range;
 
@@ -260,8 +365,6 @@ void ModelBlobfinder::Update( void )
       //g_array_append_val( blobs, blob );
       blobs.push_back( blob );
     }
-
-  Model::Update();
 }
 
 
@@ -283,6 +386,8 @@ void ModelBlobfinder::Shutdown( void )
   // stop consuming power
   SetWatts( 0 );
 
+  DetachRanger();
+
   // clear the data - this will unrender it too
   blobs.clear();
 
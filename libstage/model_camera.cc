@@ -12,6 +12,14 @@
 #define CAMERA_NEAR_CLIP 0.2
 #define CAMERA_FAR_CLIP 8.0
 
+#include "config.h" // for HAVE_GL_PIXEL_BUFFERS
+
+// declare the OpenGL 1.5 buffer object functions, where the GL library
+// exports them
+#ifdef HAVE_GL_PIXEL_BUFFERS
+#define GL_GLEXT_PROTOTYPES 1
+#endif
+
 //#define DEBUG 1
 #include "canvas.hh"
 #include "worldfile.hh"
@@ -48,6 +56,9 @@ camera
   range [ 0.2 8.0 ]
   fov [ 70.0 40.0 ]
   pantilt [ 0.0 0.0 ]
+  renderer "gl"
+  threads 1
+  latency 0
 
   # model properties
   size [ 0.1 0.07 0.05 ]
@@ -67,6 +78,12 @@ camera
   angle, in degrees, for the horizontal and vertical field of view.
 - pantilt [ pan:<float> tilt:<float> ]
   angle, in degrees, where the camera is looking. pan is the left-right positioning, and tilt is the up-down positioning.
+- renderer <string>\n
+  "gl" or "raytrace". "gl" draws the scene with OpenGL in the GUI window, so the image can be no larger than the window. "raytrace" casts a ray for each pixel through the world's occupancy grid instead, which needs no display or GPU. Without a GUI "raytrace" is the default and the only choice.
+- threads <int>\n
+  the number of bands the rows of a raytraced image are split into. The updating thread and any idle worker threads share the bands. Defaults to the world's threads setting.
+- latency <int>\n
+  0 or 1. With the "gl" renderer and latency 1, each update delivers the image rendered at the previous update, so the GPU copies it out while the simulation runs instead of stalling the pipeline. The image then lags the camera pose by one update interval.
 */
 
 //caclulate the corss product, and store results in the first vertex
@@ -100,18 +117,25 @@ ModelCamera::ModelCamera( World* world,
   _camera_colors( NULL ),
   _camera(),
   _yaw_offset( 0.0 ),
-  _pitch_offset( 0.0 )  
+  _pitch_offset( 0.0 ),
+  _raytrace( true ),
+  _threads( world->GetWorkerThreads() ),
+  _latency( 0 ),
+  _pbo( false ),
+  _pbo_checked( false ),
+  _pbo_index( 0 ),
+  _pbo_pending( false )
 {
 	PRINT_DEBUG2( "Constructing ModelCamera %d (%s)\n", 
 			id, typestr );
 
+	// without a GUI world there is no canvas, so we raytrace
 	WorldGui* world_gui = dynamic_cast< WorldGui* >( world );
 	
-	if( world_gui == NULL ) {
-		printf( "Unable to use Camera Model - it must be run with a GUI world\n" );
-		assert( 0 );
+	if( world_gui ) {
+		_canvas = world_gui->GetCanvas();
+		_raytrace = false;
 	}
-	_canvas = world_gui->GetCanvas();
 	
 	_camera.setPitch( 90.0 );
 	
@@ -125,7 +149,8 @@ ModelCamera::ModelCamera( World* world,
 	
 	RegisterOption( &showCameraData );
 
-	Startup();
+	_pbo_depth[0] = _pbo_depth[1] = 0;
+	_pbo_color[0] = _pbo_color[1] = 0;
 }
 
 ModelCamera::~ModelCamera()
@@ -138,6 +163,13 @@ ModelCamera::~ModelCamera()
 		delete[] _camera_quads;
 		delete[] _camera_colors;
 	}
+	
+#ifdef HAVE_GL_PIXEL_BUFFERS
+	if( _pbo_depth[0] ) {
+		glDeleteBuffers( 2, _pbo_depth );
+		glDeleteBuffers( 2, _pbo_color );
+	}
+#endif
 }
 
 void ModelCamera::Load( void )
@@ -158,6 +190,29 @@ void ModelCamera::Load( void )
 	wf->ReadTuple( wf_entity, "pantilt", 0, 2, "ff", &_yaw_offset, &_pitch_offset );
 
 	wf->ReadTuple( wf_entity, "resolution", 0, 2, "ii", &_width, &_height );	
+
+	const std::string renderer = 
+		wf->ReadString( wf_entity, "renderer", _raytrace ? "raytrace" : "gl" );
+	
+	if( renderer == "raytrace" )
+		_raytrace = true;
+	else if( renderer == "gl" ) {
+		if( _canvas == NULL )
+			PRINT_WARN1( "camera %s: renderer \"gl\" needs a GUI. Using \"raytrace\".", token.c_str() );
+		_raytrace = ( _canvas == NULL );
+	}
+	else
+		PRINT_ERR2( "camera %s: invalid renderer specified: \"%s\" - should be one of: \"gl\" or \"raytrace\".", token.c_str(), renderer.c_str() );
+	
+	_threads = wf->ReadInt( wf_entity, "threads", _threads );
+	if( _threads < 1 )
+		_threads = 1;
+	
+	_latency = wf->ReadInt( wf_entity, "latency", _latency );
+	if( _latency < 0 || _latency > 1 ) {
+		PRINT_ERR2( "camera %s: invalid latency %d - should be 0 or 1. Using 1.", token.c_str(), _latency );
+		_latency = 1;
+	}
 }
 
 
@@ -167,6 +222,44 @@ void ModelCamera::Update( void )
 	Model::Update();
 }
 
+/** convert n OpenGL depth buffer values in [0,1] to distances along
+    the optical axis, as PerspectiveCamera::realDistance(). A flat
+    loop that the compiler can vectorize. depth and zbuf may be the
+    same array. */
+static void linearize_depth( GLfloat* depth, const GLfloat* zbuf, int n, 
+									  double near, double far )
+{
+	const GLfloat a = near * far;
+	const GLfloat b = far;
+	const GLfloat c = far - near;
+	
+	for( int i = 0; i < n; i++ )
+		depth[ i ] = a / ( b - zbuf[ i ] * c );
+}
+
+void ModelCamera::ReadPixelBuffers( int index )
+{
+#ifdef HAVE_GL_PIXEL_BUFFERS
+	const int n = _width * _height;
+	
+	glBindBuffer( GL_PIXEL_PACK_BUFFER, _pbo_depth[ index ] );
+	const GLfloat* zbuf = (const GLfloat*)glMapBuffer( GL_PIXEL_PACK_BUFFER, GL_READ_ONLY );
+	if( zbuf ) {
+		linearize_depth( _frame_data, zbuf, n, _camera.nearClip(), _camera.farClip() );
+		glUnmapBuffer( GL_PIXEL_PACK_BUFFER );
+	}
+	
+	glBindBuffer( GL_PIXEL_PACK_BUFFER, _pbo_color[ index ] );
+	const GLubyte* color = (const GLubyte*)glMapBuffer( GL_PIXEL_PACK_BUFFER, GL_READ_ONLY );
+	if( color ) {
+		memcpy( _frame_color_data, color, 4 * n );
+		glUnmapBuffer( GL_PIXEL_PACK_BUFFER );
+	}
+#else
+	(void)index;
+#endif
+}
+
 bool ModelCamera::GetFrame( void )
 {	
 	if( _width == 0 || _height == 0 )
@@ -191,12 +284,51 @@ bool ModelCamera::GetFrame( void )
 		_camera_colors = new GLubyte[ _camera_quads_size ];
 	}
 
+	if( _raytrace ) {
+		GetFrameRaytrace();
+		return true;
+	}
+	
 	//TODO overcome issue when glviewport is set LARGER than the window side
 	//currently it just clips and draws outside areas black - resulting in bad glreadpixel data
-	if( _width > _canvas->w() )
-		_width = _canvas->w();
-	if( _height > _canvas->h() )
-		_height = _canvas->h();
+	if( _width > _canvas->w() || _height > _canvas->h() ) {
+		_width = std::min( _width, _canvas->w() );
+		_height = std::min( _height, _canvas->h() );
+		
+		// a frame waiting in the pixel buffers has the old size
+		_pbo_pending = false;
+	}
+	
+	// pixel buffer objects are core from OpenGL 2.1
+	if( ! _pbo_checked ) {
+		_pbo_checked = true;
+		
+#ifdef HAVE_GL_PIXEL_BUFFERS
+		int major = 0, minor = 0;
+		const char* version = (const char*)glGetString( GL_VERSION );
+		if( version )
+			sscanf( version, "%d.%d", &major, &minor );
+		
+		_pbo = ( major > 2 || ( major == 2 && minor >= 1 ) );
+		
+		if( _pbo ) {
+			glGenBuffers( 2, _pbo_depth );
+			glGenBuffers( 2, _pbo_color );
+			
+			// big enough for any frame: the size only ever shrinks
+			for( int i = 0; i < 2; i++ ) {
+				glBindBuffer( GL_PIXEL_PACK_BUFFER, _pbo_depth[i] );
+				glBufferData( GL_PIXEL_PACK_BUFFER, _width * _height * sizeof(GLfloat), NULL, GL_STREAM_READ );
+				glBindBuffer( GL_PIXEL_PACK_BUFFER, _pbo_color[i] );
+				glBufferData( GL_PIXEL_PACK_BUFFER, _width * _height * 4, NULL, GL_STREAM_READ );
+			}
+			glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+		}
+#endif
+		
+		if( ! _pbo && _latency )
+			PRINT_WARN1( "camera %s: latency needs OpenGL 2.1 pixel buffer objects. Using latency 0.", token.c_str() );
+	}
 	
 	GLint viewport[4];
 	glGetIntegerv(GL_VIEWPORT,viewport);
@@ -216,22 +348,50 @@ bool ModelCamera::GetFrame( void )
 	_canvas->DrawFloor();
 	_canvas->DrawBlocks();
 	
-	//read depth buffer
-	glReadPixels(0, 0, _width, _height,
-					 GL_DEPTH_COMPONENT, //GL_RGB,
-					 GL_FLOAT, //GL_UNSIGNED_BYTE,
-					 _frame_data );
-	//transform length into linear length
-	float* data = ( float* )( _frame_data ); //TODO use static_cast here
-	int buf_size = _width * _height;
-	for( int i = 0; i < buf_size; i++ )
-		data[ i ] = _camera.realDistance( data[ i ] );
-
-	//read color buffer
-	glReadPixels(0, 0, _width, _height,
-				 GL_RGBA,
-				 GL_UNSIGNED_BYTE,
-				 _frame_color_data );		
+#ifdef HAVE_GL_PIXEL_BUFFERS
+	if( _pbo ) {
+		// queue both reads into buffer objects, so neither waits for
+		// the rendering to finish
+		glBindBuffer( GL_PIXEL_PACK_BUFFER, _pbo_depth[ _pbo_index ] );
+		glReadPixels( 0, 0, _width, _height, GL_DEPTH_COMPONENT, GL_FLOAT, 0 );
+		glBindBuffer( GL_PIXEL_PACK_BUFFER, _pbo_color[ _pbo_index ] );
+		glReadPixels( 0, 0, _width, _height, GL_RGBA, GL_UNSIGNED_BYTE, 0 );
+		
+		if( _latency && _pbo_pending ) {
+			// deliver the previous frame, which has had a whole update
+			// interval to arrive, and leave this one in flight
+			ReadPixelBuffers( 1 - _pbo_index );
+			_pbo_index = 1 - _pbo_index;
+		}
+		else {
+			// wait once for this frame
+			ReadPixelBuffers( _pbo_index );
+			if( _latency )
+				_pbo_index = 1 - _pbo_index;
+		}
+		_pbo_pending = ( _latency > 0 );
+		
+		// other code reads pixels into client memory
+		glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+	}
+	else
+#endif
+	{
+		//read depth buffer
+		glReadPixels(0, 0, _width, _height,
+						 GL_DEPTH_COMPONENT, //GL_RGB,
+						 GL_FLOAT, //GL_UNSIGNED_BYTE,
+						 _frame_data );
+		//transform length into linear length
+		linearize_depth( _frame_data, _frame_data, _width * _height, 
+							  _camera.nearClip(), _camera.farClip() );
+		
+		//read color buffer
+		glReadPixels(0, 0, _width, _height,
+					 GL_RGBA,
+					 GL_UNSIGNED_BYTE,
+					 _frame_color_data );		
+	}
 
 
 	glViewport( viewport[0], viewport[1], viewport[2], viewport[3] );
@@ -240,6 +400,197 @@ bool ModelCamera::GetFrame( void )
 	return true;
 }
 
+class ModelCamera::RaytraceFrame
+{
+public:
+	Pose origin; ///< camera position in global coordinates
+	double fx, fy, fz; ///< forward unit vector: the optical axis
+	double rx, ry; ///< right unit vector (horizontal)
+	double ux, uy, uz; ///< up unit vector
+	double tanh, tanv; ///< tangents of the half fields of view
+	double near, far; ///< clipping distances along the optical axis
+	bounds3d_t floor; ///< extent of the floor drawn under the world
+};
+
+class ModelCamera::RowBand
+{
+public:
+	ModelCamera* cam;
+	const RaytraceFrame* frame;
+	int first, last;
+};
+
+void ModelCamera::RaytraceRowsJob( void* arg )
+{
+	RowBand* band = static_cast<RowBand*>( arg );
+	band->cam->RaytraceRows( *band->frame, band->first, band->last );
+}
+
+// the camera sees every block except its own robot's
+static bool camera_match( Model* candidate, Model* finder, const void* dummy )
+{
+	(void)dummy;
+	return( ! finder->IsRelated( candidate ) );
+}
+
+void ModelCamera::GetFrameRaytrace()
+{
+	RaytraceFrame frame;
+	
+	// mount the camera where GetFrame() puts the OpenGL camera
+	const Pose ppose = parent ? parent->GetGlobalPose() : GetGlobalPose();
+	frame.origin = Pose( ppose.x, ppose.y, GetGlobalPose().z, 0 );
+	
+	// pan is clockwise and tilt is downward, in degrees
+	const double heading = ppose.a - dtor( _yaw_offset );
+	const double elevation = - dtor( _pitch_offset );
+	
+	frame.fx = cos( heading ) * cos( elevation );
+	frame.fy = sin( heading ) * cos( elevation );
+	frame.fz = sin( elevation );
+	
+	frame.rx = sin( heading );
+	frame.ry = - cos( heading );
+	
+	frame.ux = - cos( heading ) * sin( elevation );
+	frame.uy = - sin( heading ) * sin( elevation );
+	frame.uz = cos( elevation );
+	
+	frame.tanh = tan( dtor( _camera.horizFov() ) / 2.0 );
+	frame.tanv = tan( dtor( _camera.vertFov() ) / 2.0 );
+	frame.near = _camera.nearClip();
+	frame.far = _camera.farClip();
+	frame.floor = world->GetExtent();
+	
+	const int bands = std::max( 1, std::min( _threads, _height ) );
+	
+	if( bands < 2 ) {
+		RaytraceRows( frame, 0, _height );
+		return;
+	}
+	
+	std::vector<RowBand> band( bands );
+	std::vector<void*> args( bands );
+	
+	for( int b = 0; b < bands; b++ ) {
+		band[b].cam = this;
+		band[b].frame = &frame;
+		band[b].first = b * _height / bands;
+		band[b].last = (b+1) * _height / bands;
+		args[b] = &band[b];
+	}
+	
+	// this thread and any idle worker threads share the bands
+	world->RunJobs( RaytraceRowsJob, args );
+}
+
+void ModelCamera::RaytraceRows( const RaytraceFrame& frame, int first, int last )
+{
+	// the GL clear colour, seen where nothing is drawn
+	static const GLubyte background[4] = { 178, 178, 204, 255 };
+	
+	std::vector<RaytraceHit> hits;
+	
+	for( int i = 0; i < _width; i++ ) {
+		
+		// the horizontal direction of the last ray traced for this column
+		double traced_a = 0;
+		bool traced = false;
+		
+		for( int j = first; j < last; j++ ) {
+			
+			// the direction of the ray through the pixel centre, scaled
+			// so that the ray parameter t is the depth along the optical
+			// axis, as in the OpenGL depth buffer
+			const double u = ( 2.0 * ( i + 0.5 ) / _width - 1.0 ) * frame.tanh;
+			const double v = ( 2.0 * ( j + 0.5 ) / _height - 1.0 ) * frame.tanv;
+			
+			const double dx = frame.fx + u * frame.rx + v * frame.ux;
+			const double dy = frame.fy + u * frame.ry + v * frame.uy;
+			const double dz = frame.fz + v * frame.uz;
+			
+			// horizontal distance travelled per unit of t
+			const double g = hypot( dx, dy );
+			const double a = atan2( dy, dx );
+			
+			// rows of a level camera share their horizontal direction,
+			// so one trace serves the whole column
+			if( ! traced || a != traced_a ) {
+				hits.clear();
+				Pose pose( frame.origin );
+				pose.a = a;
+				world->RaytraceAll( Ray( this, pose, frame.far * g, camera_match, NULL, false ), hits );
+				traced_a = a;
+				traced = true;
+			}
+			
+			double depth = frame.far;
+			const GLubyte* color = background;
+			GLubyte hitcolor[4];
+			
+			// the floor is drawn over the world's extent at z=0
+			if( dz < 0 ) {
+				const double t = - frame.origin.z / dz;
+				const double x = frame.origin.x + t * dx;
+				const double y = frame.origin.y + t * dy;
+				
+				if( t >= frame.near && t < depth &&
+					 x >= frame.floor.x.min && x <= frame.floor.x.max &&
+					 y >= frame.floor.y.min && y <= frame.floor.y.max ) {
+					depth = t;
+					hitcolor[0] = hitcolor[1] = hitcolor[2] = hitcolor[3] = 255;
+					color = hitcolor;
+				}
+			}
+			
+			// the hits are block outlines in order of distance: find the
+			// first one whose height range holds the ray, or whose top or
+			// bottom face the ray crosses before it leaves the block
+			for( size_t k = 0; k < hits.size() && g > 0; k++ ) {
+				const RaytraceHit& hit = hits[k];
+				const double t = hit.range / g;
+				
+				if( t >= depth )
+					break;
+				
+				const double z = frame.origin.z + t * dz;
+				double t_hit = depth;
+				
+				if( z >= hit.z.min && z <= hit.z.max )
+					t_hit = t;
+				else if( ( z > hit.z.max && dz < 0 ) || ( z < hit.z.min && dz > 0 ) ) {
+					const double t_face = 
+						( ( z > hit.z.max ? hit.z.max : hit.z.min ) - frame.origin.z ) / dz;
+					
+					// the face spans the block, up to its far outline
+					for( size_t m = k + 1; m < hits.size(); m++ )
+						if( hits[m].mod == hit.mod && 
+							 hits[m].z.min == hit.z.min && hits[m].z.max == hit.z.max ) {
+							if( hits[m].range / g >= t_face )
+								t_hit = t_face;
+							break;
+						}
+				}
+				
+				if( t_hit >= frame.near && t_hit < depth ) {
+					depth = t_hit;
+					const Color c = hit.mod->GetColor();
+					hitcolor[0] = (GLubyte)( c.r * 255.0 );
+					hitcolor[1] = (GLubyte)( c.g * 255.0 );
+					hitcolor[2] = (GLubyte)( c.b * 255.0 );
+					hitcolor[3] = (GLubyte)( c.a * 255.0 );
+					color = hitcolor;
+				}
+			}
+			
+			// row 0 is the bottom of the image, as from glReadPixels()
+			const int index = i + j * _width;
+			_frame_data[ index ] = depth;
+			memcpy( _frame_color_data + 4 * index, color, 4 );
+		}
+	}
+}
+
 //TODO create lines outlining camera frustrum, then iterate over each depth measurement and create a square
 void ModelCamera::DataVisualize( Camera* cam )
 {		
@@ -43,6 +43,7 @@ fiducial
   range_max_id 5.0
   fov 3.14159
   ignore_zloc 0
+  lazy 0
 
   # model properties
   size [ 0.1 0.1 0.1 ]
@@ -62,12 +63,16 @@ fiducial
 - ignore_zloc <1/0>\n
   default is 0.  When set to 1, the fiducial finder ignores the z component when checking a fiducial.  Using the default behaviour, a short object would not been seen
   by a fiducial finder placed on top of a tall robot.  With this flag set to 1, the fiducial finder will see the shorter robot.   
+- lazy <1/0>\n
+  default is 0. When set to 1, an update only records the finder's pose and the models in range and in view, where they are at the time. The line of sight tests are done when the fiducials are first read with GetFiducials(), e.g. in a controller's update callback, in the occupancy grid as it was when the update came due. Fiducials read before the next update moves any model are the same as without lazy; read later, a model that has since moved may block or clear a line of sight. Updates nobody reads cost only the range tests.
  */
   
   ModelFiducial::ModelFiducial( World* world, 
 										  Model* parent,
 										  const std::string& type ) : 
   Model( world, parent, type ),
+  targets(),
+  lazy(),
   fiducials(),
   max_range_anon( 8.0 ),
   max_range_id( 5.0 ),
@@ -109,7 +114,7 @@ static bool fiducial_raytrace_match( Model* candidate,
 }	
 
 
-void ModelFiducial::AddModelIfVisible( Model* him )  
+void ModelFiducial::AddTargetIfInView( Model* him, const Pose& gp )  
 {
 	//PRINT_DEBUG2( "Fiducial %s is testing model %s", token, him->Token() );
 
@@ -124,7 +129,7 @@ void ModelFiducial::AddModelIfVisible( Model* him )
 		return;
 	}
 
-	Pose mypose = this->GetGlobalPose();
+	Pose mypose = gp;
 
 	// are we within range?
 	Pose hispose = him->GetGlobalPose();
@@ -156,6 +161,22 @@ void ModelFiducial::AddModelIfVisible( Model* him )
 	if( IsRelated( him ) )
 		return;
 
+	Target target;
+	target.mod = him;
+	target.pose = hispose;
+	target.range = range;
+	target.bearing = dtheta;
+	targets.push_back( target );
+}
+
+void ModelFiducial::AddModelIfVisible( const Target& target, const Pose& gp, int layer )
+{
+	Model* him = target.mod;
+	const Pose& mypose = gp;
+	const Pose& hispose = target.pose;
+	const double range = target.range;
+	const double dtheta = target.bearing;
+
 	//PRINT_DEBUG1( "  %s is a candidate. doing ray trace", him->Token());
 
 
@@ -176,11 +197,14 @@ void ModelFiducial::AddModelIfVisible( Model* him )
 
 	//printf( "range %.2f\n", range );
 	
-	RaytraceResult result = Raytrace( Pose(0,0,0,dtheta),
-					  max_range_anon, // TODOscan only as far as the object
-					  fiducial_raytrace_match,
-					  NULL,
-					  true );
+	// as Model::Raytrace(), but from our pose gp
+	RaytraceResult result = world->Raytrace( (gp + geom.pose) + Pose(0,0,0,dtheta),
+						 max_range_anon, // TODOscan only as far as the object
+						 fiducial_raytrace_match,
+						 this,
+						 NULL,
+						 true,
+						 layer );
 	
 	// TODO
 	if( ignore_zloc && result.mod == NULL ) // i.e. we didn't hit anything *else*
@@ -236,9 +260,31 @@ void ModelFiducial::Update( void )
 	if( subs < 1 )
 		return;
 
+	const Pose gp( GetGlobalPose() );
+
+	// the other models move before deferred data is read, so find
+	// where they are now and leave only the line of sight tests
+	FindTargets( gp );
+
+	if( ! lazy.Defer( gp, (world->GetUpdateCount()+1) % 2 ) )
+		Detect( gp, -1 );
+
+	Model::Update();
+}
+
+void ModelFiducial::Detect( const Pose& gp, int layer )
+{
 	// reset the array of detected fiducials
 	fiducials.clear();
 
+	FOR_EACH( it, targets )
+		AddModelIfVisible( *it, gp, layer );
+}
+
+void ModelFiducial::FindTargets( const Pose& gp )
+{
+	targets.clear();
+
 #if( 1 )	
 	// BEGIN EXPERIMENT
 	
@@ -246,7 +292,6 @@ void ModelFiducial::Update( void )
 	// the two different axes
 	
 	double rng = max_range_anon;
-	Pose gp = GetGlobalPose();	
 	Model edge;	// dummy model used to find bounds in the sets
 	
 	edge.pose = Pose( gp.x-rng, gp.y, 0, 0 ); // LEFT
@@ -284,16 +329,14 @@ void ModelFiducial::Update( void )
 			
 	// create sets sorted by x and y position
  	FOR_EACH( it, nearby ) 
- 			AddModelIfVisible( *it );	
+ 			AddTargetIfInView( *it, gp );	
 #else
  	FOR_EACH( it, world->models_with_fiducials )
- 			AddModelIfVisible( *it );	
+ 			AddTargetIfInView( *it, gp );	
 
 #endif
 
 	// find the range of fiducials within range in X
-
-	Model::Update();
 }
 
 void ModelFiducial::Load( void )
@@ -308,6 +351,7 @@ void ModelFiducial::Load( void )
 	max_range_id          = wf->ReadLength( wf_entity, "range_max_id", max_range_id );
 	fov                   = wf->ReadAngle ( wf_entity, "fov",          fov );
   ignore_zloc            = wf->ReadInt  ( wf_entity, "ignore_zloc",  ignore_zloc);
+  lazy.enabled           = wf->ReadInt  ( wf_entity, "lazy",         lazy.enabled );
 }  
 
 
@@ -38,6 +38,11 @@
 
    @par Notes
 
+   The break beams and contacts are traced again only when the
+   gripper has moved, its paddles have moved, or a block has entered
+   or left the part of the occupancy grid under the gripper, so idle
+   grippers cost very little.
+
    @par Details
 
    - autosnatch < 0 or 1>\n
@@ -64,7 +69,8 @@ ModelGripper::ModelGripper( World* world,
 			    const std::string& type ) : 
   Model( world, parent, type ),	 
   cfg(), // configured below
-  cmd( CMD_NOOP )
+  cmd( CMD_NOOP ),
+  beam_cache()
 {
   // set up a gripper-specific config structure
   cfg.paddle_size.x = 0.66; // proportion of body length that is paddles
@@ -182,6 +188,39 @@ void ModelGripper::Save()
   
 }
 
+void ModelGripper::SaveState( std::string& buf ) const
+{
+  Model::SaveState( buf );
+  
+  snapshot_put( buf, cfg );
+  snapshot_put( buf, cmd );
+}
+
+bool ModelGripper::LoadState( const uint8_t*& pos, const uint8_t* end )
+{
+  const config_t old( cfg );
+
+  if( ! ( Model::LoadState( pos, end ) &&
+	  snapshot_get( pos, end, cfg ) &&
+	  snapshot_get( pos, end, cmd ) ) )
+    return false;
+  
+  beam_cache[0].valid = beam_cache[1].valid = false;
+  
+  // move the paddles back, in both layers
+  if( cfg.paddle_position != old.paddle_position ||
+      cfg.lift_position != old.lift_position )
+    {
+      PositionPaddles();
+      
+      const unsigned int layer( (world->GetUpdateCount()+1) % 2 );
+      UnMap( layer );
+      Map( layer );
+    }
+  
+  return true;
+}
+
 void ModelGripper::FixBlocks()
 {
   // get rid of the default cube
@@ -340,6 +379,7 @@ void ModelGripper::Update()
     PositionPaddles();
   
 
+  TraceBeams();
   UpdateBreakBeams();
   UpdateContacts();
   
@@ -359,8 +399,51 @@ static bool gripper_raytrace_match( Model* hit,
   // up and we must still see them.
 }
 
-void ModelGripper::UpdateBreakBeams() 
+void ModelGripper::TraceBeams()
 {
+  // Raytrace() reads the layer rendered in the previous update
+  const unsigned int layer( (world->GetUpdateCount()+1) % 2 );
+  BeamCache& cache( beam_cache[layer] );
+
+  // the beams and contacts lie inside our body, so its bounding box
+  // holds every cell they cross
+  point_t bmin( billion, billion ), bmax( -billion, -billion );
+  for( int c(0); c<4; c++ )
+    {
+      const Pose corner( LocalToGlobal( Pose( (c&1 ? 0.5 : -0.5) * geom.size.x,
+					      (c&2 ? 0.5 : -0.5) * geom.size.y, 0, 0 )));
+      bmin.x = std::min( bmin.x, corner.x );
+      bmin.y = std::min( bmin.y, corner.y );
+      bmax.x = std::max( bmax.x, corner.x );
+      bmax.y = std::max( bmax.y, corner.y );
+    }
+  
+  // grow by a cell to cover the cells the ray walk rounds into
+  const meters_t cell( 1.0 / world->Resolution() );
+  bmin.x -= cell; bmin.y -= cell;
+  bmax.x += cell; bmax.y += cell;
+  
+  const uint64_t epoch( world->OccupancyEpoch( layer, bmin, bmax ) );
+  const Pose gpose( GetGlobalPose() );
+
+  // if nothing the traces depend on has changed, they would find
+  // exactly what they found last time
+  if( cache.valid &&
+      cache.epoch == epoch &&
+      cache.pose == gpose &&
+      cache.geom.pose == geom.pose &&
+      cache.geom.size.x == geom.size.x &&
+      cache.geom.size.y == geom.size.y &&
+      cache.geom.size.z == geom.size.z &&
+      cache.paddle_position == cfg.paddle_position )
+    {
+      cfg.beam[0] = cache.beam[0];
+      cfg.beam[1] = cache.beam[1];
+      cfg.contact[0] = cache.contact[0];
+      cfg.contact[1] = cache.contact[1];
+      return;
+    }
+
   for( unsigned int index=0; index < 2; index++ )
     {  
       Pose pz;
@@ -386,20 +469,6 @@ void ModelGripper::UpdateBreakBeams()
       cfg.beam[index] = Raytrace( pz, bbr, gripper_raytrace_match, NULL, true ).mod;
     }
 
-  // autosnatch grabs anything that breaks the inner beam
-  if( cfg.autosnatch )
-    {
-      if( cfg.beam[0] || cfg.beam[1] )
-	cmd = CMD_CLOSE;
-      else
-	cmd = CMD_OPEN;
-    }
-}
-
-void ModelGripper::UpdateContacts()
-{
-  cfg.paddles_stalled = false; // may be changed below
-
   Pose lpz, rpz;
   
   // x location of contact sensor origin  
@@ -429,7 +498,34 @@ void ModelGripper::UpdateContacts()
   
   cfg.contact[0] = Raytrace( lpz, bbr, gripper_raytrace_match, NULL, true ).mod;
   cfg.contact[1] = Raytrace( rpz, bbr, gripper_raytrace_match, NULL, true ).mod;
-  
+
+  cache.valid = true;
+  cache.epoch = epoch;
+  cache.pose = gpose;
+  cache.geom = geom;
+  cache.paddle_position = cfg.paddle_position;
+  cache.beam[0] = cfg.beam[0];
+  cache.beam[1] = cfg.beam[1];
+  cache.contact[0] = cfg.contact[0];
+  cache.contact[1] = cfg.contact[1];
+}
+
+void ModelGripper::UpdateBreakBeams() 
+{
+  // autosnatch grabs anything that breaks the inner beam
+  if( cfg.autosnatch )
+    {
+      if( cfg.beam[0] || cfg.beam[1] )
+	cmd = CMD_CLOSE;
+      else
+	cmd = CMD_OPEN;
+    }
+}
+
+void ModelGripper::UpdateContacts()
+{
+  cfg.paddles_stalled = false; // may be changed below
+
   if( cfg.contact[0] || cfg.contact[1] )
     {
       cfg.paddles_stalled = true;;
@@ -52,6 +52,8 @@ using namespace Stg;
     # only used if drive is set to "car"
     wheelbase 1.0
 
+    swept_collision 0
+
     # [ xmin xmax ymin ymax zmin zmax amin amax ]				
     velocity_bounds [-1 1 -1 1 -1 1 -90 90 ]					
     acceleration_bounds [-1 1 -1 1 -1 1 -90 90]
@@ -78,6 +80,8 @@ using namespace Stg;
     - set the origin of the localization coordinate system. By default, this is copied from the model's initial pose, so the robot reports its position relative to the place it started out. Tip: If localization_origin is set to [0 0 0 0] and localization is "gps", the model will return its true global position. This is unrealistic, but useful if you want to abstract away the details of localization. Be prepared to justify the use of this mode in your research! 
     - odom_error [x y z theta]
     - parameters for the odometry error model used when specifying localization "odom". Each value is the maximum proportion of error in intergrating x, y, and theta velocities to compute odometric position estimate. For each axis, if the the value specified here is E, the actual proportion is chosen at startup at random in the range -E/2 to +E/2. Note that due to rounding errors, setting these values to zero does NOT give you perfect localization - for that you need to choose localization "gps".
+    - swept_collision <int>\n
+    If non-zero, each move is checked for collisions along its whole path, not just at its end pose, so fast robots can not tunnel through thin obstacles when the simulation interval is large. If the path is obstructed the move is repeated in steps of one bitmap cell and the robot stops at the first contact. Costs an extra trace per move, and the steps only when something is close.
     - velocity [ x:<float> y:<float> z:<float> heading:<float>
     - velocity_bounds [ xmin xmax ymin ymax zmin zmax amin amax ] x,y,z in meters per second, a in degrees per second
     - wheelbase <float,meters>
@@ -110,6 +114,7 @@ ModelPosition::ModelPosition( World* world,
 		     drand48() * INTEGRATION_ERROR_MAX_Z - INTEGRATION_ERROR_MAX_Z/2.0,
 		     drand48() * INTEGRATION_ERROR_MAX_A - INTEGRATION_ERROR_MAX_A/2.0 ),
   wheelbase( 1.0 ),
+  swept_collision( false ),
   acceleration_bounds(),
   velocity_bounds(),
   //public
@@ -216,6 +221,9 @@ void ModelPosition::Load( void )
   
   // choose a wheelbase
   this->wheelbase = wf->ReadLength( wf_entity, "wheelbase", this->wheelbase );
+
+  this->swept_collision = 
+    wf->ReadInt( wf_entity, "swept_collision", this->swept_collision );
     
   // load odometry if specified
   if( wf->PropertyExists( wf_entity, "odom" ) )
@@ -290,6 +298,29 @@ void ModelPosition::Load( void )
 		 &velocity_bounds[3].max );
 }
 
+void ModelPosition::SaveState( std::string& buf ) const
+{
+  Model::SaveState( buf );
+
+  snapshot_put( buf, velocity );
+  snapshot_put( buf, goal );
+  snapshot_put( buf, control_mode );
+  snapshot_put( buf, est_pose );
+  snapshot_put( buf, est_pose_error );
+  snapshot_put( buf, est_origin );
+}
+
+bool ModelPosition::LoadState( const uint8_t*& pos, const uint8_t* end )
+{
+  return( Model::LoadState( pos, end ) &&
+	  snapshot_get( pos, end, velocity ) &&
+	  snapshot_get( pos, end, goal ) &&
+	  snapshot_get( pos, end, control_mode ) &&
+	  snapshot_get( pos, end, est_pose ) &&
+	  snapshot_get( pos, end, est_pose_error ) &&
+	  snapshot_get( pos, end, est_origin ) );
+}
+
 void ModelPosition::Update( void  )
 { 
   PRINT_DEBUG1( "[%lu] position update", this->world->sim_time );
@@ -589,33 +620,78 @@ void ModelPosition::Move( void )
   // the pose we're trying to achieve (unless something stops us)
   const Pose newpose( pose + dp );
   
+  // stash the original pose in case we need to creep up on an obstacle
+  const Pose startpose( pose );
+  
+  const unsigned int layer( world->UpdateCount()%2 );
+
+  // if anything lies along our path, creep up on it
+  if( swept_collision && TestSweptCollision( startpose, newpose, layer ) )
+    {
+      MoveInSteps( startpose, dp, layer );
+      return;
+    }
+
+  if( TryMove( newpose, layer ) )
+    SetStall(false);
+  else if( swept_collision ) // an obstacle inside our swept hull was missed by its outline
+    MoveInSteps( startpose, dp, layer );
+  else // crunch!
+    SetStall(true);
+}
+
+bool ModelPosition::TryMove( const Pose& newpose, unsigned int layer )
+{
   // stash the original pose so we can put things back if we hit
   const Pose startpose( pose );
   
   pose = newpose; // do the move provisionally - we might undo it below
   
-  const unsigned int layer( world->UpdateCount()%2 );
-    // @todo th
-  UnMapWithChildren( layer ); // remove from all blocks
-  MapWithChildren( layer ); // render into new blocks
+  // blocks that stay on the same cells are not re-rendered, but we
+  // still test them: another model may have moved onto us
+  RemapWithChildren( layer );
   
   if( TestCollision() ) // crunch!
     {
       // put things back the way they were
       // this is expensive, but it happens _very_ rarely for most people
       pose = startpose;
-      UnMapWithChildren( layer );
-      MapWithChildren( layer );
+      RemapWithChildren( layer );
+      return false;
+    }
+  
+  return true;
+}
 
-      SetStall(true);
+void ModelPosition::MoveInSteps( const Pose& start, const Pose& dp, unsigned int layer )
+{
+  // the furthest any of our points moves, in bitmap cells
+  const double reach( hypot( geom.size.x, geom.size.y ) / 2.0 );
+  const double cells( std::max( hypot( dp.x, dp.y ), fabs(dp.a) * reach ) * world->Resolution() );
+  const int steps( std::max( 1, (int)ceil( cells ) ) );
+  
+  // we may have already moved to the end pose and failed
+  if( pose != start )
+    {
+      pose = start;
+      RemapWithChildren( layer );
     }
-  else
+  
+  for( int i=1; i<=steps; ++i )
     {
-      SetStall(false);
+      const double f( (double)i / (double)steps );
+      
+      // stop at the last good step
+      if( ! TryMove( start + Pose( dp.x * f, dp.y * f, dp.z * f, dp.a * f ), layer ) )
+	{
+	  SetStall(true);
+	  return;
+	}
     }
+  
+  SetStall(false);
 }
 
-
 void ModelPosition::Startup( void )
 {
   world->active_velocity.insert( this );
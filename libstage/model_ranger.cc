@@ -32,8 +32,20 @@
    size [  x y z ]
    fov a
    range [min max]
+   samples 1
+   channels 1
+   vfov [ -15 15 ]
+   chunk_size 256
+   noise_range 0
+   noise_proportional 0
+   noise_dropout 0
+   noise_maxrange 0
+   noise_bearing 0
    )
 
+   noise_seed 0
+   lazy 0
+
    # generic model properties with non-default values
    watts 2.0
    color_rgba [ 0 1 0 0.15 ]
@@ -59,6 +71,55 @@
    - minimum range and maximum range in meters, field of view angle in degrees. Currently fov has no effect on the sensor model, other than being shown in the confgiuration graphic for the ranger device.
    - sview[\<transducer index\>] [float float float]
    - per-transducer version of the sview property. Overrides the common setting.
+   - samples <int>\n
+   the number of beams spread evenly over the sensor's fov.
+   - channels <int>\n
+   the number of vertical channels in each beam. With more than one
+   (e.g. 16, 32 or 64), the sensor is a multi-layer 3D lidar whose
+   channels are spread evenly over vfov. All the channels of a beam
+   are found in a single walk through the occupancy grid, by
+   comparing each channel's height with the z extent of the blocks
+   met. Descending channels can hit the ground. The hit points are in
+   Stg::ModelRanger::Sensor::points, and the ranges of the channel
+   nearest the horizontal are reported as for a planar sensor.
+   - vfov [ min:<float> max:<float> ]\n
+   elevation of the lowest and highest channels, in degrees.
+   - chunk_size <int>\n
+   sensors with at least twice this many beams are split into chunks
+   of at least this many beams, which are traced in parallel by the
+   updating thread and any idle worker threads. The results are the
+   same as for a single trace. 0 disables splitting.
+   - noise_range <float>\n
+   standard deviation in meters of Gaussian noise added to each range.
+   - noise_proportional <float>\n
+   standard deviation of Gaussian range noise as a fraction of the
+   range. Combined with noise_range as the root of the sum of squares.
+   Results are clipped to [0, range max]. For a multi-layer sensor
+   each point is also moved along its beam by its own draw.
+   - noise_dropout <float>\n
+   probability that a beam gives no return, reported as range 0 and
+   intensity 0.
+   - noise_maxrange <float>\n
+   probability that a beam reports the maximum range, with intensity 0.
+   - noise_bearing <float>\n
+   standard deviation in degrees of Gaussian jitter in each beam's
+   heading. The beam is traced at the jittered heading but reports its
+   nominal bearing.
+   - noise_seed <int>\n
+   seed for the ranger's random number stream, shared by all its
+   sensors. 0, the default, picks a different seed each run. The noise
+   is generated inside the ranger's own update, on the thread that
+   updates it, so noisy rangers need no controller callback.
+   - lazy <int>\n
+   if 1, an update that comes due only records the ranger's pose, and
+   the beams are traced from that pose when the data is first read
+   with GetSensors(), e.g. in a controller's update callback. The
+   beams are traced in the occupancy grid as it was when the update
+   came due, so data read before the next update moves any model,
+   noise included, is the same as an eager update would give. Data
+   first read later sees the world as those moves left it. Scans
+   nobody reads are never traced. Sensors whose beams a blobfinder
+   reads are always traced eagerly.
 
 */
 
@@ -88,7 +149,9 @@ ModelRanger::ModelRanger( World* world,
 			  Model* parent,
 			  const std::string& type ) 
   : Model( world, parent, type ),
-    vis( world ) 
+    vis( world ),
+    sensors(),
+    rng()
 {
   PRINT_DEBUG2( "Constructing ModelRanger %d (%s)\n", 
 		id, type );
@@ -129,6 +192,79 @@ void ModelRanger::Shutdown( void )
 }
 
 
+void ModelRanger::Load( void )
+{
+  Model::Load();
+
+  const int seed( wf->ReadInt( wf_entity, "noise_seed", 0 ));
+  if( seed )
+    rng.Seed( seed );
+
+  lazy.enabled = wf->ReadInt( wf_entity, "lazy", lazy.enabled );
+}
+
+// append the samples to a checkpoint buffer, count first
+static void put_samples( std::string& buf, const std::vector<double>& v )
+{
+  snapshot_put( buf, (uint32_t)v.size() );
+  if( v.size() )
+    buf.append( (const char*)&v[0], v.size() * sizeof(double) );
+}
+
+static bool get_samples( const uint8_t*& pos, const uint8_t* end, std::vector<double>& v )
+{
+  uint32_t count( 0 );
+  if( ! snapshot_get( pos, end, count ) ||
+      (size_t)(end - pos) / sizeof(double) < count )
+    return false;
+  
+  v.resize( count );
+  if( count )
+    memcpy( &v[0], pos, count * sizeof(double) );
+  pos += count * sizeof(double);
+  return true;
+}
+
+void ModelRanger::SaveState( std::string& buf ) const
+{
+  Model::SaveState( buf );
+
+  snapshot_put( buf, rng );
+  snapshot_put( buf, lazy_rng );
+  snapshot_put( buf, lazy.stale );
+  snapshot_put( buf, lazy.pose );
+  snapshot_put( buf, lazy.layer );
+  snapshot_put( buf, lazy.skipped );
+  snapshot_put( buf, lazy.evaluated );
+
+  // the samples as last traced, which a deferred scan may replace
+  FOR_EACH( it, sensors )
+    {
+      put_samples( buf, it->ranges );
+      put_samples( buf, it->intensities );
+    }
+}
+
+bool ModelRanger::LoadState( const uint8_t*& pos, const uint8_t* end )
+{
+  if( ! ( Model::LoadState( pos, end ) &&
+	  snapshot_get( pos, end, rng ) &&
+	  snapshot_get( pos, end, lazy_rng ) &&
+	  snapshot_get( pos, end, lazy.stale ) &&
+	  snapshot_get( pos, end, lazy.pose ) &&
+	  snapshot_get( pos, end, lazy.layer ) &&
+	  snapshot_get( pos, end, lazy.skipped ) &&
+	  snapshot_get( pos, end, lazy.evaluated ) ) )
+    return false;
+
+  FOR_EACH( it, sensors )
+    if( ! ( get_samples( pos, end, it->ranges ) &&
+	    get_samples( pos, end, it->intensities ) ) )
+      return false;
+
+  return true;
+}
+
 void ModelRanger::LoadSensor( Worldfile* wf, int entity )
 {
   Sensor s;
@@ -144,7 +280,25 @@ void ModelRanger::Sensor::Load( Worldfile* wf, int entity )
   range.Load( wf, entity, "range" );
   fov = wf->ReadAngle( entity, "fov", fov );
   sample_count = wf->ReadInt( entity, "samples", sample_count );	
+  // read as signed, so that a negative count can be caught below
+  const int chans( wf->ReadInt( entity, "channels", channels ) );
+  chunk_size = wf->ReadInt( entity, "chunk_size", chunk_size );
+  wf->ReadTuple( entity, "vfov", 0, 2, "aa", &vfov.min, &vfov.max );
   color.Load( wf, entity );
+
+  noise_range = wf->ReadLength( entity, "noise_range", noise_range );
+  noise_proportional = wf->ReadFloat( entity, "noise_proportional", noise_proportional );
+  noise_dropout = wf->ReadFloat( entity, "noise_dropout", noise_dropout );
+  noise_maxrange = wf->ReadFloat( entity, "noise_maxrange", noise_maxrange );
+  noise_bearing = wf->ReadAngle( entity, "noise_bearing", noise_bearing );
+
+  if( chans < 1 )
+    {
+      PRINT_WARN( "ranger sensor channels set to <1. Forcing to 1" );
+      channels = 1;
+    }
+  else
+    channels = chans;
 }
 
 
@@ -163,22 +317,100 @@ static bool ranger_match( Model* hit,
   return( (!hit->IsRelated( finder )) && (sgn(hit->vis.ranger_return) != -1 ) );
 }	
 
+// the blobfinder's predicate, applied for blobfinders that read our
+// beams. Our blobfinder siblings are related to exactly the same
+// models as we are, so we can stand in as the finder.
+static bool blob_match( Model* hit, 
+			Model* finder,
+			const void* dummy )
+{
+  (void)dummy; // avoid warning about unused var
+
+  return( ! finder->IsRelated( hit ));
+}
+
 void ModelRanger::Update( void )
 {     
-  // raytrace new range data for all sensors
+  // a blobfinder reading our beams uses them in its own update, so
+  // they can't wait to be read
+  bool shared( false );
   FOR_EACH( it, sensors )
-    it->Update( this );
+    if( it->blob_subs )
+      shared = true;
+  
+  if( lazy.Defer( GetGlobalPose(), (world->GetUpdateCount()+1) % 2, ! shared ) )
+    {
+      // leave rng where the scan would have left it
+      lazy_rng = rng;
+      FOR_EACH( it, sensors )
+	rng.Discard( it->NoiseDraws() );
+    }
+  else
+    Scan( lazy.pose, rng, -1 );
   
   Model::Update();
 }
 
+void ModelRanger::Scan( const Pose& gpose, RandomStream& noise, int layer )
+{
+  const Pose origin( gpose + geom.pose );
+
+  // raytrace new range data for all sensors, with noise if they
+  // ask for it
+  FOR_EACH( it, sensors )
+    {
+      if( it->noise_bearing > 0 )
+	{
+	  it->jitter.resize( it->sample_count );
+	  noise.Normals( &it->jitter[0], it->sample_count );
+	  FOR_EACH( jit, it->jitter )
+	    *jit *= it->noise_bearing;
+	}
+      else
+	it->jitter.clear();
+      
+      it->Update( this, origin, layer );
+
+      if( it->Noisy() )
+	it->AddNoise( noise );
+    }
+}
+
+/** A run of beams traced by one job in ModelRanger::Sensor::Update() */
+class BeamChunk
+{
+public:
+  ModelRanger::Sensor* sensor;
+  ModelRanger* mod;
+  Pose origin; ///< global origin and heading of the first beam
+  size_t first, last; ///< the range of beams [first,last)
+  int layer; ///< the layer of the occupancy grid to trace in
+};
+
+static void trace_chunk( void* arg )
+{
+  BeamChunk* chunk( (BeamChunk*)arg );
+  chunk->sensor->TraceBeams( chunk->mod, chunk->origin, chunk->first, chunk->last, chunk->layer );
+}
+
 void ModelRanger::Sensor::Update( ModelRanger* mod )
+{
+  Update( mod, mod->GetGlobalPose() + mod->geom.pose );
+}
+
+void ModelRanger::Sensor::Update( ModelRanger* mod, const Pose& origin, int layer )
 {
   // these sizes change very rarely, so this is very cheap
   ranges.resize( sample_count );
   intensities.resize( sample_count );
   bearings.resize( sample_count );
 
+  if( blob_subs )
+    blob_hits.resize( sample_count );
+
+  if( channels > 1 )
+    points.resize( sample_count * channels );
+
   //printf( "update sensor, has ranges size %u\n", (unsigned int)ranges.size() );
   // make the first and last rays exactly at the extremes of the FOV
   const double sample_incr( fov / std::max(sample_count-1, (unsigned int)1) );
@@ -190,15 +422,104 @@ void ModelRanger::Sensor::Update( ModelRanger* mod )
   Pose rayorg(pose);
   rayorg.a += start_angle;
   rayorg.z += size.z/2.0;
-  rayorg = mod->LocalToGlobal(rayorg);
+  rayorg = origin + rayorg;
+
+  // big scans are split into chunks of at least chunk_size beams,
+  // for the calling thread and idle worker threads to share
+  const size_t count( chunk_size ? 
+		      std::min( sample_count / chunk_size, 
+				mod->world->GetWorkerThreads() + 1 ) : 0 );
   
+  if( count < 2 )
+    {
+      TraceBeams( mod, rayorg, 0, sample_count, layer );
+      return;
+    }
+  
+  std::vector<BeamChunk> chunks( count );
+  std::vector<void*> args( count );
+  
+  for( size_t c(0), t(0); c<count; c++ )
+    {
+      BeamChunk& chunk( chunks[c] );
+      chunk.sensor = this;
+      chunk.mod = mod;
+      chunk.first = c * sample_count / count;
+      chunk.last = (c+1) * sample_count / count;
+      chunk.layer = layer;
+
+      // step the heading one beam at a time, exactly as a single
+      // trace would, so that the results are the same
+      for( ; t < chunk.first; t++ )
+	rayorg.a += sample_incr;
+      chunk.origin = rayorg;
+
+      args[c] = &chunk;
+    }
+
+  mod->world->RunJobs( trace_chunk, args );
+}
+
+void ModelRanger::Sensor::TraceBeams( ModelRanger* mod, const Pose& origin, 
+				      size_t first, size_t last, int layer )
+{
+  const double sample_incr( fov / std::max(sample_count-1, (unsigned int)1) );
+  const double start_angle = (sample_count > 1 ? -fov/2.0 : 0.0);
+
+  if( channels > 1 )
+    {
+      TraceChannels( mod, origin, first, last, layer );
+      return;
+    }
+
   // set up a ray to trace
-  Ray ray( mod, rayorg, range.max, ranger_match, NULL, true );
+  Ray ray( mod, origin, range.max, ranger_match, NULL, true );
+  ray.layer = layer;
+
+  if( blob_subs ) 
+    {
+      // trace for our blobfinders in the same walk through the grid
+      std::vector<Ray> rays( 2, ray );
+      rays[1].range = blob_range;
+      rays[1].func = blob_match;
+      rays[1].ztest = false;
+
+      std::vector<RaytraceResult> res( 2 );
+
+      for( size_t t(first); t<last; t++ )
+	{
+	  if( jitter.empty() )
+	    mod->world->Raytrace( rays, res ); 
+	  else
+	    {
+	      const radians_t a( rays[0].origin.a );
+	      rays[0].origin.a = rays[1].origin.a = a + jitter[t];
+	      mod->world->Raytrace( rays, res ); 
+	      rays[0].origin.a = rays[1].origin.a = a;
+	    }
+	  ranges[t] = res[0].range;
+	  intensities[t] = res[0].mod ? res[0].mod->vis.ranger_return : 0.0;
+	  bearings[t] = start_angle + ((double)t) * sample_incr;
+	  blob_hits[t] = res[1];
+	  
+	  rays[0].origin.a += sample_incr;			
+	  rays[1].origin.a += sample_incr;			
+	}
+      return;
+    }
 
   // trace the ray, incrementing its heading for each sample
-  for( size_t t(0); t<sample_count; t++ )
+  for( size_t t(first); t<last; t++ )
     {
-      const RaytraceResult res = mod->world->Raytrace( ray); 
+      RaytraceResult res;
+      if( jitter.empty() )
+	res = mod->world->Raytrace( ray ); 
+      else
+	{
+	  Ray jittered( ray );
+	  jittered.origin.a += jitter[t];
+	  res = mod->world->Raytrace( jittered ); 
+	}
       ranges[t] = res.range;
       intensities[t] = res.mod ? res.mod->vis.ranger_return : 0.0;
       bearings[t] = start_angle + ((double)t) * sample_incr;
@@ -208,6 +529,204 @@ void ModelRanger::Sensor::Update( ModelRanger* mod )
     }
 }
 
+void ModelRanger::Sensor::TraceChannels( ModelRanger* mod, const Pose& origin, 
+					 size_t first, size_t last, int layer )
+{
+  // the elevation of each channel, and the one nearest the horizontal
+  // that goes in ranges
+  const double elev_incr( (vfov.max - vfov.min) / (channels-1) );
+  std::vector<double> slopes( channels ), cosines( channels ), sines( channels );
+  const unsigned int level( LevelChannel() );
+
+  for( unsigned int k(0); k<channels; ++k )
+    {
+      const double elev( vfov.min + k * elev_incr );
+      slopes[k] = tan( elev );
+      cosines[k] = cos( elev );
+      sines[k] = sin( elev );
+    }
+  
+  const double sample_incr( fov / std::max(sample_count-1, (unsigned int)1) );
+  const double start_angle = (sample_count > 1 ? -fov/2.0 : 0.0);
+
+  // one walk per beam covers the horizontal reach of every channel
+  Ray ray( mod, origin, range.max, ranger_match, NULL, false );
+  ray.layer = layer;
+
+  std::vector<meters_t> dists;
+  std::vector<Model*> hits;
+  
+  for( size_t t(first); t<last; t++ )
+    {
+      if( jitter.empty() )
+	mod->world->RaytraceChannels( ray, slopes, dists, hits );
+      else
+	{
+	  Ray jittered( ray );
+	  jittered.origin.a += jitter[t];
+	  mod->world->RaytraceChannels( jittered, slopes, dists, hits );
+	}
+      
+      const double bearing( start_angle + ((double)t) * sample_incr );
+      const double cosb( cos(bearing) );
+      const double sinb( sin(bearing) );
+      point3_t* pts( &points[t*channels] );
+      
+      for( unsigned int k(0); k<channels; ++k )
+	{
+	  // slant range, limited by the sensor's range
+	  const meters_t r( std::min( dists[k] / cosines[k], range.max ) );
+	  const meters_t d( r * cosines[k] );
+	  
+	  pts[k].x = d * cosb;
+	  pts[k].y = d * sinb;
+	  pts[k].z = r * sines[k];
+	  
+	  if( k == level )
+	    {
+	      ranges[t] = r;
+	      intensities[t] = ( hits[k] && r < range.max ) ? hits[k]->vis.ranger_return : 0.0;
+	      bearings[t] = bearing;
+	    }
+	}
+      
+      ray.origin.a += sample_incr;
+    }
+}
+
+void ModelRanger::Sensor::AddNoise( RandomStream& rng )
+{
+  if( ranges.empty() )
+    return;
+
+  const size_t n( ranges.size() );
+  
+  // the points of a multi-layer sensor, if there are any, and the
+  // elevation of each channel, to put a point back on its ray
+  const size_t m( channels > 1 ? points.size() : 0 );
+  const unsigned int level( LevelChannel() );
+  std::vector<double> cosines, sines;
+  if( m )
+    {
+      const double elev_incr( (vfov.max - vfov.min) / (channels-1) );
+      for( unsigned int k(0); k<channels; ++k )
+	{
+	  cosines.push_back( cos( vfov.min + k * elev_incr ));
+	  sines.push_back( sin( vfov.min + k * elev_incr ));
+	}
+    }
+  
+  if( noise_range > 0 || noise_proportional > 0 )
+    {
+      const double var( noise_range * noise_range );
+      const double pvar( noise_proportional * noise_proportional );
+
+      // a draw per point, or per beam without points; a beam's range
+      // takes the draw of its level channel, so the two still agree
+      std::vector<double> normals( m ? m : n );
+      rng.Normals( &normals[0], normals.size() );
+      
+      for( size_t t(0); t<n; t++ )
+	{
+	  const double z( normals[ m ? t*channels + level : t ] );
+	  const meters_t r( ranges[t] + z * sqrt( var + pvar * ranges[t] * ranges[t] ));
+	  ranges[t] = std::min( std::max( r, 0.0 ), range.max );
+	  
+	  if( m == 0 )
+	    continue;
+	  
+	  // each point is moved along its own ray
+	  const double cosb( cos(bearings[t]) );
+	  const double sinb( sin(bearings[t]) );
+	  point3_t* pts( &points[t*channels] );
+	  
+	  for( unsigned int k(0); k<channels; ++k )
+	    {
+	      meters_t r( ranges[t] );
+	      if( k != level )
+		{
+		  const meters_t d( sqrt( pts[k].x*pts[k].x + pts[k].y*pts[k].y + pts[k].z*pts[k].z ));
+		  r = d + normals[t*channels+k] * sqrt( var + pvar * d * d );
+		  r = std::min( std::max( r, 0.0 ), range.max );
+		}
+	      
+	      pts[k].x = r * cosines[k] * cosb;
+	      pts[k].y = r * cosines[k] * sinb;
+	      pts[k].z = r * sines[k];
+	    }
+	}
+    }
+
+  // one draw per beam decides between a dropout, a max-range return
+  // or neither, for all of the beam's channels
+  if( noise_dropout > 0 || noise_maxrange > 0 )
+    for( size_t t(0); t<n; t++ )
+      {
+	const double u( rng.Uniform() );
+	if( u >= noise_dropout + noise_maxrange )
+	  continue;
+	
+	const meters_t r( u < noise_dropout ? 0.0 : range.max );
+	ranges[t] = r;
+	intensities[t] = 0.0;
+	
+	if( m == 0 )
+	  continue;
+	
+	const double cosb( cos(bearings[t]) );
+	const double sinb( sin(bearings[t]) );
+	point3_t* pts( &points[t*channels] );
+	
+	for( unsigned int k(0); k<channels; ++k )
+	  {
+	    pts[k].x = r * cosines[k] * cosb;
+	    pts[k].y = r * cosines[k] * sinb;
+	    pts[k].z = r * sines[k];
+	  }
+      }
+}
+
+uint64_t ModelRanger::Sensor::NoiseDraws() const
+{
+  // Normals() draws uniforms in pairs
+  const uint64_t n( sample_count );
+  const uint64_t m( channels > 1 ? n * channels : 0 );
+  uint64_t draws( 0 );
+
+  // as drawn by ModelRanger::Scan() and AddNoise()
+  if( noise_bearing > 0 )
+    draws += n + (n & 1);
+
+  if( n == 0 )
+    return draws;
+
+  if( noise_range > 0 || noise_proportional > 0 )
+    {
+      const uint64_t normals( m ? m : n );
+      draws += normals + (normals & 1);
+    }
+
+  if( noise_dropout > 0 || noise_maxrange > 0 )
+    draws += n;
+
+  return draws;
+}
+
+unsigned int ModelRanger::Sensor::LevelChannel() const
+{
+  if( channels < 2 )
+    return 0;
+
+  const double elev_incr( (vfov.max - vfov.min) / (channels-1) );
+  unsigned int level( 0 );
+
+  for( unsigned int k(1); k<channels; ++k )
+    if( fabs( vfov.min + k * elev_incr ) < fabs( vfov.min + level * elev_incr ) )
+      level = k;
+
+  return level;
+}
+
 std::string ModelRanger::Sensor::String() const
 {
   char buf[256];
@@ -353,6 +872,24 @@ void ModelRanger::Sensor::Visualize( ModelRanger::Vis* vis, ModelRanger* rgr ) c
 
       rgr->PopColor();
     }
+
+  if( vis->showStrikes && channels > 1 && points.size() )
+    {
+      // the point cloud of a multi-layer sensor, from the height of
+      // its rays
+      std::vector<GLfloat> cloud( 3 * points.size() );
+      for( size_t i(0); i<points.size(); i++ )
+	{
+	  cloud[3*i+0] = (GLfloat)points[i].x;
+	  cloud[3*i+1] = (GLfloat)points[i].y;
+	  cloud[3*i+2] = (GLfloat)(points[i].z + size.z/2.0);
+	}
+      
+      glVertexPointer( 3, GL_FLOAT, 0, &cloud[0] );       
+      rgr->PushColor( Color::blue );
+      glDrawArrays( GL_POINTS, 0, points.size() );
+      rgr->PopColor();
+    }
   
   glPopMatrix();
 }
@@ -403,7 +940,8 @@ void ModelRanger::Vis::Visualize( Model* mod, Camera* cam )
 
   ModelRanger* ranger( dynamic_cast<ModelRanger*>(mod) );
 
-  const std::vector<Sensor>& sensors( ranger->GetSensors() );    
+  // draw the last scan made, rather than tracing a deferred one
+  const std::vector<Sensor>& sensors( ranger->sensors );
 	
   FOR_EACH( it, sensors )
     it->Visualize( this, ranger );
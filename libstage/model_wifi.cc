@@ -13,140 +13,593 @@
 
 /**
   @ingroup model
-  @defgroup model_wifi Wifi model 
-
-  @todo Fill this in
-
-  <h2>Worldfile properties</h2>
-
-  @todo Fill this in
-
+  @defgroup model_wifi Wifi model
+
+  The wifi model simulates a radio that finds the other radios it can
+  talk to and exchanges messages with them.
+
+  The strength of a signal is the sender's transmit power less the
+  path loss, ref_loss + 10 * exponent * log10( distance ), plus
+  wall_loss for each obstacle the straight line between the two
+  radios passes through. A radio can hear signals at least as strong
+  as its sensitivity. The propagation properties describe the
+  environment: where two radios disagree, the mean of their values is
+  used.
+
+API: Stg::ModelWifi
+
+<h2>Worldfile properties</h2>
+
+@par Summary and default values
+
+@verbatim
+wifi
+(
+  # wifi properties
+  power 15.0
+  sensitivity -80.0
+  ref_loss 40.0
+  exponent 3.0
+  wall_loss 6.0
+  move_threshold 0.1
+)
+@endverbatim
+
+@par Notes
+
+Only radios that could hear each other in free space are considered,
+found with a grid of cells as big as the longest such range, so the
+cost of an update grows with the number of radios nearby rather than
+in the whole world. The loss between two radios, including the
+raytrace that counts the walls between them, is cached and worked out
+again only when one of them has moved further than its move_threshold.
+
+Messages sent with Stg::ModelWifi::Send() during one time step are
+delivered at the start of the next, to every radio (or the one
+addressed) that the sender's signal reaches. Each radio's messages
+are read with Stg::ModelWifi::GetMessages() in its update callback.
+
+@par Details
+
+- power <float>\n
+  transmit power, in dBm.
+- sensitivity <float>\n
+  the weakest signal the radio can receive, in dBm.
+- ref_loss <float>\n
+  path loss at 1 meter, in dB.
+- exponent <float>\n
+  path loss exponent: 2 in free space, 2.5 to 4 indoors.
+- wall_loss <float>\n
+  the extra loss for each obstacle between two radios, in dB.
+- plc, ple, wall_factor <float>\n
+  older names for ref_loss, exponent and wall_loss, still read.
+- move_threshold <float>\n
+  the distance in meters a radio may move before its links are worked
+  out again.
  */
 
+//#define DEBUG 1
 
-#include <sys/time.h>
-#include "gui.h"
+#include "stage.hh"
+#include "worldfile.hh"
+#include "option.hh"
+using namespace Stg;
 
 // Number pulled directly from my ass
-#define STG_WIFI_WATTS 2.5
-
-//#define DEBUG
-
-#include "stage_internal.h"
-
-// defined in model.c
-int _model_update( model_t* mod, void* unused );
-
-// standard callbacks
-extern "C" {
-
-	// declare functions used as callbacks
-	static int wifi_update( model_t* mod, void* unused );
-	static int wifi_startup( model_t* mod, void* unused );
-	static int wifi_shutdown( model_t* mod, void* unused );
-	static int wifi_load( model_t* mod, void* unused );
-
-	// implented by the gui in some other file
-	void gui_wifi_init( model_t* mod );
-
-
-	int 
-		wifi_init( model_t* mod )
-		{
-			// we don't consume any power until subscribed
-			mod->watts = 0.0;
-
-			// override the default methods; these will be called by the simualtion
-			// engine
-			model_add_callback( mod, &mod->startup, wifi_startup, NULL );
-			model_add_callback( mod, &mod->shutdown, wifi_shutdown, NULL );
-			model_add_callback( mod, &mod->load, wifi_load, NULL );
-
-			// sensible wifi defaults; it doesn't take up any physical space
-			Geom geom;
-			geom.pose.x = 0.0;
-			geom.pose.y = 0.0;
-			geom.pose.a = 0.0;
-			geom.size.x = 0.0;
-			geom.size.y = 0.0;
-			model_set_geom( mod, &geom );
-
-			// wifi is invisible
-			model_set_obstacle_return( mod, 0 );
-			model_set_laser_return( mod, LaserTransparent );
-			model_set_blob_return( mod, 0 );
-			model_set_color( mod, (color_t)0 );
-
-			gui_wifi_init(mod);
-
-			return 0;
-		}
-
-	int 
-		wifi_update( model_t* mod, void* unused )
-		{   
-			// no work to do if we're unsubscribed
-			if( mod->subs < 1 )
-				return 0;
-
-			puts("wifi_update");
-
-			// Retrieve current configuration
-			wifi_config_t cfg;
-			memcpy(&cfg, mod->cfg, sizeof(cfg));
-
-			// Retrieve current geometry
-			Geom geom;
-			model_get_geom( mod, &geom );
-
-			// get the sensor's pose in global coords
-			Pose pz;
-			memcpy( &pz, &geom.pose, sizeof(pz) );
-			model_local_to_global( mod, &pz );
-
-
-			// We'll store current data here
-			wifi_data_t data;
-
-			// DO RADIO PROPAGATION HERE, and fill in the data structure
-
-			// publish the new stuff
-			model_set_data( mod, &data, sizeof(data));
-
-			// inherit standard update behaviour
-			_model_update( mod, NULL );
-
-			return 0; //ok
-		}
-
-	int 
-		wifi_startup( model_t* mod, void* unused )
-		{ 
-			PRINT_DEBUG( "wifi startup" );
-			model_add_callback( mod, &mod->startup, wifi_startup, NULL );
-			model_set_watts( mod, STG_WIFI_WATTS );
-			return 0; // ok
-		}
-
-	int 
-		wifi_shutdown( model_t* mod, void* unused )
-		{
-			PRINT_DEBUG( "wifi shutdown" );
-			model_remove_callback( mod, &mod->startup, wifi_startup );
-			model_set_watts( mod, 0 );
-			return 0; // ok
-		}
-
-	int
-		wifi_load( model_t* mod, void* unused )
-		{
-			wifi_config_t cfg;
-
-			// TODO: read wifi params from the world file
-
-			model_set_cfg( mod, &cfg, sizeof(cfg));
-
-			return 0;
-		}
+static const watts_t WIFI_WATTS = 2.5;
+
+Option ModelWifi::showData( "Wifi links", "show_wifi", "", true, NULL );
+
+namespace Stg
+{
+  /** The state shared by all the wifi models in a world: a grid of
+      the radios for finding neighbours, the cache of losses between
+      pairs of radios, and the messages waiting for delivery. Wifi
+      models are not thread safe, so this is only used by the main
+      thread. */
+  class WifiNetwork
+  {
+  public:
+    /** the loss between two radios, and their poses when it was
+	worked out */
+    class Pair
+    {
+    public:
+      Pose pose[2];
+      meters_t range;
+      unsigned int walls;
+      double loss;
+      uint64_t used; ///< the last update it was used in, plus one
+
+      Pair() : range(0), walls(0), loss(0), used(0) {}
+    };
+
+    typedef std::pair<const ModelWifi*,const ModelWifi*> pair_key_t;
+
+    World* world;
+    unsigned int members; ///< wifi models using this network
+    std::set<ModelWifi*> radios; ///< the subscribed ones
+    std::map<point_int_t,std::vector<ModelWifi*> > grid;
+    meters_t cell; ///< width of a grid cell
+    std::map<pair_key_t,Pair> pairs;
+    std::vector<ModelWifi::Message> outbox; ///< sent in this step
+    uint64_t tick; ///< the update in which we last delivered messages, plus one
+
+    WifiNetwork( World* world )
+      : world(world), members(0), radios(), grid(), cell(1.0),
+	pairs(), outbox(), tick(0)
+    {}
+
+    point_int_t Cell( const Pose& pose ) const
+    { return point_int_t( (int32_t)floor( pose.x / cell ), (int32_t)floor( pose.y / cell )); }
+
+    void Tick();
+    void Remove( ModelWifi* radio );
+    void Neighbours( const Pose& pose, std::vector<ModelWifi*>& found );
+    const Pair& Loss( ModelWifi* a, const Pose& pa, ModelWifi* b, const Pose& pb );
+    unsigned int CountWalls( ModelWifi* a, const Pose& pa, ModelWifi* b, const Pose& pb, meters_t range );
+  };
+}
+
+/** Called by the first radio to update in each time step. Delivers
+    the messages sent in the last step and rebuilds the grid. */
+void WifiNetwork::Tick()
+{
+  tick = world->GetUpdateCount() + 1;
+
+  FOR_EACH( it, outbox )
+    {
+      ModelWifi* from( it->from );
+      if( radios.find( from ) == radios.end() )
+	continue;
+
+      FOR_EACH( lit, from->links )
+	{
+	  ModelWifi* peer( lit->peer );
+
+	  if( (it->to == NULL || it->to == peer) &&
+	      lit->tx_dbm >= peer->sensitivity &&
+	      radios.find( peer ) != radios.end() )
+	    {
+	      peer->pending.push_back( *it );
+	      peer->pending.back().rx_dbm = lit->tx_dbm;
+	    }
+	}
+    }
+  outbox.clear();
+
+  // cells as wide as the longest range between any two radios, so
+  // that a radio's neighbours are all in the 3x3 cells around it
+  double power( -billion ), sensitivity( billion ), ref_loss( billion ), exponent( billion );
+  FOR_EACH( it, radios )
+    {
+      power = std::max( power, (*it)->power );
+      sensitivity = std::min( sensitivity, (*it)->sensitivity );
+      ref_loss = std::min( ref_loss, (*it)->ref_loss );
+      exponent = std::min( exponent, (*it)->exponent );
+    }
+
+  cell = 1.0;
+  if( ! radios.empty() && exponent > 0 )
+    cell = std::max( cell, pow( 10.0, (power - sensitivity - ref_loss) / (10.0 * exponent) ));
+
+  grid.clear();
+  FOR_EACH( it, radios )
+    grid[ Cell( (*it)->GetGlobalPose() ) ].push_back( *it );
+
+  // forget the pairs that have not been used for a while
+  const uint64_t now( world->GetUpdateCount() );
+  if( now % 100 == 0 )
+    for( std::map<pair_key_t,Pair>::iterator it( pairs.begin() ); it != pairs.end(); )
+      {
+	if( it->second.used + 100 < now )
+	  pairs.erase( it++ );
+	else
+	  ++it;
+      }
+}
+
+void WifiNetwork::Remove( ModelWifi* radio )
+{
+  radios.erase( radio );
+
+  FOR_EACH( it, grid )
+    EraseAll( radio, it->second );
+
+  for( std::map<pair_key_t,Pair>::iterator it( pairs.begin() ); it != pairs.end(); )
+    {
+      if( it->first.first == radio || it->first.second == radio )
+	pairs.erase( it++ );
+      else
+	++it;
+    }
+}
+
+void WifiNetwork::Neighbours( const Pose& pose, std::vector<ModelWifi*>& found )
+{
+  const point_int_t c( Cell( pose ) );
+
+  for( int32_t y( c.y-1 ); y <= c.y+1; ++y )
+    for( int32_t x( c.x-1 ); x <= c.x+1; ++x )
+      {
+	std::map<point_int_t,std::vector<ModelWifi*> >::const_iterator it( grid.find( point_int_t( x, y )));
+	if( it != grid.end() )
+	  found.insert( found.end(), it->second.begin(), it->second.end() );
+      }
+}
+
+static bool wifi_wall_match( Model* hit,
+			     Model* finder,
+			     const void* peer )
+{
+  // the bodies the radios are mounted on are not walls
+  return( hit->vis.obstacle_return &&
+	  ! hit->IsRelated( finder ) &&
+	  ! hit->IsRelated( (Model*)peer ) );
+}
+
+unsigned int WifiNetwork::CountWalls( ModelWifi* a, const Pose& pa,
+				      ModelWifi* b, const Pose& pb,
+				      meters_t range )
+{
+  const Pose origin( pa.x, pa.y, pa.z, atan2( pb.y - pa.y, pb.x - pa.x ));
+
+  std::vector<RaytraceHit> hits;
+  world->RaytraceAll( Ray( a, origin, range, wifi_wall_match, b, true ), hits );
+
+  // Blocks are rendered as outlines, so the ray meets a thick wall
+  // where it goes in and again where it comes out. An edge may fill a
+  // run of cells along the ray. Track the parity of each block's
+  // crossings and count a wall only where the ray goes in, unless it
+  // just came out of another block, as between the rectangles of a
+  // bitmap.
+  const meters_t gap( 2.0 / world->Resolution() );
+  unsigned int walls( 0 );
+  meters_t last( -2.0 * gap ); // the range of the last crossing
+
+  // for each block met: the range it was last met at, and whether we
+  // are inside it
+  std::map<Block*,std::pair<meters_t,bool> > blocks;
+
+  FOR_EACH( it, hits )
+    {
+      std::map<Block*,std::pair<meters_t,bool> >::iterator b( blocks.find( it->block ));
+
+      // the same edge as the last hit on this block
+      if( b != blocks.end() && it->range - b->second.first <= gap )
+	{
+	  b->second.first = it->range;
+	  continue;
+	}
+
+      if( b == blocks.end() )
+	b = blocks.insert( std::make_pair( it->block, std::make_pair( it->range, false ))).first;
+
+      b->second.first = it->range;
+      b->second.second = ! b->second.second;
+
+      if( b->second.second && it->range - last > gap )
+	++walls;
+
+      last = it->range;
+    }
+
+  return walls;
+}
+
+const WifiNetwork::Pair& WifiNetwork::Loss( ModelWifi* a, const Pose& pa,
+					    ModelWifi* b, const Pose& pb )
+{
+  // one entry for both directions, keyed in address order
+  if( b < a )
+    return Loss( b, pb, a, pa );
+
+  Pair& pair( pairs[ pair_key_t( a, b ) ] );
+
+  const meters_t threshold( std::min( a->move_threshold, b->move_threshold ));
+
+  if( pair.used == 0 ||
+      hypot( pa.x - pair.pose[0].x, pa.y - pair.pose[0].y ) > threshold ||
+      hypot( pb.x - pair.pose[1].x, pb.y - pair.pose[1].y ) > threshold )
+    {
+      pair.pose[0] = pa;
+      pair.pose[1] = pb;
+      pair.range = hypot( pb.x - pa.x, pb.y - pa.y );
+      pair.walls = CountWalls( a, pa, b, pb, pair.range );
+
+      const double ref_loss( (a->ref_loss + b->ref_loss) / 2.0 );
+      const double exponent( (a->exponent + b->exponent) / 2.0 );
+      const double wall_loss( (a->wall_loss + b->wall_loss) / 2.0 );
+
+      pair.loss = ref_loss + 10.0 * exponent * log10( std::max( pair.range, 1.0 ))
+	+ pair.walls * wall_loss;
+    }
+
+  pair.used = world->GetUpdateCount() + 1;
+  return pair;
+}
+
+
+ModelWifi::ModelWifi( World* world,
+		      Model* parent,
+		      const std::string& type ) :
+  Model( world, parent, type ),
+  power( 15.0 ),
+  sensitivity( -80.0 ),
+  ref_loss( 40.0 ),
+  exponent( 3.0 ),
+  wall_loss( 6.0 ),
+  move_threshold( 0.1 ),
+  links(),
+  inbox(),
+  pending(),
+  net( NULL )
+{
+  PRINT_DEBUG2( "Constructing ModelWifi %d (%s)\n",
+		id, type.c_str() );
+
+  if( world->wifi_network == NULL )
+    world->wifi_network = new WifiNetwork( world );
+
+  net = world->wifi_network;
+  ++net->members;
+
+  // a radio has no body and is invisible to sensors
+  ClearBlocks();
+  SetGeom( Geom( Pose(), Size( 0.05, 0.05, 0.05 )));
+  SetObstacleReturn( false );
+  SetRangerReturn( -1.0 );
+  SetBlobReturn( false );
+
+  RegisterOption( &showData );
+}
+
+ModelWifi::~ModelWifi()
+{
+  net->Remove( this );
+
+  if( --net->members == 0 )
+    {
+      delete net;
+      world->wifi_network = NULL;
+    }
+}
+
+void ModelWifi::Load( void )
+{
+  Model::Load();
+
+  power = wf->ReadFloat( wf_entity, "power", power );
+  sensitivity = wf->ReadFloat( wf_entity, "sensitivity", sensitivity );
+  // older worldfiles name these plc, ple and wall_factor
+  ref_loss = wf->ReadFloat( wf_entity, "plc", ref_loss );
+  ref_loss = wf->ReadFloat( wf_entity, "ref_loss", ref_loss );
+  exponent = wf->ReadFloat( wf_entity, "ple", exponent );
+  exponent = wf->ReadFloat( wf_entity, "exponent", exponent );
+  wall_loss = wf->ReadFloat( wf_entity, "wall_factor", wall_loss );
+  wall_loss = wf->ReadFloat( wf_entity, "wall_loss", wall_loss );
+  move_threshold = wf->ReadLength( wf_entity, "move_threshold", move_threshold );
+}
+
+static void put_messages( std::string& buf, const std::vector<ModelWifi::Message>& msgs )
+{
+  snapshot_put( buf, (uint32_t)msgs.size() );
+  FOR_EACH( it, msgs )
+    {
+      snapshot_put( buf, it->from );
+      snapshot_put( buf, it->to );
+      snapshot_put( buf, it->data );
+      snapshot_put( buf, it->rx_dbm );
+    }
+}
+
+static bool get_messages( const uint8_t*& pos, const uint8_t* end, std::vector<ModelWifi::Message>& msgs )
+{
+  uint32_t count( 0 );
+  if( ! snapshot_get( pos, end, count ) )
+    return false;
+
+  msgs.clear();
+  while( count-- )
+    {
+      ModelWifi::Message msg( NULL, NULL, "" );
+      if( ! ( snapshot_get( pos, end, msg.from ) &&
+	      snapshot_get( pos, end, msg.to ) &&
+	      snapshot_get( pos, end, msg.data ) &&
+	      snapshot_get( pos, end, msg.rx_dbm ) ) )
+	return false;
+      msgs.push_back( msg );
+    }
+  return true;
+}
+
+void ModelWifi::SaveState( std::string& buf ) const
+{
+  Model::SaveState( buf );
+
+  snapshot_put( buf, (uint32_t)links.size() );
+  FOR_EACH( it, links )
+    snapshot_put( buf, *it );
+
+  put_messages( buf, inbox );
+  put_messages( buf, pending );
+
+  // the first subscribed radio saves the state of the network: the
+  // set of radios can't change before a restore
+  const bool first( ! net->radios.empty() && *net->radios.begin() == this );
+  snapshot_put( buf, first );
+  if( ! first )
+    return;
+
+  snapshot_put( buf, net->tick == world->GetUpdateCount() + 1 );
+  put_messages( buf, net->outbox );
+
+  snapshot_put( buf, (uint32_t)net->pairs.size() );
+  FOR_EACH( it, net->pairs )
+    {
+      snapshot_put( buf, it->first.first );
+      snapshot_put( buf, it->first.second );
+      snapshot_put( buf, it->second.pose[0] );
+      snapshot_put( buf, it->second.pose[1] );
+      snapshot_put( buf, it->second.range );
+      snapshot_put( buf, it->second.walls );
+      snapshot_put( buf, it->second.loss );
+      snapshot_put( buf, it->second.used );
+    }
+}
+
+bool ModelWifi::LoadState( const uint8_t*& pos, const uint8_t* end )
+{
+  uint32_t count( 0 );
+  if( ! ( Model::LoadState( pos, end ) &&
+	  snapshot_get( pos, end, count ) ) )
+    return false;
+
+  links.clear();
+  while( count-- )
+    {
+      Link link( NULL, 0, 0, 0, 0 );
+      if( ! snapshot_get( pos, end, link ) )
+	return false;
+      links.push_back( link );
+    }
+
+  bool first( false );
+  if( ! ( get_messages( pos, end, inbox ) &&
+	  get_messages( pos, end, pending ) &&
+	  snapshot_get( pos, end, first ) ) )
+    return false;
+
+  if( ! first )
+    return true;
+
+  bool ticked( false );
+  if( ! ( snapshot_get( pos, end, ticked ) &&
+	  get_messages( pos, end, net->outbox ) &&
+	  snapshot_get( pos, end, count ) ) )
+    return false;
+
+  // the update count has been wound back already
+  net->tick = ticked ? world->GetUpdateCount() + 1 : 0;
+
+  net->pairs.clear();
+  while( count-- )
+    {
+      const ModelWifi* a( NULL );
+      const ModelWifi* b( NULL );
+      WifiNetwork::Pair pair;
+      if( ! ( snapshot_get( pos, end, a ) &&
+	      snapshot_get( pos, end, b ) &&
+	      snapshot_get( pos, end, pair.pose[0] ) &&
+	      snapshot_get( pos, end, pair.pose[1] ) &&
+	      snapshot_get( pos, end, pair.range ) &&
+	      snapshot_get( pos, end, pair.walls ) &&
+	      snapshot_get( pos, end, pair.loss ) &&
+	      snapshot_get( pos, end, pair.used ) ) )
+	return false;
+      net->pairs[ WifiNetwork::pair_key_t( a, b ) ] = pair;
+    }
+
+  return true;
+}
+
+void ModelWifi::Startup( void )
+{
+  Model::Startup();
+
+  net->radios.insert( this );
+  SetWatts( WIFI_WATTS );
+}
+
+void ModelWifi::Shutdown( void )
+{
+  PRINT_DEBUG( "wifi shutdown" );
+
+  net->Remove( this );
+  links.clear();
+  inbox.clear();
+  pending.clear();
+  SetWatts( 0 );
+
+  Model::Shutdown();
+}
+
+meters_t ModelWifi::MaxRange( const ModelWifi* peer ) const
+{
+  const double budget( power - peer->sensitivity - (ref_loss + peer->ref_loss) / 2.0 );
+  const double n( (exponent + peer->exponent) / 2.0 );
+
+  if( budget < 0 || n <= 0 )
+    return 0;
+
+  return pow( 10.0, budget / (10.0 * n) );
+}
+
+void ModelWifi::Send( const std::string& data, ModelWifi* to )
+{
+  net->outbox.push_back( Message( this, to, data ));
+}
+
+void ModelWifi::Update( void )
+{
+  if( net->tick != world->GetUpdateCount() + 1 )
+    net->Tick();
+
+  // the messages delivered since our last update are read in this one
+  inbox.swap( pending );
+  pending.clear();
+
+  links.clear();
+
+  const Pose gp( GetGlobalPose() );
+
+  std::vector<ModelWifi*> near;
+  net->Neighbours( gp, near );
+
+  FOR_EACH( it, near )
+    {
+      ModelWifi* peer( *it );
+      if( peer == this )
+	continue;
+
+      const Pose pp( peer->GetGlobalPose() );
+
+      // skip the trace if neither could hear the other in free space
+      const meters_t reach( std::max( MaxRange( peer ), peer->MaxRange( this )));
+      if( hypot( pp.x - gp.x, pp.y - gp.y ) > reach )
+	continue;
+
+      const WifiNetwork::Pair& pair( net->Loss( this, gp, peer, pp ));
+
+      const double tx( power - pair.loss );
+      const double rx( peer->power - pair.loss );
+
+      if( tx >= peer->sensitivity || rx >= sensitivity )
+	links.push_back( Link( peer, pair.range, pair.walls, rx, tx ));
+    }
+
+  Model::Update();
+}
+
+void ModelWifi::DataVisualize( Camera* cam )
+{
+  (void)cam; // avoid warning about unused var
+
+  if( ! showData )
+    return;
+
+  // draw a line to each radio that can hear us
+  PushColor( 0,0.6,0,0.5 );
+  glBegin( GL_LINES );
+
+  FOR_EACH( it, links )
+    if( it->tx_dbm >= it->peer->sensitivity )
+      {
+	const Pose p( GlobalToLocal( it->peer->GetGlobalPose() ));
+	glVertex2f( 0,0 );
+	glVertex2f( p.x, p.y );
+      }
 
-} // ends extern "C"
+  glEnd();
+  PopColor();
+}
@@ -259,6 +259,34 @@ void PowerPack::Dissipate( joules_t j, const Pose& p )
   event_vis.Accumulate( p.x, p.y, j );
 }
 
+void PowerPack::SaveState( std::string& buf ) const
+{
+  snapshot_put( buf, stored );
+  snapshot_put( buf, charging );
+  snapshot_put( buf, dissipated );
+  snapshot_put( buf, last_time );
+  snapshot_put( buf, last_joules );
+  snapshot_put( buf, last_watts );
+}
+
+bool PowerPack::LoadState( const uint8_t*& pos, const uint8_t* end )
+{
+  joules_t j( 0 ), d( 0 );
+  if( ! ( snapshot_get( pos, end, j ) &&
+	  snapshot_get( pos, end, charging ) &&
+	  snapshot_get( pos, end, d ) &&
+	  snapshot_get( pos, end, last_time ) &&
+	  snapshot_get( pos, end, last_joules ) &&
+	  snapshot_get( pos, end, last_watts ) ) )
+    return false;
+
+  // keep the global totals in step
+  SetStored( j );
+  global_dissipated += d - dissipated;
+  dissipated = d;
+  return true;
+}
+
 //------------------------------------------------------------------------------
 // Dissipation Visualizer class
 
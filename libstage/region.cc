@@ -11,6 +11,9 @@ using namespace Stg;
 Stg::Region::Region() : 
   cells(), 
   count(0),
+  layer_count(),
+  epoch(),
+  broad_count(),
   superregion(NULL)
 {
 }
@@ -19,16 +22,20 @@ Stg::Region::~Region()
 {
 }
 
-void Stg::Region::AddBlock()
+void Stg::Region::AddBlock( unsigned int layer )
 { 
   ++count; 
+  ++layer_count[layer];
+  ++epoch[layer];
   assert(count>0);
   superregion->AddBlock();
 }
 
-void Stg::Region::RemoveBlock()
+void Stg::Region::RemoveBlock( unsigned int layer )
 {
   --count; 
+  --layer_count[layer];
+  ++epoch[layer];
   assert(count>=0); 
   superregion->RemoveBlock();
 	
@@ -300,7 +307,7 @@ void Stg::Cell::AddBlock( Block* b, unsigned int layer )
 
   blocks[layer].push_back( b );   
   b->rendered_cells[layer].push_back(this);
-  region->AddBlock();
+  region->AddBlock( layer );
 }
 
 void Stg::Cell::RemoveBlock( Block* b, unsigned int layer )
@@ -379,5 +386,5 @@ void Stg::Cell::RemoveBlock( Block* b, unsigned int layer )
 #endif
     }
   
-  region->RemoveBlock();
+  region->RemoveBlock( layer );
 }
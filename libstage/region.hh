@@ -67,6 +67,9 @@ namespace Stg
   private:
     std::vector<Cell> cells;
     unsigned long count; // number of blocks rendered into this region
+    unsigned long layer_count[2]; // the same, per layer, so that tracing one layer is unaffected by moves in the other
+    unsigned long epoch[2]; // bumped whenever a cell of this region gains or loses a block, per layer
+    unsigned long broad_count[2]; // cells of this region holding a block too big for the broad phase hash, per layer
 	 
   public:
     Region();
@@ -87,8 +90,8 @@ namespace Stg
       return( &cells[ x + y * REGIONWIDTH ] );
     }
 	 	 
-    inline void AddBlock();
-    inline void RemoveBlock(); 
+    inline void AddBlock( unsigned int layer );
+    inline void RemoveBlock( unsigned int layer ); 
 	 
     SuperRegion* superregion;	
 	 
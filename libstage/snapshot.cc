@@ -0,0 +1,247 @@
+/////////////////////////////////
+// File: snapshot.cc
+// Desc: Binary snapshots of a world, which World::Load() reads back
+//       without parsing the worldfile, decoding its bitmaps or
+//       rasterizing its blocks.
+// License: GPL
+/////////////////////////////////
+
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "stage.hh"
+#include "worldfile.hh"
+#include "region.hh"
+using namespace Stg;
+
+// bump whenever the layout of any section changes
+static const uint32_t SNAPSHOT_VERSION( 1 );
+static const char SNAPSHOT_MAGIC[8] = { 'S','T','G','S','N','A','P','\0' };
+static const uint32_t SNAPSHOT_BYTE_ORDER( 0x01020304 );
+
+// A snapshot is this header, then the worldfile, bitmap and
+// occupancy sections, each as long as the header says. Everything is
+// in the byte order of the machine that wrote it, and the occupancy
+// grid has the region sizes of the Stage that wrote it: a snapshot
+// that differs in either is refused.
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order; ///< SNAPSHOT_BYTE_ORDER, as written
+  uint32_t rbits, sbits; ///< of the occupancy grid
+  uint64_t worldfile_bytes;
+  uint64_t bitmap_bytes;
+  uint64_t occupancy_bytes; ///< zero if the occupancy wasn't saved
+} snapshot_header_t;
+
+static int save_cb( Model* mod, void* dummy )
+{
+  mod->Save();
+  return 0;
+}
+
+// append the shapes of every bitmap that decoded to buf
+static void write_bitmaps( std::string& buf,
+			   const std::map<std::pair<std::string,int>,BitmapShapes>& bitmaps )
+{
+  uint32_t count( 0 );
+  FOR_EACH( it, bitmaps )
+    if( ! it->second.err )
+      ++count;
+  snapshot_put( buf, count );
+
+  FOR_EACH( it, bitmaps )
+    {
+      // a bitmap that failed is tried again, and reported, on loading
+      const BitmapShapes& shapes( it->second );
+      if( shapes.err )
+	continue;
+
+      snapshot_put( buf, it->first.first );
+      snapshot_put( buf, (int32_t)it->first.second );
+
+      snapshot_put( buf, (uint32_t)shapes.polys.size() );
+      FOR_EACH( pit, shapes.polys )
+	{
+	  snapshot_put( buf, (uint32_t)pit->size() );
+	  FOR_EACH( vit, *pit )
+	    {
+	      snapshot_put( buf, vit->x );
+	      snapshot_put( buf, vit->y );
+	    }
+	}
+
+      snapshot_put( buf, shapes.width );
+      snapshot_put( buf, shapes.height );
+      snapshot_put( buf, (uint32_t)shapes.raster.size() );
+      if( shapes.raster.size() )
+	buf.append( (const char*)&shapes.raster[0], shapes.raster.size() );
+    }
+}
+
+// read back the bitmaps written by write_bitmaps()
+static bool read_bitmaps( const uint8_t*& pos, const uint8_t* end,
+			  std::map<std::pair<std::string,int>,BitmapShapes>& bitmaps )
+{
+  uint32_t count( 0 );
+  if( ! snapshot_get( pos, end, count ) )
+    return false;
+
+  for( uint32_t i=0; i<count; i++ )
+    {
+      std::string filename;
+      int32_t mode( 0 );
+      uint32_t polys( 0 );
+      if( ! snapshot_get( pos, end, filename ) ||
+	  ! snapshot_get( pos, end, mode ) ||
+	  ! snapshot_get( pos, end, polys ) )
+	return false;
+
+      BitmapShapes& shapes( bitmaps[ std::make_pair( filename, (int)mode ) ] );
+      shapes.cached = true;
+
+      shapes.polys.resize( polys );
+      FOR_EACH( pit, shapes.polys )
+	{
+	  uint32_t points( 0 );
+	  if( ! snapshot_get( pos, end, points ) ||
+	      (size_t)(end - pos) / (2 * sizeof(meters_t)) < points )
+	    return false;
+
+	  pit->resize( points );
+	  FOR_EACH( vit, *pit )
+	    {
+	      snapshot_get( pos, end, vit->x );
+	      snapshot_get( pos, end, vit->y );
+	    }
+	}
+
+      uint32_t raster( 0 );
+      if( ! snapshot_get( pos, end, shapes.width ) ||
+	  ! snapshot_get( pos, end, shapes.height ) ||
+	  ! snapshot_get( pos, end, raster ) ||
+	  (size_t)(end - pos) < raster )
+	return false;
+
+      shapes.raster.assign( pos, pos + raster );
+      pos += raster;
+    }
+
+  return true;
+}
+
+bool World::SaveSnapshot( const std::string& filename )
+{
+  // bring the worldfile up to date with the models, as Save() does
+  ForEachDescendant( save_cb, NULL );
+
+  std::string worldfile;
+  wf->SaveSnapshot( worldfile );
+
+  // the shapes are not kept after loading, so decode them again
+  DecodeBitmaps();
+  std::string bitmaps;
+  write_bitmaps( bitmaps, decoded_bitmaps );
+  decoded_bitmaps.clear();
+
+  std::string occupancy;
+  if( ! SaveOccupancy( occupancy ) )
+    {
+      PRINT_WARN1( "the occupancy of world %s can't be saved, so it will be rendered when the snapshot is loaded",
+		   Token() );
+      occupancy.clear();
+    }
+
+  snapshot_header_t hdr;
+  memset( &hdr, 0, sizeof(hdr) );
+  memcpy( hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic) );
+  hdr.version = SNAPSHOT_VERSION;
+  hdr.byte_order = SNAPSHOT_BYTE_ORDER;
+  hdr.rbits = RBITS;
+  hdr.sbits = SBITS;
+  hdr.worldfile_bytes = worldfile.size();
+  hdr.bitmap_bytes = bitmaps.size();
+  hdr.occupancy_bytes = occupancy.size();
+
+  // write a temporary file and rename it into place, so that a
+  // reader never sees half a snapshot
+  char tmpname[32];
+  snprintf( tmpname, sizeof(tmpname), ".%d.tmp", (int)getpid() );
+  const std::string tmpfile( filename + tmpname );
+
+  FILE* fp( fopen( tmpfile.c_str(), "wb" ) );
+  if( fp == NULL )
+    {
+      PRINT_ERR2( "unable to write snapshot %s : %s", filename.c_str(), strerror(errno) );
+      return false;
+    }
+
+  bool ok( fwrite( &hdr, sizeof(hdr), 1, fp ) == 1 );
+  ok = ok && fwrite( worldfile.data(), 1, worldfile.size(), fp ) == worldfile.size();
+  ok = ok && fwrite( bitmaps.data(), 1, bitmaps.size(), fp ) == bitmaps.size();
+  ok = ok && fwrite( occupancy.data(), 1, occupancy.size(), fp ) == occupancy.size();
+  ok = ( fclose( fp ) == 0 ) && ok;
+
+  if( ! ok || rename( tmpfile.c_str(), filename.c_str() ) )
+    {
+      PRINT_ERR1( "failed to write snapshot %s", filename.c_str() );
+      unlink( tmpfile.c_str() );
+      return false;
+    }
+
+  return true;
+}
+
+bool World::LoadSnapshot( const std::string& filename )
+{
+  size_t len( 0 );
+  const uint8_t* data( map_file( filename, len ) );
+  if( data == NULL )
+    return false;
+
+  if( len < sizeof(snapshot_header_t) ||
+      memcmp( data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) ) )
+    {
+      munmap( (void*)data, len );
+      return false; // a worldfile, presumably
+    }
+
+  snapshot_header_t hdr;
+  memcpy( &hdr, data, sizeof(hdr) );
+
+  bool ok( hdr.version == SNAPSHOT_VERSION &&
+	   hdr.byte_order == SNAPSHOT_BYTE_ORDER &&
+	   hdr.rbits == (uint32_t)RBITS &&
+	   hdr.sbits == (uint32_t)SBITS &&
+	   len - sizeof(hdr) ==
+	   hdr.worldfile_bytes + hdr.bitmap_bytes + hdr.occupancy_bytes );
+
+  const uint8_t* pos( data + sizeof(hdr) );
+
+  if( ok )
+    {
+      const uint8_t* end( pos + hdr.worldfile_bytes );
+      ok = wf->LoadSnapshot( pos, end ) && pos == end;
+    }
+
+  if( ok )
+    {
+      const uint8_t* end( pos + hdr.bitmap_bytes );
+      ok = read_bitmaps( pos, end, decoded_bitmaps ) && pos == end;
+    }
+
+  if( ! ok )
+    {
+      PRINT_ERR1( "snapshot %s was made by another version of Stage, or is damaged",
+		  filename.c_str() );
+      exit(-1);
+    }
+
+  // the occupancy is restored once the models exist
+  snapshot_data = data;
+  snapshot_size = len;
+  snapshot_occupancy = pos - data;
+
+  return true;
+}
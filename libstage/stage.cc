@@ -1,6 +1,8 @@
 // Author: Richard Vaughan
 
 #include <FL/Fl_Shared_Image.H>
+#include <FL/Fl_PNG_Image.H>
+#include <FL/Fl_JPEG_Image.H>
 
 #include "stage.hh"
 #include "config.h" // results of cmake's system configuration tests
@@ -51,8 +53,65 @@ const Color Color::magenta( 1,0,1 );
 const Color Color::cyan( 0,1,1 );		
 
 
+// Fl_Shared_Image keeps a global list of the images it has loaded,
+// so only one thread at a time may load or release an image. PNG and
+// JPEG files, which is what bitmaps usually are, are decoded into an
+// image of their own instead, outside the list, so that the threads
+// decoding the bitmaps of a world don't wait for each other.
+static pthread_mutex_t image_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static Fl_Image* get_image( const std::string& filename )
+{
+  // tell the format from the first bytes of the file, as
+  // Fl_Shared_Image does, whatever its name says
+  unsigned char header[8];
+  size_t len( 0 );
+  FILE* fp( fopen( filename.c_str(), "rb" ) );
+  if( fp )
+    {
+      len = fread( header, 1, sizeof(header), fp );
+      fclose( fp );
+    }
+
+  Fl_Image* img( NULL );
+  if( len >= 8 && memcmp( header, "\211PNG\r\n\032\n", 8 ) == 0 )
+    img = new Fl_PNG_Image( filename.c_str() );
+  else if( len >= 3 && memcmp( header, "\377\330\377", 3 ) == 0 )
+    img = new Fl_JPEG_Image( filename.c_str() );
+
+  // a file that failed to load leaves an empty image
+  if( img && ( img->w() == 0 || img->h() == 0 || img->d() == 0 ) )
+    {
+      delete img;
+      img = NULL;
+    }
+
+  // anything else is left to the image types FLTK has registered
+  if( img == NULL )
+    {
+      pthread_mutex_lock( &image_mutex );
+      img = Fl_Shared_Image::get( filename.c_str() );
+      pthread_mutex_unlock( &image_mutex );
+    }
+  return img;
+}
+
+static void release_image( Fl_Image* img )
+{
+  Fl_Shared_Image* shared( dynamic_cast<Fl_Shared_Image*>( img ) );
+  if( shared == NULL )
+    {
+      delete img;
+      return;
+    }
+
+  pthread_mutex_lock( &image_mutex );
+  shared->release();
+  pthread_mutex_unlock( &image_mutex );
+}
+
 // set all the pixels in a rectangle 
-static inline void pb_set_rect( Fl_Shared_Image* pb, 
+static inline void pb_set_rect( Fl_Image* pb, 
 				const unsigned int x, const unsigned int y, 
 				const unsigned int rwidth, const unsigned int rheight, 
 				const uint8_t val )
@@ -81,152 +140,250 @@ static inline bool pixel_is_set( uint8_t* pixels,
   return( (pixels + (y*width*depth) + x*depth)[0] > threshold );
 }
 
-
-double direction( double a )
+// load the image file [filename] and set mask[x + y*width] to 1 for
+// each of its dark (occupied) pixels and to 0 for the rest
+static int dark_pixels_from_image_file( const std::string& filename,
+					std::vector<uint8_t>& mask,
+					unsigned int& width,
+					unsigned int& height )
 {
-  if( a == 0.0 )
-    return 0;
-  else
-    return sgn(a);
-}
-
-int Stg::polys_from_image_file( const std::string& filename, 
-				std::vector<std::vector<point_t> >& polys )
-{
-  // TODO: make this a parameter
-  const int threshold = 127;
+  const int threshold = IMAGE_THRESHOLD;
   
-  Fl_Shared_Image *img = Fl_Shared_Image::get(filename.c_str());
+  // this may run on a worker thread, so leave reporting the error
+  // to the caller
+  Fl_Image *img = get_image( filename );
   if( img == NULL ) 
-    {
-      std::cerr << "failed to open file: " << filename << std::endl;
-
-      assert( img ); // easy access to this point in debugger     
-      exit(-1); 
-    }
+    return -1;
 
   //printf( "loaded image %s w %d h %d d %d count %d ld %d\n", 
   //  filename, img->w(), img->h(), img->d(), img->count(), img->ld() );
 
-  const unsigned int width = img->w();
-  const unsigned height = img->h();
+  width = img->w();
+  height = img->h();
   const unsigned int depth = img->d();
   uint8_t* pixels = (uint8_t*)img->data()[0];
+
+  mask.resize( width * height );
+  for( unsigned int y=0; y<height; y++ )
+    for( unsigned int x=0; x<width; x++ )
+      mask[x + y*width] = ! pixel_is_set( pixels, width, depth, x, y, threshold );
+
+  release_image( img ); // frees all resources for this image
+  return 0; // ok
+}
+
+
+// the four directions of travel along pixel edges, in clockwise
+// order in image coordinates (y down), so that (d+1)%4 is a right
+// turn from d and (d+3)%4 a left turn
+static const int32_t edge_dx[4] = { 1, 0, -1, 0 }; // E S W N
+static const int32_t edge_dy[4] = { 0, 1, 0, -1 };
+
+int Stg::polys_from_image_file( const std::string& filename, 
+				std::vector<std::vector<point_t> >& polys )
+{
+  std::vector<uint8_t> dark;
+  unsigned int width( 0 ), height( 0 );
+  const int err( dark_pixels_from_image_file( filename, dark, width, height ) );
+  if( err )
+    return err;
+  
+  // The outline of the dark (occupied) pixels is made of the pixel
+  // edges that separate a dark pixel from a light one or from the
+  // outside of the image. Each is directed so that the dark pixel is
+  // on its right, so the outlines run clockwise around dark areas and
+  // anticlockwise around holes. A bit mask of the edges leaving each
+  // pixel corner is filled in one pass over the image.
+  const unsigned int vwidth( width+1 );
+  std::vector<uint8_t> out( vwidth * (height+1), 0 );
   
-  // a set of previously seen directed edges, The key is a 4-element vector
-  // [x1,y1,x2,y2].
-  std::set<std::vector<uint32_t> > edges;
+  // the dark pixels of the previous, current and next rows, padded
+  // with a light pixel at each end
+  std::vector<uint8_t> rows( 3 * (width+2), 0 );
+  uint8_t* above( &rows[0] );
+  uint8_t* row( &rows[width+2] );
+  uint8_t* below( &rows[2*(width+2)] );
+  
+  if( height > 0 )
+    memcpy( below+1, &dark[0], width );
 
-  for(unsigned int y = 0; y < height; y++)
+  for( unsigned int y=0; y<height; y++ )
     {
-      for(unsigned int x = 0; x < width; x++)
+      // roll the rows along
+      uint8_t* tmp( above );
+      above = row;
+      row = below;
+      below = tmp;
+      
+      if( y+1 < height )
+	memcpy( below+1, &dark[(y+1)*width], width );
+      else
+	memset( below+1, 0, width );
+
+      uint8_t* corner( &out[ y * vwidth ] ); // top left corner of pixel 0
+      
+      for( unsigned int x=0; x<width; x++ )
 	{
-	  // skip blank (white) pixels
-	  if(  pixel_is_set( pixels, width, depth, x, y, threshold) )
+	  if( ! row[x+1] ) 
 	    continue;
 	  
-	  // generate the four directed edges for this pixel	  
-	  std::vector<uint32_t> edge[4];
-	  
-	  for( int i=0; i<4; i++ )
-	    edge[i].resize(4);
-	  
-	  edge[0][0] = x+0;
-	  edge[0][1] = y+0;
-	  edge[0][2] = x+1;
-	  edge[0][3] = y+0;
-	  
-	  edge[1][0] = x+1;
-	  edge[1][1] = y+0;
-	  edge[1][2] = x+1;
-	  edge[1][3] = y+1;
-	  
-	  edge[2][0] = x+1;
-	  edge[2][1] = y+1;
-	  edge[2][2] = x+0;
-	  edge[2][3] = y+1;
-
-	  edge[3][0] = x+0;
-	  edge[3][1] = y+1;
-	  edge[3][2] = x+0;
-	  edge[3][3] = y+0;
-	  
-	  // put them in the set of the inverse edge does not exist
-	  for( int i=0; i<4; i++ )
-	    {
-	      // the same edge with the opposite direction
-	      std::vector<uint32_t> inv(4);
-	      inv[0] = edge[i][2];
-	      inv[1] = edge[i][3];
-	      inv[2] = edge[i][0];
-	      inv[3] = edge[i][1];
-	      
-	      std::set<std::vector<uint32_t> >::iterator it = 
-		edges.find( inv );
-	      
-	      if( it == edges.end() ) // inverse not found
-		edges.insert( edge[i] ); // add the new edge
-	      else // inverse found! delete it
-		edges.erase( it );
-	    }
+	  if( ! above[x+1] ) corner[x] |= 1; // top edge heads E from (x,y)
+	  if( ! row[x+2] ) corner[x+1] |= 2; // right edge heads S from (x+1,y)
+	  if( ! below[x+1] ) corner[x+1+vwidth] |= 4; // bottom edge heads W from (x+1,y+1)
+	  if( ! row[x] ) corner[x+vwidth] |= 8; // left edge heads N from (x,y+1)
 	}
     }
-    
-  std::multimap<point_t,point_t> mmap;
   
-  FOR_EACH( it, edges )
-    {
-      // fill a multimap with start-point / end-point pairs.
-      std::pair<point_t,point_t> p( point_t( (*it)[0], (*it)[1] ),
-				    point_t( (*it)[2], (*it)[3] ));
-      mmap.insert( p );
-    }
+  // Walk the edges into closed outlines, keeping only the corners. A
+  // corner shared by two diagonally adjacent dark pixels has two
+  // edges leaving it: we take the left turn, which joins areas
+  // touching at a corner into one outline and so keeps the number of
+  // blocks down. Each edge is visited once, so this is linear in the
+  // size of the image.
+  for( unsigned int start=0; start < out.size(); start++ )
+    while( out[start] )
+      {
+	std::vector<point_t> poly;
+	
+	int32_t x( start % vwidth ), y( start / vwidth );
+	unsigned int v( start );
+	
+	// leave the start the first way we can
+	int first( 0 );
+	while( ! (out[v] & (1<<first)) )
+	  first++;
+	
+	int dir( first );
+	
+	do
+	  {
+	    out[v] &= ~(1<<dir);
+	    x += edge_dx[dir];
+	    y += edge_dy[dir];
+	    v = x + y * vwidth;
+	    
+	    if( v == start )
+	      break; // closed
+	    
+	    // left, straight on or right: the reverse of the edge we
+	    // came in on can't exist
+	    int next( (dir+3) & 3 );
+	    if( ! (out[v] & (1<<next)) )
+	      next = dir;
+	    if( ! (out[v] & (1<<next)) )
+	      next = (dir+1) & 3;
+	    assert( out[v] & (1<<next) );
+	    
+	    // invert y axis and keep the corners
+	    if( next != dir )
+	      poly.push_back( point_t( x, -y ) );
+	    
+	    dir = next;
+	  }
+	while( true );
+	
+	// the start is a corner unless we arrived heading the way we left
+	if( dir != first )
+	  poly.insert( poly.begin(), point_t( x, -y ) );
+	
+	polys.push_back( poly );
+      }
+  
+  return 0; // ok
+}
 
-  for( std::multimap<point_t,point_t>::iterator seedit = mmap.begin();
-       seedit != mmap.end();
-       seedit = mmap.begin() )       
-    {
-      std::vector<point_t> poly;
-      
-      while( seedit != mmap.end() ) 
+int Stg::rects_from_image_file( const std::string& filename,
+				std::vector<std::vector<point_t> >& rects )
+{
+  // dark (occupied) pixels not yet covered by a rectangle
+  std::vector<uint8_t> todo;
+  unsigned int width( 0 ), height( 0 );
+  const int err( dark_pixels_from_image_file( filename, todo, width, height ) );
+  if( err )
+    return err;
+
+  // Greedy merging: the first free pixel in raster order is the top
+  // left corner of a new rectangle, which is grown as far right as
+  // it will go and then down for as many rows as are free across
+  // its whole width. Every pixel is covered by exactly one
+  // rectangle.
+  for( unsigned int y=0; y<height; y++ )
+    for( unsigned int x=0; x<width; x++ )
+      {
+	if( ! todo[x + y*width] )
+	  continue;
+
+	uint8_t* row( &todo[y*width] );
+
+	unsigned int x1( x+1 );
+	while( x1 < width && row[x1] )
+	  x1++;
+
+	unsigned int y1( y+1 );
+	for( ; y1 < height; y1++ )
+	  {
+	    const uint8_t* below( &todo[y1*width] );
+	    unsigned int bx( x );
+	    while( bx < x1 && below[bx] )
+	      bx++;
+	    if( bx < x1 )
+	      break;
+	  }
+
+	for( unsigned int ry=y; ry<y1; ry++ )
+	  memset( &todo[x + ry*width], 0, x1-x );
+
+	// corners in the same order as the traced outlines, with the y
+	// axis inverted
+	std::vector<point_t> rect( 4 );
+	rect[0] = point_t( x, -(double)y );
+	rect[1] = point_t( x1, -(double)y );
+	rect[2] = point_t( x1, -(double)y1 );
+	rect[3] = point_t( x, -(double)y1 );
+	rects.push_back( rect );
+
+	x = x1-1; // the rest of the span is covered
+      }
+
+  return 0; // ok
+}
+
+int Stg::raster_from_image_file( const std::string& filename,
+				 std::vector<uint8_t>& raster,
+				 uint32_t& width, uint32_t& height )
+{
+  std::vector<uint8_t> dark;
+  unsigned int iwidth( 0 ), iheight( 0 );
+  const int err( dark_pixels_from_image_file( filename, dark, iwidth, iheight ) );
+  if( err )
+    return err;
+
+  // find the bounding box of the dark pixels, which is the extent
+  // the traced outlines would have
+  unsigned int xmin( iwidth ), xmax( 0 ), ymin( iheight ), ymax( 0 );
+  for( unsigned int y=0; y<iheight; y++ )
+    for( unsigned int x=0; x<iwidth; x++ )
+      if( dark[x + y*iwidth] )
 	{
-	  // invert y axis and add the new point to the poly
-	  point_t pt = seedit->first;
-	  pt.y = -pt.y;
-	  
-	  // can this vector simply extend the previous one?
-	  size_t psize = poly.size();
-	  if( psize > 2 ) // need at least two points already
-	    {
-	      // find the direction of the vector descrived by the two previous points
-	      double ldx = direction( poly[psize-1].x - poly[psize-2].x );
-	      double ldy = direction( poly[psize-1].y - poly[psize-2].y );
-	      
-	      // find the direction of the vector described by the new point and the previous point
-	      double ndx = direction( pt.x - poly[psize-1].x );
-	      double ndy = direction( pt.y - poly[psize-1].y );
-	      
-	      // if the direction is the same, we can replace the
-	      // previous point with this one, rather than adding a
-	      // new point
-	      if( ldx == ndx && ldy == ndy )
-		poly[psize-1] = pt;	      
-	      else
-		poly.push_back( pt );      
-	    }
-	  else
-	    poly.push_back( pt ); 
-	  
-	  point_t next = seedit->second;
-	  mmap.erase( seedit );
-	  
-	  seedit = mmap.find( next );      
-	} 
-      
-      polys.push_back( poly );
+	  xmin = std::min( xmin, x );
+	  xmax = std::max( xmax, x );
+	  ymin = std::min( ymin, y );
+	  ymax = std::max( ymax, y );
+	}
+
+  raster.clear();
+  width = height = 0;
+
+  if( xmin <= xmax ) // found some
+    {
+      width = xmax - xmin + 1;
+      height = ymax - ymin + 1;
+      raster.resize( width * height );
+
+      for( unsigned int y=0; y<height; y++ )
+	memcpy( &raster[y*width], &dark[xmin + (y+ymin)*iwidth], width );
     }
-  
-  if( img ) img->release(); // frees all resources for this image
+
   return 0; // ok
 }
 
@@ -256,3 +413,38 @@ double Stg::constrain( double val, const double minval, const double maxval )
   return val;
 }
 
+
+// RANDOM NUMBERS ---------------------------------------------------
+
+void RandomStream::Seed( uint64_t seed )
+{
+  if( seed == 0 ) 
+    seed = ((uint64_t)lrand48() << 32) ^ (uint64_t)lrand48();
+  
+  // xorshift never leaves the all-zeros state
+  state = seed ? seed : 1;
+}
+
+void RandomStream::Normals( double* normals, size_t count )
+{
+  // Box-Muller turns pairs of uniforms into pairs of normals
+  const size_t even( count & ~(size_t)1 );
+  
+  // the first of each pair is in (0,1], so that its log is finite
+  for( size_t i(0); i<even; i+=2 )
+    {
+      normals[i] = 1.0 - Uniform();
+      normals[i+1] = Uniform();
+    }
+  
+  for( size_t i(0); i<even; i+=2 )
+    {
+      const double r( sqrt( -2.0 * log( normals[i] )));
+      const double theta( 2.0 * M_PI * normals[i+1] );
+      normals[i] = r * cos( theta );
+      normals[i+1] = r * sin( theta );
+    }
+  
+  if( count & 1 )
+    normals[even] = sqrt( -2.0 * log( 1.0 - Uniform() )) * cos( 2.0 * M_PI * Uniform() );
+}
@@ -47,6 +47,7 @@
 #include <iostream>
 #include <vector>
 #include <list>
+#include <deque>
 #include <map>
 #include <set>
 #include <queue>
@@ -533,7 +534,96 @@ namespace Stg
     bool operator==( const point_int_t& other ) const
     { return ((x == other.x) && (y == other.y) ); }
   };
-  
+
+  /** A small, fast stream of pseudo-random numbers (xorshift64*). A
+      model that adds noise to its data owns one, so that the threads
+      updating different models never share generator state. */
+  class RandomStream
+  {
+  public:
+    /** seed 0 takes a seed from drand48(), so that streams differ
+	between models and between runs */
+    RandomStream( uint64_t seed = 0 ) : state(1) { Seed( seed ); }
+
+    void Seed( uint64_t seed );
+
+    uint64_t Next()
+    {
+      state ^= state >> 12;
+      state ^= state << 25;
+      state ^= state >> 27;
+      return state * 2685821657736338717ULL;
+    }
+
+    /** uniform in [0,1) */
+    double Uniform()
+    { return (Next() >> 11) * (1.0 / 9007199254740992.0); }
+
+    /** Fill normals[0..count) with independent standard normal
+	deviates. The uniforms are drawn first and then transformed in
+	pairs (Box-Muller) in a separate loop with no dependencies
+	between iterations, which the compiler can vectorise. */
+    void Normals( double* normals, size_t count );
+
+    /** Skip count numbers, leaving the stream where it would be had
+	they been drawn */
+    void Discard( uint64_t count )
+    { while( count-- ) Next(); }
+
+  private:
+    uint64_t state;
+  };
+
+  /** Bookkeeping for a sensor model that can defer its work until
+      its data is read. In lazy mode an update that comes due only
+      records the model's global pose and the layer of the occupancy
+      grid it would have traced in, and marks the data stale; the
+      data is worked out from that pose, in that layer, when it is
+      first read. The layer is not written to until the next
+      update moves the models, so data read before then (e.g. in an
+      update callback of the same update, or in queue 0 of the next
+      one) is the same as an eager update would have made. Data
+      first read later than that is traced in the layer as the
+      later moves have left it, so it can differ from eager data. */
+  class LazyUpdate
+  {
+  public:
+    bool enabled; ///< defer updates until the data is read
+    bool stale; ///< an update came due and has not been done yet
+    Pose pose; ///< global pose of the model when the update came due
+    unsigned int layer; ///< the layer sensors traced in when the update came due
+    uint64_t skipped; ///< deferred updates that were never read
+    uint64_t evaluated; ///< deferred updates done when their data was read
+
+    LazyUpdate() : enabled(false), stale(false), pose(), layer(0), skipped(0), evaluated(0) {}
+
+    /** An update has come due with the model at global pose gpose,
+	while sensors trace in the given layer of the occupancy
+	grid. Returns true if it is deferred, or false if the caller
+	should do the work now. Pass allowed false to force the work,
+	e.g. if another model relies on the data being current. */
+    bool Defer( const Pose& gpose, unsigned int layer, bool allowed = true )
+    {
+      if( stale )
+	++skipped; // nobody read the last one
+      pose = gpose;
+      this->layer = layer;
+      stale = enabled && allowed;
+      return stale;
+    }
+
+    /** The data is about to be read. Returns true if a deferred
+	update must be done first. */
+    bool Claim()
+    {
+      if( ! stale )
+	return false;
+      stale = false;
+      ++evaluated;
+      return true;
+    }
+  };
+
   /** create an array of 4 points containing the corners of a unit
       square.  */
   point_t* unit_square_points_create();
@@ -592,7 +682,13 @@ namespace Stg
       record within a model and called whenever the record is set.*/
   typedef int(*model_callback_t)(Model* mod, void* user );
 
+  /** A function run by World::RunJobs() */
+  typedef void(*job_func_t)( void* arg );
+
   typedef int(*world_callback_t)(World* world, void* user );
+
+  /** Identifies a checkpoint made by World::Checkpoint() */
+  typedef uint32_t checkpoint_t;
   
   // return val, or minval if val < minval, or maxval if val > maxval
   double constrain( double val, double minval, double maxval );
@@ -615,11 +711,139 @@ namespace Stg
     Size size;
   } rotrect_t; // rotated rectangle
   
-  /** load the image file [filename] and convert it to a vector of polygons 
+  /** Pixels of a bitmap brighter than this are free space, the rest
+      are occupied */
+  const uint8_t IMAGE_THRESHOLD = 127;
+
+  /** load the image file [filename] and convert it to a vector of
+      polygons. Returns 0 on success, or non-zero if the file could
+      not be read.
    */
   int polys_from_image_file( const std::string& filename, 
 			     std::vector<std::vector<point_t> >& polys );
 
+  /** load the image file [filename] and cover its dark pixels with a
+      set of non-overlapping axis-aligned rectangles, found by greedy
+      merging of pixel runs. Each rectangle is a 4-point polygon in
+      the same coordinates as polys_from_image_file() uses. Returns
+      0 on success, or non-zero if the file could not be read.
+   */
+  int rects_from_image_file( const std::string& filename,
+			     std::vector<std::vector<point_t> >& rects );
+
+  /** load the image file [filename] and return the dark pixels of
+      the smallest rectangle that contains them all, one byte per
+      pixel, row by row from the top. This rectangle has the same
+      extent as the polygons of polys_from_image_file(). width and
+      height are set to 0 if there are no dark pixels. Returns 0 on
+      success, or non-zero if the file could not be read.
+   */
+  int raster_from_image_file( const std::string& filename,
+			      std::vector<uint8_t>& raster,
+			      uint32_t& width, uint32_t& height );
+
+  /** Read the polygons and raster that the method called [method]
+      made from the image file [filename] from the cache file next to
+      it, by mapping the file into memory. Returns true iff the cache
+      file exists and was made by the same method from an image with
+      the same contents, with the same threshold. */
+  bool map_cache_read( const std::string& filename, const char* method,
+		       std::vector<std::vector<point_t> >& polys,
+		       std::vector<uint8_t>& raster,
+		       uint32_t& width, uint32_t& height );
+
+  /** Write the polygons and raster that the method called [method]
+      made from the image file [filename] to a cache file next to it,
+      named [filename].[method].cache, for map_cache_read(). Warns if
+      the file can't be written. */
+  void map_cache_write( const std::string& filename, const char* method,
+			const std::vector<std::vector<point_t> >& polys,
+			const std::vector<uint8_t>& raster,
+			uint32_t width, uint32_t height );
+
+  /** Map the whole of the file [filename] into memory, read-only,
+      and set len to its length. Returns NULL if the file can't be
+      read or is empty. Release the memory with munmap(). */
+  const uint8_t* map_file( const std::string& filename, size_t& len );
+
+  /** Append the bytes of a plain value to a binary snapshot buffer */
+  template <typename T>
+  inline void snapshot_put( std::string& buf, const T& val )
+  { buf.append( (const char*)&val, sizeof(T) ); }
+
+  /** Append a string to a binary snapshot buffer, length first */
+  inline void snapshot_put( std::string& buf, const std::string& str )
+  { 
+    snapshot_put( buf, (uint32_t)str.size() );
+    buf.append( str );
+  }
+
+  /** Read a plain value from the snapshot bytes at pos, and move pos
+      past it. Returns false, changing nothing, if it would read past
+      end. */
+  template <typename T>
+  inline bool snapshot_get( const uint8_t*& pos, const uint8_t* end, T& val )
+  {
+    if( (size_t)(end - pos) < sizeof(T) )
+      return false;
+    memcpy( &val, pos, sizeof(T) );
+    pos += sizeof(T);
+    return true;
+  }
+
+  /** Append a pose to a binary snapshot buffer. Pose has a vtable,
+      so its bytes are not copied whole. */
+  inline void snapshot_put( std::string& buf, const Pose& p )
+  {
+    snapshot_put( buf, p.x );
+    snapshot_put( buf, p.y );
+    snapshot_put( buf, p.z );
+    snapshot_put( buf, p.a );
+  }
+
+  inline void snapshot_put( std::string& buf, const Velocity& v )
+  { snapshot_put( buf, (const Pose&)v ); }
+
+  /** Read a string written by snapshot_put() */
+  inline bool snapshot_get( const uint8_t*& pos, const uint8_t* end, std::string& str )
+  {
+    uint32_t len( 0 );
+    if( ! snapshot_get( pos, end, len ) || (size_t)(end - pos) < len )
+      return false;
+    str.assign( (const char*)pos, len );
+    pos += len;
+    return true;
+  }
+
+  /** Read a pose written by snapshot_put() */
+  inline bool snapshot_get( const uint8_t*& pos, const uint8_t* end, Pose& p )
+  {
+    if( (size_t)(end - pos) < 4 * sizeof(double) )
+      return false;
+    snapshot_get( pos, end, p.x );
+    snapshot_get( pos, end, p.y );
+    snapshot_get( pos, end, p.z );
+    snapshot_get( pos, end, p.a );
+    return true;
+  }
+
+  inline bool snapshot_get( const uint8_t*& pos, const uint8_t* end, Velocity& v )
+  { return snapshot_get( pos, end, (Pose&)v ); }
+
+  /** The polygons or map raster that a bitmap file is turned into,
+      as made by BlockGroup::DecodeBitmap() */
+  class BitmapShapes
+  {
+  public:
+    std::vector<std::vector<point_t> > polys;
+    std::vector<uint8_t> raster;
+    uint32_t width, height; ///< of the raster
+    bool cached; ///< true iff read back from a cache file
+    int err; ///< non-zero iff the bitmap could not be read
+
+    BitmapShapes() : polys(), raster(), width(0), height(0), cached(false), err(0) {}
+  };
+
 
   /** matching function should return true iff the candidate block is
       stops the ray, false if the block transmits the ray
@@ -763,10 +987,10 @@ namespace Stg
   {
   public:
     Ray( const Model* mod, const Pose& origin, const meters_t range, const ray_test_func_t func, const void* arg, const bool ztest ) :
-      mod(mod), origin(origin), range(range), func(func), arg(arg), ztest(ztest)
+      mod(mod), origin(origin), range(range), func(func), arg(arg), ztest(ztest), layer(-1)
     {}
 
-    Ray() : mod(NULL), origin(0,0,0,0), range(0), func(NULL), arg(NULL), ztest(true)
+    Ray() : mod(NULL), origin(0,0,0,0), range(0), func(NULL), arg(NULL), ztest(true), layer(-1)
     {}
 		
     const Model* mod;
@@ -775,6 +999,23 @@ namespace Stg
     ray_test_func_t func;
     const void* arg;
     bool ztest;		    
+    /** the layer of the occupancy grid to trace in, or -1 for the
+	one sensors updating now trace in. A ray with a layer of its
+	own is never answered from another ray's walk. */
+    int layer;
+  };
+
+  /** A block met by a ray, as reported by World::RaytraceAll() */
+  class RaytraceHit
+  {
+  public:
+    Model* mod; ///< the model that owns the block
+    Bounds z; ///< the block's extent in global z
+    meters_t range; ///< distance along the ray to the block
+    Block* block; ///< the block itself
+
+    RaytraceHit( Model* mod, const Bounds& z, meters_t range, Block* block ) 
+      : mod(mod), z(z), range(range), block(block) {}
   };
 		
 
@@ -816,6 +1057,9 @@ namespace Stg
   };
 
   class ModelPosition;
+  class ModelRanger;
+  class ModelWifi;
+  class WifiNetwork;
 
   /// %World class
   class World : public Ancestor
@@ -824,8 +1068,10 @@ namespace Stg
     friend class Block;
     friend class Model; // allow access to private members
     friend class ModelFiducial;
+    friend class ModelWifi;
     friend class Canvas;
     friend class WorkerThread;
+    friend class BlockGroup;
 
   public: 
     /** contains the command line arguments passed to Stg::Init(), so
@@ -842,6 +1088,8 @@ namespace Stg
 	 
     bool destroy;
     bool dirty; ///< iff true, a gui redraw would be required
+    bool loading; ///< iff true, Load() is reading the worldfile, so blocks are not rendered yet
+    bool show_load_times; ///< iff true, Load() prints how long each of its phases took
 	 
     /** Pointers to all the models in this world. */
     std::set<Model*> models;
@@ -895,8 +1143,9 @@ namespace Stg
     //--- thread sync ----
     pthread_mutex_t sync_mutex; ///< protect the worker thread management stuff
     unsigned int threads_working; ///< the number of worker threads not yet finished
+    unsigned int threads_started; ///< the number of times the worker threads have been started
     pthread_cond_t threads_start_cond; ///< signalled to unblock worker threads
-    pthread_cond_t threads_done_cond; ///< signalled by last worker thread to unblock main thread
+    pthread_cond_t jobs_cond; ///< signalled when jobs are queued or finished, and by the last worker thread to finish
     int total_subs; ///< the total number of subscriptions to all models
     unsigned int worker_threads; ///< the number of worker threads to use
     
@@ -913,8 +1162,23 @@ namespace Stg
     std::list<float*> ray_list;///< List of rays traced for debug visualization
     usec_t sim_time; ///< the current sim time in this world in microseconds
     std::map<point_int_t,SuperRegion*> superregions;
+
+    /** Collision broad phase: for each of the two bitmap layers, a
+	spatial hash of the pixel-space bounding boxes of the rendered
+	blocks, bucketed by region coordinates. A block whose box
+	spans many regions, such as the outline of a bitmap map, would
+	overlap everything inside it, so it is left out and counted in
+	Region::broad_count of the regions its cells are in instead. */
+    std::map<point_int_t,std::vector<Block*> > bbox_buckets[2];
+
+    /** Add a rendered block's bounding box to the broad phase hash. */
+    void BroadPhaseInsert( Block* block, unsigned int layer );
+    /** Remove a block's bounding box from the broad phase hash. */
+    void BroadPhaseRemove( Block* block, unsigned int layer );
 	 
     uint64_t updates; ///< the number of simulated time steps executed so far
+    uint64_t vis_epoch; ///< bumped whenever a model's visibility to sensors is changed
+    WifiNetwork* wifi_network; ///< shared by this world's wifi models, if it has any
     Worldfile* wf; ///< If set, points to the worldfile used to create this world
 
     void CallUpdateCallbacks(); ///< Call all calbacks in cb_list, removing any that return true;
@@ -977,6 +1241,38 @@ namespace Stg
 		  Block* block,
 		  unsigned int layer );
 
+    /** Add the block to the raytrace bitmap cells x0 to x1-1 in row
+	y. Used to render map blocks a run of cells at a time. */
+    void MapRun( int32_t y, int32_t x0, int32_t x1,
+		 Block* block,
+		 unsigned int layer );
+
+    /** Read-only counterpart of MapPoly(). Returns the first obstacle
+	model that would collide with the block if it was rendered with
+	the outline poly, or NULL if none would. */
+    Model* TestPolyCollision( const std::vector<point_int_t>& poly,
+			      const Block* block,
+			      unsigned int layer );
+
+    /** Collision broad phase. Returns true iff the bounding box of a
+	block belonging to an obstacle model not related to mod, or a
+	cell holding part of a block too big to hash, overlaps mod's
+	cached bounding box, grown by margin pixels on each side, in
+	the indicated layer. If false, no block of mod can collide
+	with anything in that layer. */
+    bool BroadPhaseTest( const Model* mod, unsigned int layer, int32_t margin=0 );
+
+    /** Move each model in mods to a random pose inside the rectangle
+	[xmin..xmax, ymin..ymax] in world coordinates where it collides
+	with nothing. Candidate positions come from an index of free
+	cells built once from the occupancy grid, so placing many
+	models costs little more than placing one. Models are placed in
+	order and never overlap each other. Returns the number of models
+	placed; the others keep their pose. */
+    unsigned int PlaceInFreeSpace( const std::vector<Model*>& mods,
+				   meters_t xmin, meters_t xmax, 
+				   meters_t ymin, meters_t ymax );
+
     SuperRegion* AddSuperRegion( const point_int_t& coord );
     SuperRegion* GetSuperRegion( const point_int_t& org );
     SuperRegion* GetSuperRegionCreate( const point_int_t& org );
@@ -1001,15 +1297,122 @@ namespace Stg
     SuperRegion* CreateSuperRegion( point_int_t origin );
     void DestroySuperRegion( SuperRegion* sr );
 	 	
-    /** trace a ray. */
+    /** Call func( args[i] ) for every i, sharing the calls between
+	the calling thread and any threads in the worker pool that are
+	idle, and return when they have all finished. The calls must be
+	safe to run in parallel. Used to split up the work of a single
+	large sensor update. */
+    void RunJobs( job_func_t func, const std::vector<void*>& args );
+
+    /** Bitmaps decoded by DecodeBitmaps() ahead of the models that
+	use them, keyed on the bitmap's path and BlockGroup::BitmapMode. */
+    std::map<std::pair<std::string,int>,BitmapShapes> decoded_bitmaps;
+
+    /** Decode every bitmap that a model in the worldfile names, each
+	once however many models use it, in parallel on the worker
+	threads. BlockGroup::LoadBitmap() then takes the shapes from
+	decoded_bitmaps. */
+    void DecodeBitmaps();
+
+    /** The Init() function of each controller module opened so far,
+	keyed on the module's name, so that a module is opened once
+	however many models it controls. */
+    std::map<std::string,model_callback_t> ctrl_initfuncs;
+
+    /** The snapshot being loaded, mapped into memory by
+	LoadSnapshot(), or NULL */
+    const uint8_t* snapshot_data;
+    size_t snapshot_size;
+    size_t snapshot_occupancy; ///< offset of its occupancy section
+
+    /** If the file is a snapshot made by SaveSnapshot(), map it into
+	memory, restore the worldfile and decoded_bitmaps from it and
+	return true. Returns false if the file is not a snapshot. Quits
+	if it is one that this version of Stage can't read. */
+    bool LoadSnapshot( const std::string& filename );
+
+    /** Append the contents of every occupancy cell to buf, with the
+	blocks numbered model by model in worldfile order. Returns
+	false if a cell holds a block that does not belong to a
+	worldfile model, so that the occupancy can't be saved. */
+    bool SaveOccupancy( std::string& buf );
+
+    /** Render every block into the cells recorded in the occupancy
+	section of the snapshot being loaded, instead of rasterizing
+	it, then release the snapshot. Returns false, rendering
+	nothing, if the snapshot has no occupancy section or it does
+	not match the models. */
+    bool RestoreOccupancy();
+
+    /** Add the blocks to the cells listed in the occupancy section
+	from pos to end, and restore the bounding boxes that go with
+	them. Returns false, leaving every block unrendered, if the
+	section does not match the models. */
+    bool MapOccupancy( const uint8_t* pos, const uint8_t* end );
+
+    /** The buffers made by Checkpoint(), by handle */
+    std::map<checkpoint_t,std::string> checkpoints;
+    checkpoint_t next_checkpoint;
+
+    /** The children made by the last Fork() that have not been
+	joined: their process ids, and the pipes their reports come
+	down */
+    std::vector<std::pair<pid_t,int> > forks;
+    /** In a child made by Fork(), the pipe to the parent, else -1 */
+    int fork_report;
+
+    /** trace a ray. While models are being updated, a ray that
+	shares its origin and heading with one already traced in this
+	update is usually answered from that ray's
+	walk: see the "raytrace_fusion" worldfile property. */
     RaytraceResult Raytrace( const Ray& ray );
+
+    /** trace a ray that does not stop at the first hit: every block
+	on the ray that satisfies the ray's predicate is appended to
+	hits, nearest first. */
+    void RaytraceAll( const Ray& ray, std::vector<RaytraceHit>& hits );
+
+    /** trace several rays that share an origin and heading but have
+	their own predicate, range and z test, walking the grid only
+	once. results[i] is set to the first hit that satisfies
+	rays[i]. This matches Raytrace( rays[i] ) to within a cell: the
+	shared walk is as long as the longest ray, so its path through
+	the grid can differ slightly from a shorter ray's own. */
+    void Raytrace( const std::vector<Ray>& rays, 
+		   std::vector<RaytraceResult>& results );
+
+    /** trace a vertical fan of rays that share the origin and heading
+	of ray, in a single walk through the grid. Channel k climbs
+	slopes[k] meters per meter travelled horizontally. ranges[k]
+	is set to the horizontal distance at which the channel first
+	passes through a block that satisfies ray's predicate, or
+	reaches the ground at z=0, or else to ray.range. hits[k] is
+	the model hit, or NULL for the ground or no hit. ray.ztest is
+	ignored. */
+    void RaytraceChannels( const Ray& ray, 
+			   const std::vector<double>& slopes,
+			   std::vector<meters_t>& ranges,
+			   std::vector<Model*>& hits );
+
+    /** Returns a number that changes whenever a block enters or
+	leaves a cell of the indicated layer of the occupancy grid
+	inside the box [min,max] in global coordinates, or a model's
+	visibility to sensors is changed with one of its Set*Return()
+	methods. Sensors can compare it with the value from their last
+	trace to tell whether tracing again could give a different
+	result. Cells are watched a region at a time, so the number
+	also changes for some cells near the box. */
+    uint64_t OccupancyEpoch( unsigned int layer, const point_t& min, const point_t& max );
     
+    /** trace a ray as Raytrace( const Ray& ), in the given layer of
+	the occupancy grid: see Ray::layer */
     RaytraceResult Raytrace( const Pose& pose, 			 
 			     const meters_t range,
 			     const ray_test_func_t func,
 			     const Model* finder,
 			     const void* arg,
-			     const bool ztest );
+			     const bool ztest,
+			     const int layer = -1 );
     
     void Raytrace( const Pose &gpose, // global pose
 		   const meters_t range,
@@ -1018,7 +1421,8 @@ namespace Stg
 		   const Model* model,			 
 		   const void* arg,
 		   const bool ztest,		      
-		   std::vector<RaytraceResult>& results );
+		   std::vector<RaytraceResult>& results,
+		   const int layer = -1 );
 		
     /** Enlarge the bounding volume to include this point */
     inline void Extend( point3_t pt );
@@ -1041,6 +1445,28 @@ namespace Stg
     bool PastQuitTime();
 				
     static void* update_thread_entry( std::pair<World*,int>* info );
+
+    /** Start the worker threads that consume event queues 1 and up */
+    void StartThreads();
+
+    /** A piece of work queued by RunJobs() */
+    class Job
+    {
+    public:
+      job_func_t func;
+      void* arg;
+      unsigned int* pending; ///< jobs not yet finished in this job's batch
+      
+      Job( job_func_t func, void* arg, unsigned int* pending ) 
+	: func(func), arg(arg), pending(pending) {}
+    };
+    
+    std::deque<Job> jobs; ///< jobs waiting for a thread, protected by sync_mutex
+    
+    /** Run the next queued job, if any, and return true, or return
+	false if there are none. Call with sync_mutex locked: it is
+	unlocked while the job runs. */
+    bool RunJob();
     
     class Event
     {
@@ -1087,8 +1513,33 @@ namespace Stg
     /** Set of models that require their positions to be recalculated at each World::Update(). */
     std::set<ModelPosition*> active_velocity;
     
+    /** Walk the cells along ray r, nearest first, calling visit(
+	model, z, range, block ) for every block found that passes the ray's z
+	test, until visit returns true. The ray's predicate is not
+	applied: that is up to the visitor. Defined in world.cc. */
+    template <class Visitor>
+    void RaytraceWalk( const Ray& r, Visitor& visit );
+
+    /** Records the blocks met by recent rays, so that a second sensor
+	tracing the same beam in the same update can test its own
+	predicate against them instead of walking the grid
+	again. Defined in world.cc. */
+    class RayMemo;
+    RayMemo* ray_memo;
+    bool ray_fusion; ///< iff true, sensors may share walks via the memos
+    bool ray_fusion_active; ///< true while sensors are being updated
+    
     /** The amount of simulated time to run for each call to Update() */
     usec_t sim_interval;
+
+    /** Bounds on sim_interval in adaptive timestep mode, which is
+	enabled iff sim_interval_max is non-zero. */
+    usec_t sim_interval_min, sim_interval_max;
+
+    /** Choose the length of the next time step in adaptive timestep
+	mode: as long as possible without passing the next scheduled
+	event, but short when a moving robot is close to an obstacle. */
+    usec_t AdaptiveInterval();
 		
     // debug instrumentation - making sure the number of update callbacks
     // in each thread is consistent with the number that have been
@@ -1121,6 +1572,12 @@ namespace Stg
   	
     /** Returns the current simulated time in this world, in microseconds. */
     usec_t SimTimeNow(void) const { return sim_time; }
+
+    /** Returns the average number of Update() steps run per simulated
+	second so far. This is fixed unless adaptive timestep mode is
+	enabled. */
+    double StepsPerSimSecond(void) const 
+    { return( sim_time > 0 ? (double)updates * 1e6 / (double)sim_time : 0.0 ); }
 		
     /** Returns a pointer to the currently-open worlddfile object, or
 	NULL if there is none. */
@@ -1135,7 +1592,8 @@ namespace Stg
 	object, read the file and configure the world from the
 	contents, creating models as necessary. The created object
 	persists, and can be retrieved later with
-	World::GetWorldFile(). */
+	World::GetWorldFile(). The file may instead be a snapshot
+	written by SaveSnapshot(). */
     virtual void Load( const std::string& worldfile_path );
 
     virtual void UnLoad();
@@ -1146,6 +1604,65 @@ namespace Stg
 	filename.  @param Filename to save as. */
     virtual bool Save( const char* filename );
 
+    /** Save the current world state into a binary snapshot with the
+	given filename: the parsed worldfile, the shapes decoded from
+	its bitmaps and the contents of the occupancy grid. Load()
+	accepts a snapshot in place of a worldfile, and reads it back
+	without parsing, decoding or rasterizing anything. A snapshot
+	can be read only by the version of Stage that wrote it, on the
+	same kind of machine. Returns true on success. */
+    bool SaveSnapshot( const std::string& filename );
+
+    /** Capture the state of the simulation that changes as it runs
+	into a buffer held by the world: the clock, the poses and
+	parents of the models, their velocities and goals, powerpack
+	charges, gripper and ranger state, the pending events and the
+	state of drand48(). Returns a handle for Restore(). Call it
+	between updates, or from an update callback. State kept by
+	controllers, and the models' configuration, are not
+	captured. */
+    checkpoint_t Checkpoint();
+
+    /** Return the simulation to the state captured by
+	Checkpoint(). Only the models whose rendering in the occupancy
+	grid differs from the checkpoint are rendered again. Returns
+	false, changing nothing, if the handle is unknown, if models
+	have been added, removed, subscribed or unsubscribed since the
+	checkpoint, or if the checkpoint is incomplete. It also
+	returns false if a model can't read back the state it saved,
+	which means its SaveState() and LoadState() disagree; the
+	rest of the world is restored then. The checkpoint can be
+	restored again. */
+    bool Restore( checkpoint_t handle );
+
+    /** Free the buffer of a checkpoint that is no longer needed */
+    void ReleaseCheckpoint( checkpoint_t handle )
+    { checkpoints.erase( handle ); }
+
+    /** Split the process into the given number of children, each
+	holding a copy of the simulation as it stands, to be run on
+	independently, e.g. to try a different controller policy from
+	the same state. The children share the memory of the parent,
+	including the static map and block geometry, until they write
+	to it, so a fork costs a few page copies rather than a load.
+	Returns the number of the child, from 1, in each child, and 0
+	in the parent, which must then call ForkJoin(). Only this
+	world runs in the children. Children draw the same random
+	numbers as the parent would have. Call it between updates, or
+	from an update callback. A world with a GUI can't be forked,
+	and -1 is returned. */
+    int Fork( unsigned int children );
+
+    /** In a child made by Fork(), send report to the parent, for
+	ForkJoin(), and end the child. */
+    void ForkReturn( const std::string& report );
+
+    /** In the parent, wait for the children made by the last Fork()
+	to end, and fill in reports with what each sent to
+	ForkReturn(), in order of their numbers. Returns false if any
+	child failed to start, crashed, or exited with an error. */
+    bool ForkJoin( std::vector<std::string>& reports );
+
     /** Run one simulation timestep. Advances the simulation clock,
 	executes all simulation updates due at the current time, then
 	queues up future events. */
@@ -1187,6 +1704,9 @@ namespace Stg
     /** Return the number of times the world has been updated. */
     uint64_t GetUpdateCount() const { return updates; }
 
+    /** Return the number of worker threads set by the worldfile */
+    unsigned int GetWorkerThreads() const { return worker_threads; }
+
     /// Register an Option for pickup by the GUI
     void RegisterOption( Option* opt );	
 	 
@@ -1218,6 +1738,17 @@ namespace Stg
     
     /** A from-file  constructor */
     Block( BlockGroup* group, Worldfile* wf, int entity);
+
+    /** A map block constructor. The block covers the raster's dark
+	pixels, given one byte per pixel row by row from the top, and
+	is rendered by writing them straight into the cells under it
+	instead of by tracing polygon edges. Its points are the
+	raster's bounding rectangle, in the pixel coordinates used by
+	polys_from_image_file(). */
+    Block( BlockGroup* group,
+	   const std::vector<uint8_t>& raster,
+	   uint32_t width, uint32_t height,
+	   const Bounds& zrange );
     
     ~Block();
     
@@ -1226,6 +1757,11 @@ namespace Stg
     
     /** remove the block from the world's raytracing data structure */
     void UnMap( unsigned int layer );	 
+
+    /** Re-render the block at its current global pose, but only if
+	that puts it on different bitmap cells or changes its z
+	extent. Returns true iff the block was re-rendered. */
+    bool Remap( unsigned int layer );
     
     /** draw the block in OpenGL as a solid single color */    
     void DrawSolid(bool topview);
@@ -1256,8 +1792,10 @@ namespace Stg
 		
     void AppendTouchingModels( std::set<Model*>& touchers );
 	 
-    /** Returns the first model that shares a bitmap cell with this model */
-    Model* TestCollision(); 
+    /** Returns the first model that shares a bitmap cell with this
+	model. If narrow is false, the broad phase has already ruled
+	out contact with other models and only the ground is tested. */
+    Model* TestCollision( bool narrow=true ); 
 
     void Load( Worldfile* wf, int entity );  
     
@@ -1276,6 +1814,38 @@ namespace Stg
 	bitmap layers.*/  
     std::vector<Cell*> rendered_cells[2];
 
+    /** pixel-space bounding box of the cells this block was last
+	rendered into, one per bitmap layer. Valid only while
+	rendered_cells[layer] is not empty. */
+    point_int_t bbox_min[2], bbox_max[2];
+
+    /** the global pixel coordinates of the vertices of the polygon
+	last rendered into each bitmap layer */
+    std::vector<point_int_t> rendered_pts[2];
+
+    /** for a map block, the dark pixels it covers, row by row from
+	the top of the rectangle pts. Empty for a polygon block. */
+    std::vector<uint8_t> raster;
+    uint32_t raster_width, raster_height;
+
+    /** render the polygon with vertices at the given global pixel
+	coordinates */
+    void MapPixels( const std::vector<point_int_t>& pixels, unsigned int layer );
+
+    /** render a map block whose corners are at the given global
+	pixel coordinates, resampling its raster onto the cells */
+    void MapRaster( const std::vector<point_int_t>& pixels, unsigned int layer );
+
+    /** the local coordinates of the point u pixels across and v
+	pixels down a map block's raster */
+    point_t RasterPoint( double u, double v ) const;
+
+    /** draw a box for every run of dark pixels in a map block's raster */
+    void DrawRaster( bool top, bool sides, meters_t z );
+
+    /** the global z extent of the block at its current pose */
+    Bounds GlobalZ() const;
+
     void DrawTop();
     void DrawSides();
   };
@@ -1310,10 +1880,45 @@ namespace Stg
     void Map( unsigned int layer );
     /** Removes all blocks from the bitmap at the indicated layer.*/
     void UnMap( unsigned int layer );
+    /** Re-renders only the blocks that moved to different cells.
+	Returns true iff any block was re-rendered. */
+    bool Remap( unsigned int layer );
+
+    /** Recompute the owning model's cached bounding box in the
+	indicated layer from those of the blocks. */
+    void CacheBoundingBox( unsigned int layer );
 		
-    /** Interpret the bitmap file as a set of rectangles and add them
-	as blocks to this group.*/
-    void LoadBitmap( const std::string& bitmapfile, Worldfile *wf );
+  public:
+    /** Define how a bitmap is turned into blocks */
+    typedef enum
+      { BITMAP_OUTLINES, ///< a block per traced outline
+	BITMAP_RECTS, ///< a block per rectangle: see rects_from_image_file()
+	BITMAP_CELLS ///< a single map block, written straight into the cells
+      } BitmapMode;
+
+    /** Turn the bitmap file into shapes as LoadBitmap() does, but
+	without adding any blocks. Several bitmaps can be decoded at
+	once on different threads: only images other than PNG and JPEG
+	files are loaded one at a time. */
+    static void DecodeBitmap( const std::string& filename, BitmapMode mode,
+			      bool cache, BitmapShapes& shapes );
+
+    /** Return the mode asked for by the bitmap_cells and bitmap_rects
+	properties of the worldfile entity. */
+    static BitmapMode ReadBitmapMode( Worldfile* wf, int entity );
+
+    /** Return the path of a bitmap named in the worldfile. Relative
+	names are relative to the worldfile's directory. */
+    static std::string BitmapPath( const std::string& bitmapfile, Worldfile* wf );
+
+  private:
+    /** Interpret the bitmap file as a set of polygons, or as a map
+	block, and add them as blocks to this group. If cache is true,
+	the results are kept in a cache file next to the bitmap and
+	read back from it while the bitmap is unchanged: see
+	map_cache_read(). */
+    void LoadBitmap( const std::string& bitmapfile, Worldfile *wf,
+		     BitmapMode mode=BITMAP_OUTLINES, bool cache=false );
 
     /** Add a new block decribed by a worldfile entry. */
     void LoadBlock( Worldfile* wf, int entity );
@@ -1339,6 +1944,12 @@ namespace Stg
     ~BlockGroup();
     
     uint32_t GetCount() const { return blocks.size(); };
+    /** Return the total number of vertices of the member blocks. */
+    size_t GetVertexCount() const;
+    /** Return the number of bitmap cells the member blocks were last
+	rendered into in the indicated layer, counting shared cells
+	once per block. */
+    size_t GetCellCount( unsigned int layer ) const;
     const Block& GetBlock( unsigned int index ) const { return blocks[index]; }; 
     Block& GetBlockMutable( unsigned int index ) { return blocks[index]; }; 
 
@@ -1723,6 +2334,14 @@ namespace Stg
 	 
     /** Lose energy as work or heat, and record the event */
     void Dissipate( joules_t j, const Pose& p );
+
+    /** Append the charge and the charging state to buf, for
+	World::Checkpoint() */
+    void SaveState( std::string& buf ) const;
+
+    /** Read back the state written by SaveState(). Returns false if
+	buf ends early. */
+    bool LoadState( const uint8_t*& pos, const uint8_t* end );
   };
 
    
@@ -1760,6 +2379,17 @@ namespace Stg
 
     BlockGroup blockgroup;
 
+    /** Cached pixel-space bounding box of this model's blocks, as last
+	rendered into each of the two bitmap layers. Updated by
+	BlockGroup::Map() and used by the collision broad phase. */
+    point_int_t bbox_min[2], bbox_max[2];
+    /** true iff no block was rendered into the layer at the last Map() */
+    bool bbox_empty[2];
+    /** Our pose when the blocks were last rendered into each of the
+	two bitmap layers. World::Restore() renders the blocks again
+	only where this differs from the checkpoint. */
+    Pose map_pose[2];
+
     /** Iff true, 4 thin blocks are automatically added to the model,
 	forming a solid boundary around the bounding box of the
 	model. */
@@ -2073,6 +2703,21 @@ namespace Stg
 	collision with, or NULL if no collision exists.  Recursively
 	calls TestCollision() on all descendents. */		
     Model* TestCollision();
+
+    /** Conservative continuous collision test for a straight-line
+	move of this model from pose from to pose to. Traces the outline
+	of the convex hull of each block's start and end footprints
+	through the indicated bitmap layer, without modifying it.
+	Returns the first obstacle found, or NULL if the path is
+	clear. Recursively includes all descendents. */
+    Model* TestSweptCollision( const Pose& from, const Pose& to, unsigned int layer );
+
+    /** Append the global pixel coordinates of each of this model's
+	and its descendents' block vertices at their current poses to
+	the vector with the same index, creating vectors as needed. */
+    void AppendFootprints( std::vector<const Block*>& blocks,
+			   std::vector<std::vector<point_int_t> >& pixels,
+			   size_t& index ) const;
   
     void CommitTestedPose();
 
@@ -2088,6 +2733,11 @@ namespace Stg
 
     void MapWithChildren( unsigned int layer );
     void UnMapWithChildren( unsigned int layer );
+
+    /** Re-render the blocks of this model and its descendents that
+	moved to different bitmap cells since they were last rendered
+	into the layer. Returns true iff any block was re-rendered. */
+    bool RemapWithChildren( unsigned int layer );
   
     // Find the root model, and map/unmap the whole tree.
     void MapFromRoot( unsigned int layer );
@@ -2177,6 +2827,10 @@ namespace Stg
     //void RecordRenderPoint( GSList** head, GSList* link, 
     //					unsigned int* c1, unsigned int* c2 );
 
+    /** If the model collides with anything, move it to a random pose
+	inside the rectangle [xmin..xmax, ymin..ymax] where it does
+	not. The rectangle is in world coordinates. See
+	World::PlaceInFreeSpace() to place many models at once. */
     void PlaceInFreeSpace( meters_t xmin, meters_t xmax, 
 			   meters_t ymin, meters_t ymax );
 	
@@ -2230,6 +2884,16 @@ namespace Stg
 	
     /** save the state of the model to the current world file */
     virtual void Save();
+
+    /** Append the state of the model that changes as the simulation
+	runs to buf, for World::Checkpoint(). The pose, parent and
+	subscriptions are saved by the world. Subclasses with more
+	such state override this, calling the base class first. */
+    virtual void SaveState( std::string& buf ) const;
+
+    /** Read back the state written by SaveState(), for
+	World::Restore(). Returns false if buf ends early. */
+    virtual bool LoadState( const uint8_t*& pos, const uint8_t* end );
 	
     /** Call Init() for all attached controllers. */
     void InitControllers();
@@ -2282,6 +2946,10 @@ namespace Stg
 
     /** Returns a pointer to the world that contains this model */
     World* GetWorld() const { return this->world; }
+
+    /** Returns a const reference to the blocks that make up this
+	model's body */
+    const BlockGroup& GetBlockGroup() const { return blockgroup; }
   
     /** return the root model of the tree containing this model */
     Model* Root(){ return(  parent ? parent->Root() : this ); }
@@ -2475,9 +3143,42 @@ namespace Stg
 	to add and remove colors at run time.*/
     std::vector<Color> colors;
 
+    /** The colors above packed by ColorKey() and sorted, for fast
+	lookup while segmenting. Rebuilt whenever colors changes. */
+    std::vector<uint32_t> color_keys;
+
+    /** If non-negative, the index of the sensor on a sibling ranger
+	whose beams we use instead of tracing our own. */
+    int ranger_sensor;
+
+    /** The sibling ranger, found on the first update. */
+    ModelRanger* ranger;
+
     // predicate for ray tracing
     static bool BlockMatcher( Block* testblock, Model* finder );
 
+    /** Pack a color's RGB components into 8 bits each, ignoring alpha */
+    static uint32_t ColorKey( const Color& col );
+
+    void UpdateColorKeys();
+
+    /** Find the sibling ranger named by ranger_sensor and start
+	receiving its beams. Returns false if there is none. */
+    bool AttachRanger();
+    void DetachRanger();
+
+    /** Deferred updates. Only our own raytrace can be deferred: with
+	a ranger's beams to read, the blobs are found eagerly. */
+    LazyUpdate lazy;
+
+    /** Find the blobs seen from global pose gpose, in the given
+	layer of the occupancy grid: see Ray::layer */
+    void Detect( const Pose& gpose, int layer = -1 );
+
+    /** Do any update deferred in lazy mode */
+    void Refresh()
+    { if( lazy.Claim() ) Detect( lazy.pose, lazy.layer ); }
+
   public:
     radians_t fov; ///< Horizontal field of view in radians, in the range 0 to pi.
     radians_t pan; ///< Horizontal pan angle in radians, in the range -pi to +pi.
@@ -2501,11 +3202,22 @@ namespace Stg
 	data. Use this if you don't need to modify the model's
 	internal data, e.g. if you want to copy it into a new
 	vector.*/
-    const std::vector<Blob>& GetBlobs() const { return blobs; }
+    const std::vector<Blob>& GetBlobs() const 
+    { 
+      const_cast<ModelBlobfinder*>(this)->Refresh(); // discard const
+      return blobs; 
+    }
 
     /** Returns a mutable reference to the model's internal detected
 	blob data. Use this with caution, if at all. */
-    std::vector<Blob>& GetBlobsMutable() { return blobs; }
+    std::vector<Blob>& GetBlobsMutable() { Refresh(); return blobs; }
+
+    /** Defer updates until the blobs are read (the worldfile's lazy
+	property). See LazyUpdate. */
+    void SetLazy( bool enable ) { lazy.enabled = enable; }
+
+    /** Counts of deferred updates that were done or skipped */
+    const LazyUpdate& GetLazy() const { return lazy; }
 
     /** Start finding blobs with this color.*/
     void AddColor( Color col );
@@ -2597,8 +3309,30 @@ namespace Stg
     void UpdateBreakBeams();
     void UpdateContacts();
 
+    /** Trace the break beams and contacts into cfg.beam and
+	cfg.contact, unless nothing they could see has changed since
+	the last trace in the same layer of the occupancy grid. */
+    void TraceBeams();
+
     config_t cfg;
     cmd_t cmd;
+
+    /** The inputs and results of the last beam and contact traces in
+	one layer of the occupancy grid */
+    class BeamCache
+    {
+    public:
+      bool valid;
+      Pose pose; ///< our global pose
+      Geom geom;
+      double paddle_position;
+      uint64_t epoch; ///< World::OccupancyEpoch() of our footprint
+      Model* beam[2];
+      Model* contact[2];
+
+      BeamCache() : valid(false), pose(), geom(), paddle_position(0), epoch(0)
+      { beam[0] = beam[1] = contact[0] = contact[1] = NULL; }
+    } beam_cache[2];
 	 
     Block* paddle_left;
     Block* paddle_right;
@@ -2617,9 +3351,16 @@ namespace Stg
   
     virtual void Load();
     virtual void Save();
+    virtual void SaveState( std::string& buf ) const;
+    virtual bool LoadState( const uint8_t*& pos, const uint8_t* end );
 
     /** Configure the gripper */
-    void SetConfig( config_t & newcfg ){ this->cfg = newcfg; FixBlocks(); }
+    void SetConfig( config_t & newcfg )
+    { 
+      this->cfg = newcfg; 
+      FixBlocks(); 
+      beam_cache[0].valid = beam_cache[1].valid = false;
+    }
 	 
     /** Returns the state of the gripper .*/
     config_t GetConfig(){ return cfg; };
@@ -2672,8 +3413,44 @@ namespace Stg
     };
 
   private:
-    // if neighbor is visible, add him to the fiducial scan
-    void AddModelIfVisible( Model* him );
+    /** A model in range and in our field of view when an update came
+	due, and where it was then */
+    class Target
+    {
+    public:
+      Model* mod;
+      Pose pose; ///< his global pose
+      meters_t range; ///< range to him
+      radians_t bearing; ///< bearing to him, relative to our heading
+    };
+
+    /** The targets found at the last update, waiting for their line
+	of sight tests */
+    std::vector<Target> targets;
+
+    // if neighbor is in range and in view from global pose gp, add
+    // him to the targets
+    void AddTargetIfInView( Model* him, const Pose& gp );
+
+    // if the target is visible from global pose gp, add him to the
+    // fiducial scan
+    void AddModelIfVisible( const Target& target, const Pose& gp, int layer );
+
+    /** Find the targets in range and in view from global pose gp */
+    void FindTargets( const Pose& gp );
+
+    /** Find the fiducials among the targets seen from global pose
+	gp, in the given layer of the occupancy grid: see Ray::layer */
+    void Detect( const Pose& gp, int layer = -1 );
+
+    /** Deferred updates. Our own pose and the targets are recorded
+	when an update comes due, as the other models move before the
+	data is read. Only the line of sight tests are deferred. */
+    LazyUpdate lazy;
+
+    /** Do any update deferred in lazy mode */
+    void Refresh()
+    { if( lazy.Claim() ) Detect( lazy.pose, lazy.layer ); }
 
     virtual void Update();
     virtual void DataVisualize( Camera* cam );
@@ -2701,14 +3478,22 @@ namespace Stg
     bool ignore_zloc;  ///< Are we ignoring the Z-loc of the fiducials we detect compared to the fiducial detector?	
 		
     /** Access the dectected fiducials. C++ style. */
-    std::vector<Fiducial>& GetFiducials() { return fiducials; }
+    std::vector<Fiducial>& GetFiducials() { Refresh(); return fiducials; }
 		
     /** Access the dectected fiducials, C style. */
     Fiducial* GetFiducials( unsigned int* count )
     {
+      Refresh();
       if( count ) *count = fiducials.size();
       return &fiducials[0];
     }
+
+    /** Defer updates until the fiducials are read (the worldfile's
+	lazy property). See LazyUpdate. */
+    void SetLazy( bool enable ) { lazy.enabled = enable; }
+
+    /** Counts of deferred updates that were done or skipped */
+    const LazyUpdate& GetLazy() const { return lazy; }
   };
 	
 	
@@ -2751,6 +3536,56 @@ namespace Stg
       std::vector<meters_t> ranges;
       std::vector<double> intensities;
       std::vector<double> bearings;
+
+      /** Number of blobfinders reading this sensor's beams (see the
+	  blobfinder's "ranger" property). While non-zero, each beam
+	  also finds the first model visible to a blobfinder, out to
+	  blob_range, and stores it in blob_hits. */
+      unsigned int blob_subs;
+      meters_t blob_range;
+      std::vector<RaytraceResult> blob_hits;
+
+      /** Number of vertical channels. With more than one, the sensor
+	  is a multi-layer (3D) lidar: each of the sample_count beams
+	  is a vertical fan of channels spread evenly over vfov. */
+      unsigned int channels;
+
+      /** Elevation of the lowest and highest channels, in radians */
+      Bounds vfov;
+
+      /** The hit points of a multi-layer sensor in the sensor's own
+	  frame, the channels of each beam together: channel k of
+	  beam t is points[t*channels+k]. A channel that hits nothing
+	  gives the point at its maximum range. ranges, intensities
+	  and bearings hold the channel nearest the horizontal. */
+      std::vector<point3_t> points;
+
+      /** Scans of at least twice this many beams are split into
+	  chunks of at least this many beams, which the world's worker
+	  threads can trace in parallel. Zero disables splitting. */
+      unsigned int chunk_size;
+
+      /** Noise added to the data in Update(), all zero (off) by
+	  default. Range noise is Gaussian, with standard deviation
+	  sqrt( noise_range^2 + (noise_proportional*range)^2 ). A
+	  beam drops out (range 0, below any valid reading) with
+	  probability noise_dropout, or reports range.max with
+	  probability noise_maxrange. Each beam is traced at its
+	  bearing plus Gaussian jitter with standard deviation
+	  noise_bearing, but reports its nominal bearing. Each point
+	  of a multi-layer sensor gets range noise along its own ray,
+	  and the beam's range the same noise as its level channel's
+	  point. A dropout or max-range return moves all of a beam's
+	  points. */
+      meters_t noise_range;
+      double noise_proportional;
+      double noise_dropout;
+      double noise_maxrange;
+      radians_t noise_bearing;
+
+      /** per-beam heading jitter for the current scan, empty if
+	  noise_bearing is zero */
+      std::vector<radians_t> jitter;
 			
       Sensor() : pose( 0,0,0,0 ), 
 		 size( 0.02, 0.02, 0.02 ), // teeny transducer
@@ -2760,10 +3595,52 @@ namespace Stg
 		 color( Color(0,0,1,0.15)),
 		 ranges(),
 		 intensities(),
-		 bearings()
+		 bearings(),
+		 blob_subs(0),
+		 blob_range(0),
+		 blob_hits(),
+		 channels(1),
+		 vfov( -M_PI/12.0, M_PI/12.0 ),
+		 points(),
+		 chunk_size(256),
+		 noise_range(0),
+		 noise_proportional(0),
+		 noise_dropout(0),
+		 noise_maxrange(0),
+		 noise_bearing(0),
+		 jitter()
       {}
 			
+      /** Trace the scan from the ranger's current pose */
       void Update( ModelRanger* rgr );			
+
+      /** Trace the scan from origin, the global pose of the ranger's
+	  own frame, in the given layer of the occupancy grid: see
+	  Ray::layer */
+      void Update( ModelRanger* rgr, const Pose& origin, int layer = -1 );
+
+      /** Trace beams [first,last), the first from origin, in global
+	  coords. Update() calls this for the whole scan or for chunks
+	  of it. */
+      void TraceBeams( ModelRanger* rgr, const Pose& origin, size_t first, size_t last, int layer = -1 );
+      void TraceChannels( ModelRanger* rgr, const Pose& origin, size_t first, size_t last, int layer = -1 );
+
+      /** true if any of the noise properties is set */
+      bool Noisy() const
+      { return( noise_range > 0 || noise_proportional > 0 || noise_dropout > 0 || 
+		noise_maxrange > 0 || noise_bearing > 0 ); }
+
+      /** Add range noise, dropouts and max-range returns to the
+	  traced data, drawing from rng */
+      void AddNoise( RandomStream& rng );
+
+      /** The number of random numbers an update draws for noise */
+      uint64_t NoiseDraws() const;
+
+      /** The channel nearest the horizontal, whose data goes in
+	  ranges, intensities and bearings */
+      unsigned int LevelChannel() const;
+
       void Visualize( Vis* vis, ModelRanger* rgr ) const;
       std::string String() const;			
       void Load( Worldfile* wf, int entity );
@@ -2771,24 +3648,142 @@ namespace Stg
 
     /** returns a const reference to a vector of range and reflectance samples */
     const std::vector<Sensor>& GetSensors() const
-    { return sensors; }
+    { 
+      const_cast<ModelRanger*>(this)->Refresh(); // discard const
+      return sensors; 
+    }
 
     /** returns a mutable reference to a vector of range and reflectance samples */
     std::vector<Sensor>& GetSensorsMutable() 
-    { return sensors; }
+    { Refresh(); return sensors; }
+
+    /** Defer updates until the samples are read (the worldfile's
+	lazy property). See LazyUpdate. A sensor whose beams a
+	blobfinder reads is always updated eagerly. */
+    void SetLazy( bool enable ) { lazy.enabled = enable; }
+
+    /** Counts of deferred updates that were done or skipped */
+    const LazyUpdate& GetLazy() const { return lazy; }
 	 
     void LoadSensor( Worldfile* wf, int entity );
 		
   private:
     std::vector<Sensor> sensors;		
+
+    /** Source of the sensors' noise. Only this model's update uses
+	it, so it needs no lock. */
+    RandomStream rng;
+
+    /** Deferred updates, and the state of rng when the last one came
+	due, so that a deferred scan has the same noise as it would
+	have had eagerly */
+    LazyUpdate lazy;
+    RandomStream lazy_rng;
+
+    /** Trace all the sensors from global pose gpose, in the given
+	layer of the occupancy grid (see Ray::layer), drawing noise
+	from noise */
+    void Scan( const Pose& gpose, RandomStream& noise, int layer = -1 );
+
+    /** Do any update deferred in lazy mode */
+    void Refresh()
+    { if( lazy.Claim() ) Scan( lazy.pose, lazy_rng, lazy.layer ); }
     
   protected:
 		
     virtual void Startup();
     virtual void Shutdown();
     virtual void Update();		
+    virtual void Load();
+    virtual void SaveState( std::string& buf ) const;
+    virtual bool LoadState( const uint8_t*& pos, const uint8_t* end );
   };
 	
+  // WIFI MODEL --------------------------------------------------------
+
+  /// %ModelWifi class
+  class ModelWifi : public Model
+  {
+    friend class WifiNetwork;
+
+  public:
+    /** Another radio that can hear us, or that we can hear */
+    class Link
+    {
+    public:
+      ModelWifi* peer;
+      meters_t range; ///< distance to the peer
+      unsigned int walls; ///< number of obstacles between us and the peer
+      double rx_dbm; ///< strength of the peer's signal at our antenna
+      double tx_dbm; ///< strength of our signal at the peer's antenna
+
+      Link( ModelWifi* peer, meters_t range, unsigned int walls, double rx_dbm, double tx_dbm )
+	: peer(peer), range(range), walls(walls), rx_dbm(rx_dbm), tx_dbm(tx_dbm) {}
+    };
+
+    /** A message received from another radio */
+    class Message
+    {
+    public:
+      ModelWifi* from;
+      ModelWifi* to; ///< NULL for a broadcast
+      std::string data;
+      double rx_dbm; ///< strength of the signal it arrived on
+
+      Message( ModelWifi* from, ModelWifi* to, const std::string& data )
+	: from(from), to(to), data(data), rx_dbm(0) {}
+    };
+
+  private:
+    double power; ///< transmit power, in dBm
+    double sensitivity; ///< weakest signal we can receive, in dBm
+    double ref_loss; ///< path loss at 1m, in dB
+    double exponent; ///< path loss exponent
+    double wall_loss; ///< loss for each obstacle crossed, in dB
+    meters_t move_threshold; ///< links are recomputed after moving further than this
+
+    std::vector<Link> links;
+    std::vector<Message> inbox; ///< messages for controllers to read in this update
+    std::vector<Message> pending; ///< messages delivered since our last update
+
+    WifiNetwork* net;
+
+    static Option showData;
+
+    virtual void Startup();
+    virtual void Shutdown();
+    virtual void Update();
+    virtual void DataVisualize( Camera* cam );
+
+  public:
+    ModelWifi( World* world, 
+	       Model* parent,
+	       const std::string& type );
+    virtual ~ModelWifi();
+
+    virtual void Load();
+    virtual void SaveState( std::string& buf ) const;
+    virtual bool LoadState( const uint8_t*& pos, const uint8_t* end );
+
+    /** Returns the radios we can hear or that can hear us, as found in
+	our last update */
+    const std::vector<Link>& GetLinks() const { return links; }
+
+    /** Returns the messages delivered to us for this update. Read
+	them in an update callback: they are replaced at our next
+	update. */
+    const std::vector<Message>& GetMessages() const { return inbox; }
+
+    /** Send data to radio to, or to every radio in range if to is
+	NULL. Messages sent in one time step are delivered at the start
+	of the next one, to the radios our signal reaches then. */
+    void Send( const std::string& data, ModelWifi* to = NULL );
+
+    /** Returns the free-space distance at which our signal falls to
+	peer's sensitivity. Walls can only make it shorter. */
+    meters_t MaxRange( const ModelWifi* peer ) const;
+  };
+
   // BLINKENLIGHT MODEL ----------------------------------------------------
   class ModelBlinkenlight : public Model
   {
@@ -2847,8 +3842,37 @@ namespace Stg
     double _yaw_offset; //position camera is mounted at
     double _pitch_offset;
 		
+    bool _raytrace; ///< render by raytracing the world's occupancy grid instead of with OpenGL
+    int _threads; ///< number of bands the rows of a raytraced frame are split into, for World::RunJobs()
+    
+    int _latency; ///< frames between rendering with OpenGL and delivering the image: 0 or 1
+    bool _pbo; ///< read back through pixel buffer objects. False until checked on the first frame
+    bool _pbo_checked; ///< true once the GL version has been checked for pixel buffer objects
+    GLuint _pbo_depth[2]; ///< pixel buffer objects receiving the depth buffer, used in turn
+    GLuint _pbo_color[2]; ///< pixel buffer objects receiving the colour buffer, used in turn
+    int _pbo_index; ///< the pair of pixel buffer objects that receives the next frame
+    bool _pbo_pending; ///< true if a frame waits in the other pair of pixel buffer objects
+    
     ///Take a screenshot from the camera's perspective. return: true for sucess, and data is available via FrameDepth() / FrameColor()
     bool GetFrame();
+    
+    /// frame geometry shared by the threads rendering a raytraced frame
+    class RaytraceFrame;
+    
+    /// the rows of a raytraced frame rendered by one job
+    class RowBand;
+    
+    ///Copy a frame from the indicated pair of pixel buffer objects into the frame buffers
+    void ReadPixelBuffers( int index );
+    
+    ///Render a frame without OpenGL by raytracing the world's occupancy grid
+    void GetFrameRaytrace();
+    
+    ///Raytrace the image rows [first, last)
+    void RaytraceRows( const RaytraceFrame& frame, int first, int last );
+    
+    ///World::RunJobs() entry point for RaytraceRows()
+    static void RaytraceRowsJob( void* band );
 	
   public:
     ModelCamera( World* world,
@@ -2927,6 +3951,18 @@ namespace Stg
     LocalizationMode localization_mode; ///< global or local mode
     Velocity integration_error; ///< errors to apply in simple odometry model
     double wheelbase;
+    bool swept_collision; ///< iff true, test the path of each move, not just its end pose
+
+    /** Advance by dp from start in steps no longer than one bitmap
+	cell, stopping at the last pose that does not collide. */
+    void MoveInSteps( const Pose& start, const Pose& dp, unsigned int layer );
+
+    /** Move to newpose, re-rendering only the blocks that moved to
+	different bitmap cells, and test for collisions. Returns true
+	on success. If a collision is detected the
+	model is returned to its previous pose and false is
+	returned. Does not change the stall flag. */
+    bool TryMove( const Pose& newpose, unsigned int layer );
     
   public:
     /** Set the min and max acceleration in all 4 DOF */
@@ -3018,6 +4054,8 @@ namespace Stg
     virtual void Shutdown();
     virtual void Update();
     virtual void Load();
+    virtual void SaveState( std::string& buf ) const;
+    virtual bool LoadState( const uint8_t*& pos, const uint8_t* end );
   };
 
 
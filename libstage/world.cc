@@ -18,11 +18,15 @@
 
     name                     <worldfile name>
     interval_sim            100
+    interval_sim_min        <interval_sim>
+    interval_sim_max          0
     quit_time                 0
+    raytrace_fusion           0
     resolution                0.02
 
     show_clock                0
     show_clock_interval     100
+    show_load_times           0
     threads                   1
 
     @endverbatim
@@ -41,12 +45,38 @@
     callbacks. You are not likely to need to change the default of 100
     msec: this is used internally by clients such as Player and WebSim.
 
+    - interval_sim_max <float>\n
+    If greater than zero, enables adaptive timestep mode, which is
+    mostly useful for headless batch runs. Each World::Update() then
+    runs for between interval_sim_min and interval_sim_max msec of
+    simulated time. Steps are as long as possible without passing the
+    next scheduled model update, so they grow only as long as the
+    shortest update_interval of the subscribed models, and are
+    shortened so that robots with an obstacle's cells within reach at
+    their current speed move no more than a quarter of their size per
+    step. The average number of steps per simulated second is printed
+    when quit_time is reached.
+
+    - interval_sim_min <float>\n
+    The shortest step allowed in adaptive timestep mode, in
+    msec. Defaults to the value of interval_sim, which is also the
+    length of the first step.
+
     - quit_time <float>\n
     Stop the simulation after this many simulated seconds have
     elapsed. In libstage, World::Update() returns true. In Stage with
     a GUI, the simulation is paused.wo In Stage without a GUI, Stage
     quits.
  
+    - raytrace_fusion <int>\n
+    If non-zero, sensors that trace the same beam (the same origin and
+    heading) in the same update share a single walk through the
+    grid: the blocks met by the first ray are remembered, and later
+    rays test their own predicates against them. Results can differ
+    from separate walks by up to one cell when the rays have
+    different ranges. Recording costs a few percent in worlds where
+    no beams are shared, so this is off by default.
+
     - resolution <float>\n
     The resolution (in meters) of the underlying bitmap model. Larger
     values speed up raytracing at the expense of fidelity in collision
@@ -62,6 +92,14 @@
     if $show_clock is enabled. The default is once every 10 simulated
     seconds. Smaller values slow the simulation down a little.
 
+    - show_load_times <int>\n
+    If non-zero, print how long each phase of loading the world took
+    on stdout: parsing the worldfile, starting the worker threads,
+    decoding bitmaps, loading the models, rendering them into the
+    world and running the controllers' init functions. Bitmaps are
+    decoded on the worker threads, so a world with several large
+    bitmaps may load faster with more threads.
+
     - threads <int>\n The number of worker threads to spawn. Some
     models can be updated in parallel (e.g. laser, ranger), and
     running 2 or more threads here may make the simulation run faster,
@@ -89,6 +127,7 @@
 #include <locale.h> 
 #include <limits.h>
 #include <libgen.h> // for dirname(3)
+#include <sys/mman.h> // for munmap(2)
 
 #include "stage.hh"
 #include "file_manager.hh"
@@ -120,12 +159,91 @@ std::set<World*> World::world_set;
 std::string World::ctrlargs;
 std::vector<std::string> World::args;
 
+/** The blocks met by rays traced in this update, in a hash table
+    indexed by the rays' origin and heading. Each entry has its own
+    lock, as sensors in all the worker threads share the table. */
+class World::RayMemo
+{
+public:
+  class Entry
+  {
+  public:
+    pthread_mutex_t mutex;
+    int64_t x, y, a; ///< origin and heading, quantized
+    uint64_t update; ///< the RayMemo::generation of the walk
+    meters_t range; ///< the range of the walk
+    bool stopped; ///< true if the walk stopped early at a hit
+    meters_t reach; ///< if stopped, the range of the hit
+    std::vector<RaytraceHit> hits; ///< every block met, nearest first
+    unsigned int walks; ///< walks recorded here since Prepare()
+    
+    Entry() : mutex(), x(0), y(0), a(0), update(0), range(0), stopped(false), reach(0), hits(), walks(0)
+    { pthread_mutex_init( &mutex, NULL ); }
+
+    ~Entry()
+    { pthread_mutex_destroy( &mutex ); }
+  };
+  
+  Entry* slots;
+  unsigned int size; // a power of two
+
+  /** Counts the calls to Prepare(), so that a walk is only current in
+      the update it was made in. Not the update count, which
+      World::Restore() may wind back. */
+  uint64_t generation;
+  
+  RayMemo() : slots( new Entry[1024] ), size( 1024 ), generation( 1 ) {}
+  ~RayMemo() { delete[] slots; }
+
+  /** Called before each update, while no rays are being traced. Grow
+      the table if the last update's rays could not all be kept until
+      the end of the update. */
+  void Prepare()
+  {
+    ++generation;
+
+    unsigned int walks( 0 );
+    for( unsigned int i(0); i<size; ++i )
+      {
+	walks += slots[i].walks;
+	slots[i].walks = 0;
+      }
+    
+    if( 2 * walks > size )
+      {
+	while( 2 * walks > size )
+	  size *= 2;
+	
+	delete[] slots;
+	slots = new Entry[size];
+      }
+  }
+  
+  /** Find the entry for this origin and heading, which is only valid
+      if its key matches */
+  Entry& Lookup( const Pose& origin, int64_t& x, int64_t& y, int64_t& a )
+  {
+    // sensors reach the same beam by different arithmetic, so
+    // compare to a micron and a nanoradian
+    x = llrint( origin.x * 1e6 );
+    y = llrint( origin.y * 1e6 );
+    a = llrint( normalize( origin.a ) * 1e9 );
+    
+    const uint64_t h( (uint64_t)x * 73856093ULL ^ 
+		      (uint64_t)y * 19349663ULL ^ 
+		      (uint64_t)a * 83492791ULL );
+    return slots[ (h ^ (h >> 17)) & (size-1) ];
+  }
+};
+
 World::World( const std::string& name, 
 	      double ppm )
   : 
   // private
   destroy( false ),
   dirty( true ),
+  loading( false ),
+  show_load_times( false ),
   models(),
   models_by_name(),
   models_with_fiducials(),
@@ -137,8 +255,9 @@ World::World( const std::string& name,
   show_clock_interval( 100 ), // 10 simulated seconds using defaults
   sync_mutex(),
   threads_working( 0 ),
+  threads_started( 0 ),
   threads_start_cond(),
-  threads_done_cond(),
+  jobs_cond(),
   total_subs( 0 ), 
   worker_threads( 1 ),
 
@@ -153,13 +272,30 @@ World::World( const std::string& name,
   sim_time( 0 ),
   superregions(),
   updates( 0 ),
+  vis_epoch( 0 ),
+  wifi_network( NULL ),
   wf( NULL ),
   paused( false ),
+  decoded_bitmaps(),
+  ctrl_initfuncs(),
+  snapshot_data( NULL ),
+  snapshot_size( 0 ),
+  snapshot_occupancy( 0 ),
+  checkpoints(),
+  next_checkpoint( 0 ),
+  forks(),
+  fork_report( -1 ),
+  jobs(),
   event_queues(1), // use 1 thread by default
   pending_update_callbacks(),
   active_energy(),
   active_velocity(),
+  ray_memo( NULL ),
+  ray_fusion( false ),
+  ray_fusion_active( false ),
   sim_interval( 1e5 ), // 100 msec has proved a good default
+  sim_interval_min( 0 ),
+  sim_interval_max( 0 ), // adaptive timestep disabled
   update_cb_count(0)
 {
   if( ! Stg::InitDone() )
@@ -170,7 +306,8 @@ World::World( const std::string& name,
  
   pthread_mutex_init( &sync_mutex, NULL );
   pthread_cond_init( &threads_start_cond, NULL );
-  pthread_cond_init( &threads_done_cond, NULL );
+  pthread_cond_init( &jobs_cond, NULL );
+  ray_memo = new RayMemo();
  
   World::world_set.insert( this );
   
@@ -188,6 +325,29 @@ World::~World( void )
   if( ground ) delete ground;
   if( wf ) delete wf;
   World::world_set.erase( this );
+
+  delete ray_memo;
+}
+
+uint64_t World::OccupancyEpoch( unsigned int layer, 
+				const point_t& min, const point_t& max )
+{
+  const point_int_t gmin( MetersToPixels( min ) );
+  const point_int_t gmax( MetersToPixels( max ) );
+  
+  // region epochs only ever grow, so their sum changes if any of
+  // them does
+  uint64_t epoch( vis_epoch );
+  
+  for( int32_t ry( gmin.y & ~CELLMASK ); ry <= gmax.y; ry += REGIONWIDTH )
+    for( int32_t rx( gmin.x & ~CELLMASK ); rx <= gmax.x; rx += REGIONWIDTH )
+      {
+	SuperRegion* sr( GetSuperRegion( point_int_t( GETSREG(rx), GETSREG(ry) )));
+	if( sr )
+	  epoch += sr->GetRegion( GETREG(rx), GETREG(ry) )->epoch[layer];
+      }
+  
+  return epoch;
 }
 
 SuperRegion* World::CreateSuperRegion( point_int_t origin )
@@ -252,13 +412,19 @@ void* World::update_thread_entry( std::pair<World*,int> *thread_info )
 
   pthread_mutex_lock( &world->sync_mutex );  
 
+  unsigned int started( 0 ); // the last update we worked on
+
   while( 1 )
     {
       //printf( "thread ID %d waiting for start\n", thread_instance );
       // wait until the main thread signals us
       //puts( "worker waiting for start signal" );
       
-      pthread_cond_wait( &world->threads_start_cond, &world->sync_mutex );
+      // meanwhile, help with any jobs queued between updates
+      while( world->threads_started == started )
+	if( ! world->RunJob() )
+	  pthread_cond_wait( &world->threads_start_cond, &world->sync_mutex );
+      started = world->threads_started;
       pthread_mutex_unlock( &world->sync_mutex );
 		
       //printf( "worker %u thread awakes for task %u\n", thread_instance, task );
@@ -273,14 +439,137 @@ void* World::update_thread_entry( std::pair<World*,int> *thread_info )
       if( --world->threads_working == 0 )
 	{
 	  //puts( "last worker signalling main thread" );
-	  pthread_cond_signal( &world->threads_done_cond );
+	  pthread_cond_broadcast( &world->jobs_cond );
 	}
+
+      // help the threads still working with any jobs they share out
+      while( world->threads_working > 0 && world->threads_started == started )
+	if( ! world->RunJob() )
+	  pthread_cond_wait( &world->jobs_cond, &world->sync_mutex );
+
       // keep lock going round the loop
     }
   
   return NULL;
 }
 
+void World::StartThreads()
+{
+  // kick off the threads
+  for( unsigned int t(0); t<worker_threads; ++t )
+    {      
+      //normal posix pthread C function pointer
+      typedef void* (*func_ptr) (void*);
+      
+      // the pair<World*,int> is the configuration for each thread. it can't be a local
+      // stack var, since it's accssed in the threads
+
+      pthread_t pt;
+      pthread_create( &pt,
+		      NULL,
+		      (func_ptr)World::update_thread_entry, 
+		      new std::pair<World*,int>( this, t+1 ) );
+    }
+}
+
+bool World::RunJob()
+{
+  if( jobs.empty() )
+    return false;
+  
+  const Job job( jobs.front() );
+  jobs.pop_front();
+  
+  pthread_mutex_unlock( &sync_mutex );
+  (*job.func)( job.arg );
+  pthread_mutex_lock( &sync_mutex );
+  
+  // wake the thread waiting for this batch
+  if( --(*job.pending) == 0 )
+    pthread_cond_broadcast( &jobs_cond );
+
+  return true;
+}
+
+void World::RunJobs( job_func_t func, const std::vector<void*>& args )
+{
+  unsigned int pending( args.size() );
+
+  pthread_mutex_lock( &sync_mutex );
+
+  FOR_EACH( it, args )
+    jobs.push_back( Job( func, *it, &pending ) );
+  
+  // wake the threads helping with an update, and any idle ones
+  pthread_cond_broadcast( &jobs_cond );
+  pthread_cond_broadcast( &threads_start_cond );
+  
+  // work on the queue, which holds ours and perhaps other threads'
+  // jobs, until all of ours are done
+  while( pending > 0 )
+    if( ! RunJob() )
+      pthread_cond_wait( &jobs_cond, &sync_mutex );
+
+  pthread_mutex_unlock( &sync_mutex );
+}
+
+// a bitmap for DecodeBitmaps() to decode on a worker thread
+class BitmapJob
+{
+public:
+  std::string filename;
+  BlockGroup::BitmapMode mode;
+  bool cache;
+  BitmapShapes* shapes;
+
+  BitmapJob() :
+    filename(), mode( BlockGroup::BITMAP_OUTLINES ), cache( false ), shapes( NULL ) {}
+};
+
+static void decode_bitmap( void* arg )
+{
+  BitmapJob* job( (BitmapJob*)arg );
+  BlockGroup::DecodeBitmap( job->filename, job->mode, job->cache, *job->shapes );
+}
+
+void World::DecodeBitmaps()
+{
+  std::map<std::pair<std::string,int>,BitmapJob> bitmap_jobs;
+
+  for( int entity(1); entity < wf->GetEntityCount(); ++entity )
+    {
+      // the entities that LoadModel() will load
+      const char *typestr( wf->GetEntityType(entity) );
+      if( strcmp( typestr, "window" ) == 0 ||
+	  strcmp( typestr, "block" ) == 0 ||
+	  strcmp( typestr, "sensor" ) == 0 ||
+	  ! wf->PropertyExists( entity, "bitmap" ) )
+	continue;
+
+      const std::string bitmapfile( wf->ReadString( entity, "bitmap", "" ) );
+      if( bitmapfile == "" )
+	continue;
+
+      const std::string full( BlockGroup::BitmapPath( bitmapfile, wf ) );
+      const BlockGroup::BitmapMode mode( BlockGroup::ReadBitmapMode( wf, entity ) );
+      const std::pair<std::string,int> key( full, mode );
+
+      BitmapJob& job( bitmap_jobs[key] );
+      job.filename = full;
+      job.mode = mode;
+      // a bitmap is cached if any of the models that use it asks
+      job.cache = job.cache || wf->ReadInt( entity, "bitmap_cache", 0 );
+      job.shapes = &decoded_bitmaps[key];
+    }
+
+  std::vector<void*> args;
+  FOR_EACH( it, bitmap_jobs )
+    args.push_back( &it->second );
+
+  if( args.size() )
+    RunJobs( decode_bitmap, args );
+}
+
 void World::AddModel( Model*  mod )
 {
   models.insert( mod );
@@ -385,6 +674,14 @@ void World::LoadModel( Worldfile* wf, int entity )
   models_by_wfentity[entity] = mod;
 }
 
+// wall clock time in seconds, for timing the phases of Load()
+static double real_seconds()
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return( tv.tv_sec + tv.tv_usec / 1e6 );
+}
+
 void World::Load( const std::string& worldfile_path )
 {
   // note: must call Unload() before calling Load() if a world already
@@ -393,10 +690,24 @@ void World::Load( const std::string& worldfile_path )
   printf( " [Loading %s]", worldfile_path.c_str() );
   fflush(stdout);
 
+  // the time at the start of each phase of loading
+  const double start_time( real_seconds() );
+
+  // models are mapped again and again as their properties are read,
+  // which is costly for big maps: blocks wait until the end instead
+  loading = true;
+
   this->wf = new Worldfile();
-  wf->Load( worldfile_path );
+
+  // a snapshot brings the parsed worldfile, the decoded bitmaps and
+  // the occupancy grid with it
+  const bool snapshot( LoadSnapshot( worldfile_path ) );
+  if( ! snapshot )
+    wf->Load( worldfile_path );
   PRINT_DEBUG1( "wf has %d entitys", wf->GetEntityCount() );
 
+  const double parsed_time( real_seconds() );
+
   // end the output line of worldfile components
   //puts("");
   
@@ -416,11 +727,29 @@ void World::Load( const std::string& worldfile_path )
   
   this->show_clock_interval = 
     wf->ReadInt( entity, "show_clock_interval", this->show_clock_interval );
+
+  this->show_load_times = 
+    wf->ReadInt( entity, "show_load_times", this->show_load_times );
   
   // read msec instead of usec: easier for user
   this->sim_interval =
     1e3 * wf->ReadFloat( entity, "interval_sim", this->sim_interval / 1e3 );
   
+  // adaptive timestep bounds, also in msec
+  this->sim_interval_max =
+    1e3 * wf->ReadFloat( entity, "interval_sim_max", this->sim_interval_max / 1e3 );
+  
+  this->sim_interval_min =
+    1e3 * wf->ReadFloat( entity, "interval_sim_min", this->sim_interval / 1e3 );
+  
+  if( sim_interval_max && sim_interval_max < sim_interval_min )
+    {
+      PRINT_WARN( "interval_sim_max is less than interval_sim_min. Disabling adaptive timestep" );
+      this->sim_interval_max = 0;
+    }
+
+  this->ray_fusion = wf->ReadInt( entity, "raytrace_fusion", this->ray_fusion );
+
   this->worker_threads = wf->ReadInt( entity, "threads",  this->worker_threads );  
   if( this->worker_threads < 1 )
     {
@@ -433,24 +762,17 @@ void World::Load( const std::string& worldfile_path )
   
   //printf( "worker threads %d\n", worker_threads );
   
-  // kick off the threads
-  for( unsigned int t(0); t<worker_threads; ++t )
-    {      
-      //normal posix pthread C function pointer
-      typedef void* (*func_ptr) (void*);
-      
-      // the pair<World*,int> is the configuration for each thread. it can't be a local
-      // stack var, since it's accssed in the threads
-
-      pthread_t pt;
-      pthread_create( &pt,
-		      NULL,
-		      (func_ptr)World::update_thread_entry, 
-		      new std::pair<World*,int>( this, t+1 ) );
-    }
+  StartThreads();
   
   if( worker_threads > 1 ) 
     printf( "[threads %u]", worker_threads );	
+
+  // the costly part of loading a bitmap needs nothing from the model,
+  // so it is done up front, in parallel
+  const double threads_time( real_seconds() );
+  if( ! snapshot )
+    DecodeBitmaps();
+  const double bitmaps_time( real_seconds() );
   
   // Iterate through entitys and create objects of the appropriate type
   for( int entity(1); entity < wf->GetEntityCount(); ++entity )
@@ -469,21 +791,40 @@ void World::Load( const std::string& worldfile_path )
       else
 	LoadModel( wf, entity );
     }
+
+  const double models_time( real_seconds() );
+  decoded_bitmaps.clear();
   
-  // call all controller init functions
+  loading = false;
+
   FOR_EACH( it, models )
-    {
-      (*it)->blockgroup.CalcSize();
-      (*it)->UnMap(); // clears both layers
-      (*it)->Map(); // maps both layers
-      
-      // to here
-    }
+    (*it)->blockgroup.CalcSize();
+
+  if( ! ( snapshot && RestoreOccupancy() ) )
+    FOR_EACH( it, models )
+      {
+	(*it)->UnMap(); // clears both layers
+	(*it)->Map(); // maps both layers
+      }
+
+  const double map_time( real_seconds() );
   
   // the world is all done - run any init code for user's controllers
   FOR_EACH( it, models )
     (*it)->InitControllers();
 
+  const double init_time( real_seconds() );
+
+  if( show_load_times )
+    printf( "[load %.3fs: parse %.3f threads %.3f bitmaps %.3f models %.3f map %.3f init %.3f]",
+	    init_time - start_time,
+	    parsed_time - start_time,
+	    threads_time - parsed_time,
+	    bitmaps_time - threads_time,
+	    models_time - bitmaps_time,
+	    map_time - models_time,
+	    init_time - map_time );
+
   putchar( '\n' );
 }
 
@@ -639,6 +980,9 @@ bool World::Update()
       fflush( stdout );
     }
 	
+  if( sim_interval_max )
+    sim_interval = AdaptiveInterval();
+
   sim_time += sim_interval; 
 	
   // rebuild the sets sorted by position on x,y axis
@@ -654,12 +998,18 @@ bool World::Update()
   //printf( "x %lu y %lu\n", models_with_fiducials_byy.size(),
   //			models_with_fiducials_byx.size() );
 
+  // sensors may share ray walks until all the queues are done
+  ray_fusion_active = ray_fusion;
+  if( ray_fusion )
+    ray_memo->Prepare();
+
   // handle the zeroth queue synchronously in the main thread
   ConsumeQueue( 0 );
   
   // handle all the remaining queues asynchronously in worker threads
   pthread_mutex_lock( &sync_mutex );
   threads_working = worker_threads; 
+  ++threads_started;
   // unblock the workers - they are waiting on this condition var
   //puts( "main thread signalling workers" );
   pthread_cond_broadcast( &threads_start_cond );
@@ -672,14 +1022,18 @@ bool World::Update()
   
   pthread_mutex_lock( &sync_mutex );
   // wait for all the last update job to complete - it will
-  // signal the worker_threads_done condition var
+  // signal the jobs condition var. Meanwhile, help with any jobs the
+  // workers share out.
   while( threads_working > 0  )
     {
       //puts( "main thread waiting for workers to finish" );
-      pthread_cond_wait( &threads_done_cond, &sync_mutex );
+      if( ! RunJob() )
+	pthread_cond_wait( &jobs_cond, &sync_mutex );
     }
   pthread_mutex_unlock( &sync_mutex );		 
   //puts( "main thread awakes" );
+
+  ray_fusion_active = false;
   
   // TODO: allow threadsafe callbacks to be called in worker
   // threads		
@@ -695,10 +1049,62 @@ bool World::Update()
     (*it)->UpdateCharge();
   
   ++updates;  
+  
+  if( (show_clock || sim_interval_max) && PastQuitTime() )
+    printf( "\n[Stage: %llu steps, %.2f steps per simulated second]\n",
+	    (unsigned long long)updates, StepsPerSimSecond() );
     
   return false;
 }
 
+usec_t World::AdaptiveInterval()
+{
+  usec_t interval( sim_interval_max );
+  
+  // don't step past the next scheduled event, so that models are
+  // still updated at their own intervals
+  FOR_EACH( it, event_queues )
+    if( !it->empty() && it->top().time > sim_time )
+      interval = std::min( interval, it->top().time - sim_time );
+  
+  // the layer rendered in the previous step is the most recent
+  const unsigned int layer( (updates+1) % 2 );
+  
+  FOR_EACH( it, active_velocity )
+    {
+      ModelPosition* pos( *it );
+      Bounds* vb( pos->velocity_bounds );
+      const Velocity v( pos->GetVelocity() );
+      
+      // the fastest any point on the robot is moving
+      const double reach( hypot( pos->geom.size.x, pos->geom.size.y ) / 2.0 );
+      const double speed( hypot( vb[0].Constrain( v.x ), vb[1].Constrain( v.y ) ) +
+			  fabs( vb[3].Constrain( v.a ) ) * reach );
+      if( speed <= 0.0 )
+	continue;
+      
+      // if no obstacle is within range of the robot, or of another
+      // robot moving just as fast towards it, a long step is safe.
+      // Within a map, this looks at the cells the map occupies, not
+      // at the box of its outline.
+      const int32_t margin( 2 * MetersToPixels( speed * interval / 1e6 ) + 1 );
+      if( ! BroadPhaseTest( pos, layer, margin ) )
+	continue;
+      
+      // otherwise, move no more than a quarter of the robot's size
+      const double limit( std::min( pos->geom.size.x, pos->geom.size.y ) / 4.0 );
+      interval = std::min( interval, (usec_t)( 1e6 * limit / speed ) );
+    }
+  
+  interval = std::max( interval, sim_interval_min );
+  
+  // don't overshoot the end of the simulation
+  if( quit_time > sim_time )
+    interval = std::min( interval, quit_time - sim_time );
+  
+  return interval;
+}
+
 unsigned int World::GetEventQueue( Model* mod ) const
 {
   // todo: there should be a policy that works faster than random, but
@@ -752,7 +1158,8 @@ void World::Raytrace( const Pose &gpose, // global pose
  		      const Model* mod,			 
 		      const void* arg,
 		      const bool ztest,		      
-		      std::vector<RaytraceResult>& results )
+		      std::vector<RaytraceResult>& results,
+		      const int layer )
 {
   // find the direction of the first ray
   Pose raypose( gpose );
@@ -760,6 +1167,7 @@ void World::Raytrace( const Pose &gpose, // global pose
   
   // set up a ray to trace
   Ray ray( mod, gpose, range, func, arg, ztest );
+  ray.layer = layer;
   
   const size_t sample_count = results.size();
   
@@ -777,20 +1185,21 @@ RaytraceResult World::Raytrace( const Pose &gpose,
 				const ray_test_func_t func,
 				const Model* mod,		
 				const void* arg,
-				const bool ztest )
+				const bool ztest,
+				const int layer )
 {    
-  return Raytrace( Ray( mod, gpose, range, func, arg, ztest ));
+  Ray ray( mod, gpose, range, func, arg, ztest );
+  ray.layer = layer;
+  return Raytrace( ray );
 }
 
 
-RaytraceResult World::Raytrace( const Ray& r )
+template <class Visitor>
+void World::RaytraceWalk( const Ray& r, Visitor& visit )
 {
   //rt_cells.clear();
   //rt_candidate_cells.clear();
 
-  // initialize result for return
-  RaytraceResult result( r.origin, NULL, Color(), r.range );
-
   // our global position in (floating point) cell coordinates
   double globx( r.origin.x * ppm );
   double globy( r.origin.y * ppm );
@@ -831,7 +1240,7 @@ RaytraceResult World::Raytrace( const Ray& r )
   const double xjumpdist( fabs(xjumpx)+fabs(xjumpy) );
   const double yjumpdist( fabs(yjumpx)+fabs(yjumpy) );
 
-  const unsigned int layer( (updates+1) % 2 );
+  const unsigned int layer( r.layer < 0 ? (updates+1) % 2 : r.layer );
   
   // these are updated as we go along the ray
   double xcrossx(0), xcrossy(0);
@@ -850,7 +1259,10 @@ RaytraceResult World::Raytrace( const Ray& r )
       SuperRegion* sr( GetSuperRegion(point_int_t(GETSREG(globx),GETSREG(globy))));
       Region* reg( sr ?	sr->GetRegion(GETREG(globx),GETREG(globy)) : NULL );
 			
-      if( reg && reg->count ) // if the region contains any objects
+      // if the region contains any objects in our layer. Blocks in
+      // the other layer, which may be moving, must not change the
+      // path of the walk.
+      if( reg && reg->layer_count[layer] )
 	{
 	  //assert( reg->cells.size() );
 					
@@ -862,7 +1274,7 @@ RaytraceResult World::Raytrace( const Ray& r )
 	  int32_t cx( GETCELL(globx) ); 
 	  int32_t cy( GETCELL(globy) );
 
-	  // since reg->count was non-zero, we expect this pointer to be good
+	  // since reg->layer_count was non-zero, we expect this pointer to be good
 	  Cell* c( &reg->cells[ cx + cy * REGIONWIDTH ] );
 
 	  // while within the bounds of this region and while some ray remains
@@ -871,32 +1283,28 @@ RaytraceResult World::Raytrace( const Ray& r )
 		 (cy>=0) && (cy<REGIONWIDTH) && 
 		 n > 0 )
 	    {			 
-	      FOR_EACH( it, c->blocks[layer] )
+	      if( ! c->blocks[layer].empty() )
 		{
-		  Block* block( *it );
-		  assert( block );
+		  // faster than the equivalent hypot() call
+		  const meters_t range( ax > ay ? 
+					fabs((globx-startx) / cosa) / ppm :
+					fabs((globy-starty) / sina) / ppm );
 		  
-		  // skip if not in the right z range
-		  if( r.ztest && 
-		      ( r.origin.z < block->global_z.min || 
-			r.origin.z > block->global_z.max ) )
-		    continue; 
-									
-		  // test the predicate we were passed
-		  if( (*r.func)( &block->group->mod, (Model*)r.mod, r.arg )) 
+		  FOR_EACH( it, c->blocks[layer] )
 		    {
-		      // a hit!
-		      result.pose = r.origin;
-		      result.mod = &block->group->mod;	
-		      result.color = result.mod->GetColor();
-
-		      if( ax > ay ) // faster than the equivalent hypot() call
-			result.range = fabs((globx-startx) / cosa) / ppm;
-		      else
-			result.range = fabs((globy-starty) / sina) / ppm;
-
-		      return result;
-		    }				  
+		      Block* block( *it );
+		      assert( block );
+		      
+		      // skip if not in the right z range
+		      if( r.ztest && 
+			  ( r.origin.z < block->global_z.min || 
+			    r.origin.z > block->global_z.max ) )
+			continue; 
+		      
+		      // let the visitor decide whether the ray stops here
+		      if( visit( &block->group->mod, block->global_z, range, block ) )
+			return;
+		    }
 		}
 
 	      // increment our cell in the correct direction
@@ -999,10 +1407,323 @@ RaytraceResult World::Raytrace( const Ray& r )
 	}			  	
       //rt_cells.push_back( point_int_t( globx, globy ));
     } 
+}
+
+/** Raytrace() visitor: stops at the first block that satisfies the
+    ray's predicate */
+class FirstHit
+{
+public:
+  const Ray& ray;
+  RaytraceResult& result;
+  
+  FirstHit( const Ray& ray, RaytraceResult& result ) 
+    : ray(ray), result(result) {}
+  
+  bool operator()( Model* hitmod, const Bounds& z, meters_t range, Block* block )
+  {
+    (void)z;
+    
+    // test the predicate we were passed
+    if( ! (*ray.func)( hitmod, (Model*)ray.mod, ray.arg ) )
+      return false;
+    
+    // a hit!
+    result.mod = hitmod;
+    result.color = hitmod->GetColor();
+    result.range = range;
+    return true;
+  }
+};
+
+/** Raytrace() visitor that also records every block it meets in a
+    RayMemo entry. The ray's z test is applied here, so that the
+    record holds blocks at all heights. */
+class RecordFirstHit
+{
+public:
+  const Ray& ray;
+  RaytraceResult& result;
+  std::vector<RaytraceHit>& hits;
+  
+  RecordFirstHit( const Ray& ray, RaytraceResult& result, std::vector<RaytraceHit>& hits ) 
+    : ray(ray), result(result), hits(hits) {}
+  
+  bool operator()( Model* hitmod, const Bounds& z, meters_t range, Block* block )
+  {
+    hits.push_back( RaytraceHit( hitmod, z, range, block ) );
+
+    if( ray.ztest && ( ray.origin.z < z.min || ray.origin.z > z.max ) )
+      return false;
+    
+    if( ! (*ray.func)( hitmod, (Model*)ray.mod, ray.arg ) )
+      return false;
+    
+    result.mod = hitmod;
+    result.color = hitmod->GetColor();
+    result.range = range;
+    return true;
+  }
+};
+
+RaytraceResult World::Raytrace( const Ray& r )
+{
+  // initialize result for return
+  RaytraceResult result( r.origin, NULL, Color(), r.range );
+  
+  // a ray in a layer of its own can't share the walks of this update
+  if( ! ray_fusion_active || r.layer >= 0 )
+    {
+      FirstHit visit( r, result );
+      RaytraceWalk( r, visit );
+      return result;
+    }
+  
+  int64_t x, y, a;
+  RayMemo::Entry& e( ray_memo->Lookup( r.origin, x, y, a ) );
+  
+  pthread_mutex_lock( &e.mutex );
+
+  if( e.update == ray_memo->generation && e.x == x && e.y == y && e.a == a )
+    {
+      // this beam was walked earlier in this update: test our
+      // predicate against the blocks it met
+      FOR_EACH( it, e.hits )
+	{
+	  if( it->range > r.range )
+	    break;
+	  
+	  if( r.ztest && ( r.origin.z < it->z.min || r.origin.z > it->z.max ) )
+	    continue;
+	  
+	  if( (*r.func)( it->mod, (Model*)r.mod, r.arg ) )
+	    {
+	      result.mod = it->mod;
+	      result.color = it->mod->GetColor();
+	      result.range = it->range;
+	      pthread_mutex_unlock( &e.mutex );
+	      return result;
+	    }
+	}
+      
+      // no hit in the record, which may be enough to know we see nothing
+      if( e.stopped ? r.range < e.reach : r.range <= e.range )
+	{
+	  pthread_mutex_unlock( &e.mutex );
+	  return result;
+	}
+    }
+  
+  // walk the grid, recording what we meet for the next sensor
+  e.x = x;
+  e.y = y;
+  e.a = a;
+  e.update = ray_memo->generation;
+  e.range = r.range;
+  e.hits.clear();
+  ++e.walks;
+
+  Ray walk( r );
+  walk.ztest = false; // applied by the visitor
+  
+  RecordFirstHit visit( r, result, e.hits );
+  RaytraceWalk( walk, visit );
+
+  e.stopped = ( result.mod != NULL );
+  e.reach = result.range;
 
+  pthread_mutex_unlock( &e.mutex );
+  
   return result;
 }
 
+/** Visitor for the multiple-ray Raytrace(): keeps the first hit for
+    each ray, and stops once every ray has a hit or has run out of
+    range */
+class FirstHits
+{
+public:
+  const std::vector<Ray>& rays;
+  std::vector<RaytraceResult>& results;
+  std::vector<bool> done;
+  size_t remaining;
+  
+  FirstHits( const std::vector<Ray>& rays, std::vector<RaytraceResult>& results ) 
+    : rays(rays), results(results), done(rays.size(),false), remaining(rays.size()) {}
+  
+  bool operator()( Model* hitmod, const Bounds& z, meters_t range, Block* block )
+  {
+    for( size_t i(0); i<rays.size(); ++i )
+      {
+	if( done[i] )
+	  continue;
+
+	const Ray& ray( rays[i] );
+	
+	// cells are visited nearest first, so this ray is finished
+	if( range > ray.range )
+	  {
+	    done[i] = true;
+	    --remaining;
+	    continue;
+	  }
+	
+	if( ray.ztest && ( ray.origin.z < z.min || ray.origin.z > z.max ) )
+	  continue;
+	
+	if( ! (*ray.func)( hitmod, (Model*)ray.mod, ray.arg ) )
+	  continue;
+	
+	results[i].mod = hitmod;
+	results[i].color = hitmod->GetColor();
+	results[i].range = range;
+	done[i] = true;
+	--remaining;
+      }
+    
+    return( remaining == 0 );
+  }
+};
+
+void World::Raytrace( const std::vector<Ray>& rays, 
+		      std::vector<RaytraceResult>& results )
+{
+  results.resize( rays.size() );
+
+  if( rays.empty() )
+    return;
+  
+  // one walk long enough for all the rays, with the z tests left to
+  // the visitor
+  Ray walk( rays[0] );
+  walk.ztest = false;
+  
+  for( size_t i(0); i<rays.size(); ++i )
+    {
+      results[i] = RaytraceResult( rays[i].origin, NULL, Color(), rays[i].range );
+      walk.range = std::max( walk.range, rays[i].range );
+    }
+
+  FirstHits visit( rays, results );
+  RaytraceWalk( walk, visit );
+}
+
+/** RaytraceChannels() visitor: finds the first block or ground
+    contact for each channel of a vertical fan */
+class ChannelHits
+{
+public:
+  const Ray& ray;
+  const std::vector<double>& slopes;
+  std::vector<meters_t>& ranges;
+  std::vector<Model*>& hits;
+  std::vector<double> heights;
+  std::vector<bool> done;
+  size_t remaining;
+  
+  ChannelHits( const Ray& ray, 
+	       const std::vector<double>& slopes,
+	       std::vector<meters_t>& ranges,
+	       std::vector<Model*>& hits ) 
+    : ray(ray), slopes(slopes), ranges(ranges), hits(hits), 
+      heights(slopes.size()), done(slopes.size(),false), remaining(slopes.size()) {}
+  
+  bool operator()( Model* hitmod, const Bounds& z, meters_t range, Block* block )
+  {
+    const size_t count( slopes.size() );
+    const double z0( ray.origin.z );
+    const double* slope( &slopes[0] );
+    double* height( &heights[0] );
+
+    // the height of every channel at this range, in a loop simple
+    // enough for the compiler to vectorize
+    for( size_t k(0); k<count; ++k )
+      height[k] = z0 + range * slope[k];
+    
+    int match( -1 ); // the predicate is tested at most once per block
+    
+    for( size_t k(0); k<count; ++k )
+      {
+	if( done[k] )
+	  continue;
+	
+	if( height[k] < 0.0 ) // reached the ground before this block
+	  {
+	    ranges[k] = -z0 / slope[k];
+	    done[k] = true;
+	    --remaining;
+	    continue;
+	  }
+	
+	if( height[k] < z.min || height[k] > z.max )
+	  continue;
+
+	if( match < 0 )
+	  match = (*ray.func)( hitmod, (Model*)ray.mod, ray.arg );
+
+	if( match )
+	  {
+	    ranges[k] = range;
+	    hits[k] = hitmod;
+	    done[k] = true;
+	    --remaining;
+	  }
+      }
+    
+    return( remaining == 0 );
+  }
+};
+
+void World::RaytraceChannels( const Ray& r, 
+			      const std::vector<double>& slopes,
+			      std::vector<meters_t>& ranges,
+			      std::vector<Model*>& hits )
+{
+  ranges.assign( slopes.size(), r.range );
+  hits.assign( slopes.size(), (Model*)NULL );
+  
+  if( slopes.empty() )
+    return;
+
+  Ray walk( r );
+  walk.ztest = false; // each channel has its own height
+  
+  ChannelHits visit( walk, slopes, ranges, hits );
+  RaytraceWalk( walk, visit );
+  
+  // descending channels that met no block may reach the ground
+  // beyond the last block
+  for( size_t k(0); k<slopes.size(); ++k )
+    if( ! visit.done[k] && slopes[k] < 0.0 )
+      ranges[k] = std::min( r.range, -r.origin.z / slopes[k] );
+}
+
+/** RaytraceAll() visitor: records every block that satisfies the
+    ray's predicate */
+class AllHits
+{
+public:
+  const Ray& ray;
+  std::vector<RaytraceHit>& hits;
+  
+  AllHits( const Ray& ray, std::vector<RaytraceHit>& hits ) 
+    : ray(ray), hits(hits) {}
+  
+  bool operator()( Model* hitmod, const Bounds& z, meters_t range, Block* block )
+  {
+    if( (*ray.func)( hitmod, (Model*)ray.mod, ray.arg ) )
+      hits.push_back( RaytraceHit( hitmod, z, range, block ) );
+    
+    return false; // keep going
+  }
+};
+
+void World::RaytraceAll( const Ray& r, std::vector<RaytraceHit>& hits )
+{
+  AllHits visit( r, hits );
+  RaytraceWalk( r, visit );
+}
+
 static int _save_cb( Model* mod, void* dummy )
 {
   mod->Save();
@@ -1105,6 +1826,26 @@ void World::MapPoly( const std::vector<point_int_t>& pts, Block* block, unsigned
 }
 
 
+// add a block to cells x0 to x1-1 of row y
+void World::MapRun( int32_t y, int32_t x0, int32_t x1, Block* block, unsigned int layer )
+{
+  while( x0 < x1 )
+    {
+      Region* reg( GetSuperRegionCreate( point_int_t(GETSREG(x0), 
+						     GETSREG(y)))
+		   ->GetRegion( GETREG(x0), 
+				GETREG(y)));
+      assert(reg);
+      
+      // add all the cells of the run in this region before looking
+      // up another region
+      const int32_t end( std::min( x1, x0 + REGIONWIDTH - GETCELL(x0) ));
+      
+      for( Cell* c( reg->GetCell( GETCELL(x0), GETCELL(y) )); x0 < end; ++x0, ++c )
+	c->AddBlock( block, layer );
+    }
+}
+
 SuperRegion* World::AddSuperRegion( const point_int_t& sup )
 {
   SuperRegion* sr( CreateSuperRegion( sup ) );
@@ -1147,6 +1888,699 @@ inline SuperRegion* World::GetSuperRegionCreate( const point_int_t& org )
   return sr;
 }
 
+bool World::SaveOccupancy( std::string& buf )
+{
+  // the worldfile models. LoadBlock() and LoadSensor() leave a NULL
+  // for any entity they look up that is not a model
+  std::vector<Model*> mods;
+  FOR_EACH( it, models_by_wfentity )
+    if( it->second )
+      mods.push_back( it->second );
+
+  // number the blocks model by model in worldfile order, which
+  // Load() reproduces
+  std::map<const Block*,uint32_t> numbers;
+
+  snapshot_put( buf, (uint32_t)mods.size() );
+  FOR_EACH( it, mods )
+    {
+      const std::vector<Block>& blocks( (*it)->blockgroup.blocks );
+      snapshot_put( buf, (int32_t)(*it)->wf_entity );
+      snapshot_put( buf, (uint32_t)blocks.size() );
+      
+      FOR_EACH( bit, blocks )
+	{
+	  const uint32_t number( numbers.size() );
+	  numbers[ &*bit ] = number;
+	}
+    }
+
+  // where each block was last rendered, as MapPixels() records it
+  FOR_EACH( it, mods )
+    FOR_EACH( bit, (*it)->blockgroup.blocks )
+      for( unsigned int layer(0); layer<2; ++layer )
+	{
+	  const uint8_t rendered( ! bit->rendered_cells[layer].empty() );
+	  snapshot_put( buf, rendered );
+	  if( ! rendered )
+	    continue;
+
+	  snapshot_put( buf, (int32_t)bit->bbox_min[layer].x );
+	  snapshot_put( buf, (int32_t)bit->bbox_min[layer].y );
+	  snapshot_put( buf, (int32_t)bit->bbox_max[layer].x );
+	  snapshot_put( buf, (int32_t)bit->bbox_max[layer].y );
+	  snapshot_put( buf, (uint32_t)bit->rendered_pts[layer].size() );
+	  FOR_EACH( pit, bit->rendered_pts[layer] )
+	    {
+	      snapshot_put( buf, (int32_t)pit->x );
+	      snapshot_put( buf, (int32_t)pit->y );
+	    }
+	}
+
+  // the blocks in every occupied cell, in order, region by region
+  for( unsigned int layer(0); layer<2; ++layer )
+    {
+      std::string cells;
+      uint32_t regions( 0 );
+
+      FOR_EACH( it, superregions )
+	for( int32_t r(0); r<SUPERREGIONSIZE; ++r )
+	  {
+	    const Region* reg( it->second->GetRegion( r % SUPERREGIONWIDTH, 
+						      r / SUPERREGIONWIDTH ));
+	    if( reg->layer_count[layer] == 0 )
+	      continue;
+	    
+	    uint32_t used( 0 );
+	    FOR_EACH( cit, reg->cells )
+	      if( ! cit->blocks[layer].empty() )
+		++used;
+
+	    ++regions;
+	    snapshot_put( cells, (int32_t)it->second->GetOrigin().x );
+	    snapshot_put( cells, (int32_t)it->second->GetOrigin().y );
+	    snapshot_put( cells, r );
+	    snapshot_put( cells, used );
+
+	    for( int32_t c(0); c<(int32_t)reg->cells.size(); ++c )
+	      {
+		const std::vector<Block*>& blocks( reg->cells[c].blocks[layer] );
+		if( blocks.empty() )
+		  continue;
+
+		snapshot_put( cells, (uint16_t)c );
+		snapshot_put( cells, (uint32_t)blocks.size() );
+		FOR_EACH( bit, blocks )
+		  {
+		    std::map<const Block*,uint32_t>::const_iterator number( numbers.find( *bit ));
+		    if( number == numbers.end() )
+		      return false;
+		    snapshot_put( cells, number->second );
+		  }
+	      }
+	  }
+
+      snapshot_put( buf, regions );
+      buf.append( cells );
+    }
+
+  return true;
+}
+
+bool World::RestoreOccupancy()
+{
+  const bool ok( snapshot_occupancy < snapshot_size &&
+		 MapOccupancy( snapshot_data + snapshot_occupancy,
+			       snapshot_data + snapshot_size ));
+
+  if( ! ok && snapshot_occupancy < snapshot_size )
+    PRINT_WARN( "the occupancy saved in the snapshot does not match the models, so they are rendered afresh" );
+
+  // the snapshot is no longer needed
+  munmap( (void*)snapshot_data, snapshot_size );
+  snapshot_data = NULL;
+  snapshot_size = snapshot_occupancy = 0;
+
+  return ok;
+}
+
+bool World::MapOccupancy( const uint8_t* pos, const uint8_t* end )
+{
+  // the blocks, numbered as SaveOccupancy() numbered them
+  std::vector<Block*> blocks;
+
+  std::vector<Model*> mods;
+  FOR_EACH( it, models_by_wfentity )
+    if( it->second )
+      mods.push_back( it->second );
+
+  uint32_t count( 0 );
+  if( ! snapshot_get( pos, end, count ) || count != mods.size() )
+    return false;
+  
+  FOR_EACH( it, mods )
+    {
+      int32_t entity( 0 );
+      uint32_t block_count( 0 );
+      if( ! snapshot_get( pos, end, entity ) ||
+	  ! snapshot_get( pos, end, block_count ) ||
+	  entity != (*it)->wf_entity ||
+	  block_count != (*it)->blockgroup.blocks.size() )
+	return false;
+      
+      FOR_EACH( bit, (*it)->blockgroup.blocks )
+	blocks.push_back( &*bit );
+    }
+
+  // every block must belong to a worldfile model to have a number
+  size_t total( 0 );
+  FOR_EACH( it, models )
+    total += (*it)->blockgroup.blocks.size();
+  if( total != blocks.size() )
+    return false;
+
+  // the record of where each block was rendered goes straight into
+  // the block: it means nothing until the block has cells
+  std::vector<uint8_t> rendered( 2 * blocks.size() );
+  for( size_t b(0); b<blocks.size(); ++b )
+    for( unsigned int layer(0); layer<2; ++layer )
+      {
+	Block* block( blocks[b] );
+	if( ! snapshot_get( pos, end, rendered[ 2*b + layer ] ))
+	  return false;
+	if( ! rendered[ 2*b + layer ] )
+	  continue;
+
+	int32_t x0( 0 ), y0( 0 ), x1( 0 ), y1( 0 );
+	uint32_t pts( 0 );
+	if( ! snapshot_get( pos, end, x0 ) ||
+	    ! snapshot_get( pos, end, y0 ) ||
+	    ! snapshot_get( pos, end, x1 ) ||
+	    ! snapshot_get( pos, end, y1 ) ||
+	    ! snapshot_get( pos, end, pts ) ||
+	    (size_t)(end - pos) / (2 * sizeof(int32_t)) < pts )
+	  return false;
+
+	block->bbox_min[layer] = point_int_t( x0, y0 );
+	block->bbox_max[layer] = point_int_t( x1, y1 );
+	block->rendered_pts[layer].resize( pts );
+	FOR_EACH( it, block->rendered_pts[layer] )
+	  {
+	    int32_t x( 0 ), y( 0 );
+	    snapshot_get( pos, end, x );
+	    snapshot_get( pos, end, y );
+	    *it = point_int_t( x, y );
+	  }
+      }
+
+  // fix up the block numbers in each cell into pointers
+  bool ok( true );
+  for( unsigned int layer(0); ok && layer<2; ++layer )
+    {
+      uint32_t regions( 0 );
+      ok = snapshot_get( pos, end, regions );
+      
+      for( uint32_t i(0); ok && i<regions; ++i )
+	{
+	  int32_t x( 0 ), y( 0 ), r( 0 );
+	  uint32_t cells( 0 );
+	  ok = snapshot_get( pos, end, x ) &&
+	    snapshot_get( pos, end, y ) &&
+	    snapshot_get( pos, end, r ) &&
+	    snapshot_get( pos, end, cells ) &&
+	    r >= 0 && r < SUPERREGIONSIZE;
+	  if( ! ok )
+	    break;
+
+	  Region* reg( GetSuperRegionCreate( point_int_t( x, y ))
+		       ->GetRegion( r % SUPERREGIONWIDTH, r / SUPERREGIONWIDTH ));
+
+	  for( uint32_t j(0); ok && j<cells; ++j )
+	    {
+	      uint16_t c( 0 );
+	      uint32_t n( 0 );
+	      ok = snapshot_get( pos, end, c ) &&
+		snapshot_get( pos, end, n ) &&
+		c < REGIONSIZE &&
+		(size_t)(end - pos) / sizeof(uint32_t) >= n;
+	      if( ! ok )
+		break;
+	      
+	      Cell* cell( reg->GetCell( c % REGIONWIDTH, c / REGIONWIDTH ));
+	      for( uint32_t k(0); ok && k<n; ++k )
+		{
+		  uint32_t number( 0 );
+		  snapshot_get( pos, end, number );
+		  ok = number < blocks.size();
+		  if( ok )
+		    cell->AddBlock( blocks[number], layer );
+		}
+	    }
+	}
+    }
+  
+  // every block must now be rendered just where the snapshot says
+  for( size_t b(0); ok && b<blocks.size(); ++b )
+    for( unsigned int layer(0); layer<2; ++layer )
+      if( (bool)rendered[ 2*b + layer ] == blocks[b]->rendered_cells[layer].empty() )
+	ok = false;
+
+  if( ! ok || pos != end )
+    {
+      // take the blocks out again, for Map() to render afresh
+      FOR_EACH( it, blocks )
+	for( unsigned int layer(0); layer<2; ++layer )
+	  {
+	    FOR_EACH( cit, (*it)->rendered_cells[layer] )
+	      (*cit)->RemoveBlock( *it, layer );
+	    (*it)->rendered_cells[layer].clear();
+	  }
+      return false;
+    }
+  
+  // the rest of what MapPixels() and BlockGroup::Map() do
+  FOR_EACH( it, blocks )
+    {
+      for( unsigned int layer(0); layer<2; ++layer )
+	if( ! (*it)->rendered_cells[layer].empty() )
+	  BroadPhaseInsert( *it, layer );
+      
+      (*it)->global_z = (*it)->GlobalZ();
+    }
+  
+  FOR_EACH( it, models )
+    {
+      (*it)->blockgroup.CacheBoundingBox( 0 );
+      (*it)->blockgroup.CacheBoundingBox( 1 );
+      (*it)->map_pose[0] = (*it)->map_pose[1] = (*it)->pose;
+    }
+
+  return true;
+}
+
+Model* World::TestPolyCollision( const std::vector<point_int_t>& pts, 
+				 const Block* block, 
+				 unsigned int layer )
+{
+  const Model& mod( block->group->mod );
+  const size_t pt_count( pts.size() );
+  
+  for( size_t i(0); i<pt_count; ++i )
+    {
+      const point_int_t& start(pts[i] );
+      const point_int_t& end(pts[(i+1)%pt_count]);
+      
+      // walk the same cells as MapPoly()
+      const int32_t dx( end.x - start.x );
+      const int32_t dy( end.y - start.y );
+      const int32_t sx(sgn(dx));  
+      const int32_t sy(sgn(dy));  
+      const int32_t bx(2*abs(dx));	
+      const int32_t by(2*abs(dy));	 
+      
+      int32_t exy(abs(dy)-abs(dx)); 
+      int32_t n(abs(dx)+abs(dy));
+      
+      int32_t globx(start.x);
+      int32_t globy(start.y);
+      
+      while( n ) 
+	{
+	  SuperRegion* sr( GetSuperRegion( point_int_t(GETSREG(globx), 
+							GETSREG(globy))));
+	  if( sr )
+	    {
+	      Region* reg( sr->GetRegion( GETREG(globx), GETREG(globy)));
+	      
+	      // don't make the region allocate cells just to look at them
+	      if( reg->count )
+		{
+		  Cell* c( reg->GetCell( GETCELL(globx), GETCELL(globy) ));
+		  
+		  FOR_EACH( it, c->GetBlocks(layer) )
+		    {
+		      const Block* testblock( *it );
+		      Model* testmod( &testblock->group->mod );
+		      
+		      // same criteria as Block::TestCollision()
+		      if( (testmod != &mod) &&
+			  testmod->vis.obstacle_return &&
+			  (!mod.IsRelated( testmod )) && 
+			  testblock->global_z.min <= block->global_z.max && 
+			  testblock->global_z.max >= block->global_z.min )
+			return testmod;
+		    }
+		}
+	    }
+	  
+	  if( exy < 0 ) 
+	    {
+	      globx += sx;
+	      exy += by;
+	    }
+	  else 
+	    {
+	      globy += sy;
+	      exy -= bx; 
+	    }
+	  --n;
+	}
+    }
+  
+  return NULL;
+}
+
+// A block whose box spans more regions than this, either way, is
+// counted by region instead of hashed: its box says little about
+// where its cells are.
+static const int32_t BROAD_SPAN( 4 );
+
+static bool too_big_to_hash( const point_int_t& bmin, const point_int_t& bmax )
+{
+  return( (bmax.x >> RBITS) - (bmin.x >> RBITS) >= BROAD_SPAN ||
+	  (bmax.y >> RBITS) - (bmin.y >> RBITS) >= BROAD_SPAN );
+}
+
+void World::BroadPhaseInsert( Block* block, unsigned int layer )
+{
+  const point_int_t& bmin( block->bbox_min[layer] );
+  const point_int_t& bmax( block->bbox_max[layer] );
+
+  if( too_big_to_hash( bmin, bmax ) )
+    {
+      FOR_EACH( it, block->rendered_cells[layer] )
+	++(*it)->region->broad_count[layer];
+      return;
+    }
+
+  // add the block to every region-sized bucket its box touches
+  for( int32_t y( bmin.y >> RBITS ); y <= (bmax.y >> RBITS); ++y )
+    for( int32_t x( bmin.x >> RBITS ); x <= (bmax.x >> RBITS); ++x )
+      bbox_buckets[layer][point_int_t(x,y)].push_back( block );
+}
+
+void World::BroadPhaseRemove( Block* block, unsigned int layer )
+{
+  const point_int_t& bmin( block->bbox_min[layer] );
+  const point_int_t& bmax( block->bbox_max[layer] );
+
+  if( too_big_to_hash( bmin, bmax ) )
+    {
+      FOR_EACH( it, block->rendered_cells[layer] )
+	--(*it)->region->broad_count[layer];
+      return;
+    }
+
+  for( int32_t y( bmin.y >> RBITS ); y <= (bmax.y >> RBITS); ++y )
+    for( int32_t x( bmin.x >> RBITS ); x <= (bmax.x >> RBITS); ++x )
+      {
+	std::map<point_int_t,std::vector<Block*> >::iterator bucket =
+	  bbox_buckets[layer].find( point_int_t(x,y) );
+	
+	if( bucket == bbox_buckets[layer].end() )
+	  continue;
+
+	std::vector<Block*>& v( bucket->second );
+	std::vector<Block*>::iterator it = std::find( v.begin(), v.end(), block );
+	
+	if( it != v.end() ) // order does not matter, so swap and pop
+	  {
+	    *it = v.back();
+	    v.pop_back();
+	  }
+
+	// an empty bucket is kept: a moving model will soon fill it again
+      }
+}
+
+bool World::BroadPhaseTest( const Model* mod, unsigned int layer, int32_t margin )
+{
+  if( mod->bbox_empty[layer] )
+    return false;
+
+  const point_int_t mmin( mod->bbox_min[layer].x - margin, mod->bbox_min[layer].y - margin );
+  const point_int_t mmax( mod->bbox_max[layer].x + margin, mod->bbox_max[layer].y + margin );
+
+  for( int32_t y( mmin.y >> RBITS ); y <= (mmax.y >> RBITS); ++y )
+    for( int32_t x( mmin.x >> RBITS ); x <= (mmax.x >> RBITS); ++x )
+      {
+	std::map<point_int_t,std::vector<Block*> >::const_iterator bucket =
+	  bbox_buckets[layer].find( point_int_t(x,y) );
+	
+	if( bucket == bbox_buckets[layer].end() )
+	  continue;
+	
+	FOR_EACH( it, bucket->second )
+	  {
+	    const Block* b( *it );
+	    Model* testmod( &b->group->mod );
+	    
+	    if( testmod != mod &&
+		testmod->vis.obstacle_return &&
+		b->bbox_min[layer].x <= mmax.x &&
+		b->bbox_max[layer].x >= mmin.x &&
+		b->bbox_min[layer].y <= mmax.y &&
+		b->bbox_max[layer].y >= mmin.y &&
+		! mod->IsRelated( testmod ) )
+	      return true;
+	  }
+      }
+
+  // the blocks too big to hash: look in the cells of our box, in
+  // the regions that hold any of them
+  for( int32_t y( mmin.y >> RBITS ); y <= (mmax.y >> RBITS); ++y )
+    for( int32_t x( mmin.x >> RBITS ); x <= (mmax.x >> RBITS); ++x )
+      {
+	const int32_t rx( x * REGIONWIDTH ), ry( y * REGIONWIDTH );
+	SuperRegion* sr( GetSuperRegion( point_int_t( GETSREG(rx), GETSREG(ry) )));
+	if( sr == NULL )
+	  continue;
+
+	Region* reg( sr->GetRegion( GETREG(rx), GETREG(ry) ));
+	if( reg->broad_count[layer] == 0 )
+	  continue;
+
+	// our box, clipped to this region, in cells
+	const int32_t cx0( std::max( mmin.x, rx ) - rx );
+	const int32_t cx1( std::min( mmax.x, rx + REGIONWIDTH - 1 ) - rx );
+	const int32_t cy0( std::max( mmin.y, ry ) - ry );
+	const int32_t cy1( std::min( mmax.y, ry + REGIONWIDTH - 1 ) - ry );
+
+	for( int32_t cy(cy0); cy<=cy1; ++cy )
+	  for( int32_t cx(cx0); cx<=cx1; ++cx )
+	    FOR_EACH( it, reg->cells[ cx + cy * REGIONWIDTH ].blocks[layer] )
+	      {
+		const Block* b( *it );
+		Model* testmod( &b->group->mod );
+		
+		if( testmod != mod &&
+		    testmod->vis.obstacle_return &&
+		    too_big_to_hash( b->bbox_min[layer], b->bbox_max[layer] ) &&
+		    ! mod->IsRelated( testmod ) )
+		  return true;
+	      }
+      }
+  
+  return false;
+}
+
+/** append mod and all its descendants to tree */
+static void append_tree( Model* mod, std::vector<Model*>& tree )
+{
+  tree.push_back( mod );
+  
+  FOR_EACH( it, mod->GetChildren() )
+    append_tree( *it, tree );
+}
+
+/** true if mod is in roots or is a descendant of a model in roots */
+static bool in_trees( const Model* mod, const std::set<const Model*>& roots )
+{
+  for( ; mod; mod = mod->Parent() )
+    if( roots.count( mod ) )
+      return true;
+  
+  return false;
+}
+
+unsigned int World::PlaceInFreeSpace( const std::vector<Model*>& mods,
+				      meters_t xmin, meters_t xmax, 
+				      meters_t ymin, meters_t ymax )
+{
+  const int32_t x0( MetersToPixels( xmin ) );
+  const int32_t y0( MetersToPixels( ymin ) );
+  const int32_t x1( MetersToPixels( xmax ) );
+  const int32_t y1( MetersToPixels( ymax ) );
+
+  if( mods.empty() || x1 < x0 || y1 < y0 )
+    return 0;
+  
+  const unsigned int layer( updates % 2 );
+  
+  // footprint radius in pixels: a circle around the model's origin
+  // that holds the bounding box of every block rendered by the model
+  // and its descendants, at any heading, plus one for rounding
+  double radius_px( 0 );
+  FOR_EACH( it, mods )
+    {
+      const Pose gpose( (*it)->GetGlobalPose() );
+      const double ox( gpose.x * ppm );
+      const double oy( gpose.y * ppm );
+      
+      std::vector<Model*> tree;
+      append_tree( *it, tree );
+      
+      FOR_EACH( mit, tree )
+	if( ! (*mit)->bbox_empty[layer] )
+	  {
+	    const point_int_t& bmin( (*mit)->bbox_min[layer] );
+	    const point_int_t& bmax( (*mit)->bbox_max[layer] );
+	    
+	    const double dx( std::max( fabs( bmin.x - ox ), fabs( bmax.x + 1 - ox )));
+	    const double dy( std::max( fabs( bmin.y - oy ), fabs( bmax.y + 1 - oy )));
+	    radius_px = std::max( radius_px, hypot( dx, dy ) );
+	  }
+    }
+  radius_px += 1.0;
+  
+  // the index has one entry for each square of step x step pixels,
+  // a fraction of the largest footprint, but no more than a few
+  // million entries in all
+  int32_t step( std::max( 1, (int32_t)(radius_px / 4.0) ) );
+  while( (int64_t)((x1-x0)/step + 1) * ((y1-y0)/step + 1) > (1<<22) )
+    step *= 2;
+  
+  // half-width in entries of the window that holds any footprint
+  // centred somewhere inside an entry
+  const int32_t reach( (int32_t)ceil( radius_px / step ) );
+  
+  // pad the index by reach entries on all sides so every candidate
+  // has its whole window inside the index
+  const int32_t gx0( x0 - reach * step );
+  const int32_t gy0( y0 - reach * step );
+  const int32_t w( (x1-x0)/step + 1 + 2*reach );
+  const int32_t h( (y1-y0)/step + 1 + 2*reach );
+  const int32_t gx1( gx0 + w * step - 1 );
+  const int32_t gy1( gy0 + h * step - 1 );
+  
+  const std::set<const Model*> placing( mods.begin(), mods.end() );
+  
+  // mark the entries that contain an obstacle, visiting the grid a
+  // region at a time and skipping the empty ones
+  std::vector<uint8_t> occupied( w*h, 0 );
+  
+  for( int32_t ry( gy0 & ~CELLMASK ); ry <= gy1; ry += REGIONWIDTH )
+    for( int32_t rx( gx0 & ~CELLMASK ); rx <= gx1; rx += REGIONWIDTH )
+      {
+	SuperRegion* sr( GetSuperRegion( point_int_t( GETSREG(rx), GETSREG(ry) )));
+	if( sr == NULL )
+	  continue;
+	
+	Region* reg( sr->GetRegion( GETREG(rx), GETREG(ry) ));
+	if( reg->count == 0 )
+	  continue;
+	
+	const int32_t pymax( std::min( ry + REGIONWIDTH - 1, gy1 ) );
+	const int32_t pxmax( std::min( rx + REGIONWIDTH - 1, gx1 ) );
+	
+	for( int32_t py( std::max( ry, gy0 ) ); py <= pymax; ++py )
+	  for( int32_t px( std::max( rx, gx0 ) ); px <= pxmax; ++px )
+	    {
+	      uint8_t& entry( occupied[ (px-gx0)/step + (py-gy0)/step * w ] );
+	      if( entry )
+		continue;
+	      
+	      Cell* c( reg->GetCell( GETCELL(px), GETCELL(py) ));
+	      
+	      FOR_EACH( it, c->GetBlocks(layer) )
+		{
+		  const Model* testmod( &(*it)->group->mod );
+		  if( testmod->vis.obstacle_return && ! in_trees( testmod, placing ) )
+		    {
+		      entry = 1;
+		      break;
+		    }
+		}
+	    }
+      }
+  
+  // summed-area table, so each window is tested in constant time
+  std::vector<uint32_t> sum( (w+1) * (h+1), 0 );
+  for( int32_t j(0); j<h; ++j )
+    for( int32_t i(0); i<w; ++i )
+      sum[ (i+1) + (j+1)*(w+1) ] = occupied[ i + j*w ] 
+	+ sum[ i + (j+1)*(w+1) ] + sum[ (i+1) + j*(w+1) ] - sum[ i + j*(w+1) ];
+  
+  // the free-cell index: every free entry in the rectangle, split
+  // into those whose whole window is free, where a model is sure to
+  // fit, and the rest, which are worth a try once the first run out
+  std::vector<uint32_t> clear, tight;
+  for( int32_t j(reach); j<h-reach; ++j )
+    for( int32_t i(reach); i<w-reach; ++i )
+      {
+	const int32_t i0( i-reach ), i1( i+reach+1 );
+	const int32_t j0( j-reach ), j1( j+reach+1 );
+	
+	if( sum[ i1 + j1*(w+1) ] - sum[ i0 + j1*(w+1) ] 
+	    - sum[ i1 + j0*(w+1) ] + sum[ i0 + j0*(w+1) ] == 0 )
+	  clear.push_back( i + j*w );
+	else if( ! occupied[ i + j*w ] )
+	  tight.push_back( i + j*w );
+      }
+  
+  // entries under the blocks of models we have already placed
+  std::vector<uint8_t> taken( w*h, 0 );
+  
+  unsigned int placed( 0 );
+  
+  FOR_EACH( it, mods )
+    {
+      Model* mod( *it );
+      const Pose start( mod->GetGlobalPose() );
+      bool found( false );
+      
+      while( ! (clear.empty() && tight.empty()) && ! found )
+	{
+	  std::vector<uint32_t>& candidates( clear.empty() ? tight : clear );
+	  
+	  // draw a random candidate without replacement
+	  const size_t k( std::min( (size_t)(drand48() * candidates.size()), 
+				    candidates.size()-1 ));
+	  const int32_t i( candidates[k] % w );
+	  const int32_t j( candidates[k] / w );
+	  candidates[k] = candidates.back();
+	  candidates.pop_back();
+	  
+	  // skip entries under a model we already placed
+	  if( taken[ i + j*w ] )
+	    continue;
+	  
+	  // a random point inside the entry, kept inside the rectangle
+	  const meters_t x( (gx0 + (i + drand48()) * step) / ppm );
+	  const meters_t y( (gy0 + (j + drand48()) * step) / ppm );
+	  
+	  mod->SetGlobalPose( Pose( std::min( std::max( x, xmin ), xmax ),
+				    std::min( std::max( y, ymin ), ymax ),
+				    start.z,
+				    normalize( drand48() * (2.0 * M_PI) )));
+	  
+	  // the index is conservative, but the blocks have the last word
+	  if( mod->TestCollision() )
+	    continue;
+	  
+	  // claim the entries under the blocks the model just rendered
+	  std::vector<Model*> tree;
+	  append_tree( mod, tree );
+	  
+	  FOR_EACH( mit, tree )
+	    if( ! (*mit)->bbox_empty[layer] )
+	      {
+		const point_int_t& bmin( (*mit)->bbox_min[layer] );
+		const point_int_t& bmax( (*mit)->bbox_max[layer] );
+		
+		const int32_t a0( std::max( 0, (bmin.x - gx0) / step ) );
+		const int32_t a1( std::min( w-1, (bmax.x - gx0) / step ) );
+		const int32_t b0( std::max( 0, (bmin.y - gy0) / step ) );
+		const int32_t b1( std::min( h-1, (bmax.y - gy0) / step ) );
+		
+		for( int32_t b( b0 ); b <= b1; ++b )
+		  for( int32_t a( a0 ); a <= a1; ++a )
+		    taken[ a + b*w ] = 1;
+	      }
+	  
+	  found = true;
+	  ++placed;
+	}
+      
+      if( ! found )
+	{
+	  mod->SetGlobalPose( start );
+	  break;
+	}
+    }
+  
+  return placed;
+}
 
 void World::Extend( point3_t pt )
 {
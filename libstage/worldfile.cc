@@ -37,6 +37,8 @@
 #include <unistd.h>
 #include <math.h>
 #include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 //#define DEBUG
 
@@ -51,6 +53,26 @@ using namespace Stg;
 #define isblank(a) (a == ' ' || a == '\t')
 #endif
 
+// 32 bit FNV-1a, for the string pool
+static size_t hash_string( const char* str, size_t len )
+{
+  uint32_t h( 2166136261U );
+  for( size_t i=0; i<len; i++ )
+    {
+      h ^= (uint8_t)str[i];
+      h *= 16777619U;
+    }
+  return h;
+}
+
+// scramble a property name id, for the property tables
+static size_t hash_name( unsigned int name_id )
+{
+  uint32_t h( name_id * 2654435761U );
+  h ^= h >> 16;
+  return h;
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Useful macros for dumping parser errors
 #define TOKEN_ERR(z, l)				\
@@ -63,6 +85,8 @@ using namespace Stg;
 // Default constructor
 Worldfile::Worldfile() :
   tokens(),
+  strings(),
+  string_slots(),
   macros(),
   entities(),
 	properties(),
@@ -219,6 +243,145 @@ bool Worldfile::Save(const std::string& filename )
 }
 
 
+///////////////////////////////////////////////////////////////////////////
+// Save the parsed world to a snapshot. Macros are left out: they are
+// only needed while parsing.
+void Worldfile::SaveSnapshot(std::string& buf)
+{
+  snapshot_put( buf, this->filename );
+  snapshot_put( buf, this->unit_length );
+  snapshot_put( buf, this->unit_angle );
+
+  // the string pool goes in order, so that token values and property
+  // names keep their indices
+  snapshot_put( buf, (uint32_t)strings.size() );
+  FOR_EACH( it, strings )
+    snapshot_put( buf, *it );
+
+  snapshot_put( buf, (uint32_t)tokens.size() );
+  FOR_EACH( it, tokens )
+    {
+      snapshot_put( buf, (int32_t)it->include );
+      snapshot_put( buf, (int32_t)it->type );
+      snapshot_put( buf, (uint32_t)it->value );
+    }
+
+  snapshot_put( buf, (uint32_t)entities.size() );
+  FOR_EACH( it, entities )
+    {
+      snapshot_put( buf, (int32_t)it->parent );
+      snapshot_put( buf, it->type );
+    }
+
+  snapshot_put( buf, (uint32_t)properties.size() );
+  FOR_EACH( it, properties )
+    {
+      const CProperty* property( *it );
+      snapshot_put( buf, (int32_t)property->entity );
+      snapshot_put( buf, (uint32_t)property->name_id );
+      snapshot_put( buf, (int32_t)property->line );
+      snapshot_put( buf, (uint32_t)property->values.size() );
+      FOR_EACH( vit, property->values )
+	snapshot_put( buf, (int32_t)*vit );
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Load the parsed world from a snapshot
+bool Worldfile::LoadSnapshot(const uint8_t*& pos, const uint8_t* end)
+{
+  ClearProperties();
+  ClearMacros();
+  ClearEntities();
+  ClearTokens();
+
+  if( ! snapshot_get( pos, end, this->filename ) ||
+      ! snapshot_get( pos, end, this->unit_length ) ||
+      ! snapshot_get( pos, end, this->unit_angle ) )
+    return false;
+
+  uint32_t count( 0 );
+  if( ! snapshot_get( pos, end, count ) )
+    return false;
+
+  for( uint32_t i=0; i<count; i++ )
+    {
+      uint32_t len( 0 );
+      if( ! snapshot_get( pos, end, len ) || (size_t)(end - pos) < len )
+	return false;
+
+      // every string in the pool is different, so each one is added
+      if( InternString( (const char*)pos, len ) != i )
+	return false;
+      pos += len;
+    }
+
+  if( ! snapshot_get( pos, end, count ) )
+    return false;
+
+  tokens.reserve( count );
+  for( uint32_t i=0; i<count; i++ )
+    {
+      int32_t include( 0 ), type( 0 );
+      uint32_t value( 0 );
+      if( ! snapshot_get( pos, end, include ) ||
+	  ! snapshot_get( pos, end, type ) ||
+	  ! snapshot_get( pos, end, value ) ||
+	  value >= strings.size() )
+	return false;
+
+      tokens.push_back( CToken( include, type, value ) );
+    }
+
+  if( ! snapshot_get( pos, end, count ) )
+    return false;
+
+  entities.reserve( count );
+  for( uint32_t i=0; i<count; i++ )
+    {
+      int32_t parent( 0 );
+      std::string type;
+      if( ! snapshot_get( pos, end, parent ) ||
+	  ! snapshot_get( pos, end, type ) )
+	return false;
+
+      AddEntity( parent, type.c_str() );
+    }
+
+  if( ! snapshot_get( pos, end, count ) )
+    return false;
+
+  properties.reserve( count );
+  for( uint32_t i=0; i<count; i++ )
+    {
+      int32_t entity( 0 ), line( 0 );
+      uint32_t name_id( 0 ), values( 0 );
+      if( ! snapshot_get( pos, end, entity ) ||
+	  ! snapshot_get( pos, end, name_id ) ||
+	  ! snapshot_get( pos, end, line ) ||
+	  ! snapshot_get( pos, end, values ) ||
+	  entity < 0 || entity >= (int)entities.size() ||
+	  name_id >= strings.size() ||
+	  (size_t)(end - pos) / sizeof(int32_t) < values )
+	return false;
+
+      CProperty* property( AddProperty( entity, strings[name_id].c_str(), line ) );
+      property->values.resize( values );
+      FOR_EACH( it, property->values )
+	{
+	  int32_t value( 0 );
+	  snapshot_get( pos, end, value );
+	  if( value < 0 || value >= (int)tokens.size() )
+	    return false;
+	  *it = value;
+	}
+    }
+
+  return true;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////
 // Check for unused properties and print warnings
 bool Worldfile::WarnUnused()
@@ -227,10 +390,10 @@ bool Worldfile::WarnUnused()
   
   FOR_EACH( it, properties )
     {
-      if( ! it->second->used )
+      if( ! (*it)->used )
 	{
 	  PRINT_WARN3("worldfile %s:%d : property [%s] is defined but not used",
-		      this->filename.c_str(), it->second->line, it->second->name.c_str());
+		      this->filename.c_str(), (*it)->line, (*it)->name.c_str());
 	  unused = true;
 	}
     }
@@ -243,87 +406,90 @@ bool Worldfile::WarnUnused()
 // Load tokens from a file.
 bool Worldfile::LoadTokens(FILE *file, int include)
 {
-  int ch;
-  int line;
-  char token[256];
+  struct stat st;
+  const int fd( fileno(file) );
+
+  if( fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) && st.st_size > 0 )
+    {
+      const size_t len( st.st_size );
+      void* data( mmap( NULL, len, PROT_READ, MAP_PRIVATE, fd, 0 ) );
+      if( data != MAP_FAILED )
+	{
+	  const bool ok( LoadTokens( (const char*)data, len, include ) );
+	  munmap( data, len );
+	  return ok;
+	}
+    }
+
+  // not a regular file, or it can't be mapped: read it all in
+  std::string text;
+  char buf[BUFSIZ];
+  size_t n;
+  while( (n = fread( buf, 1, sizeof(buf), file )) > 0 )
+    text.append( buf, n );
+
+  return LoadTokens( text.data(), text.size(), include );
+}
 
-  line = 1;
 
-  while (true)
+///////////////////////////////////////////////////////////////////////////
+// Load tokens from a buffer.
+bool Worldfile::LoadTokens(const char *data, size_t len, int include)
+{
+  const char *pos = data;
+  const char *end = data + len;
+  int line = 1;
+
+  while (pos < end)
     {
-      ch = fgetc(file);
-      if (ch == EOF)
-	break;
+      const char ch = *pos;
 
-      if ((char) ch == '#')
+      if (ch == '#')
 	{
-	  ungetc(ch, file);
-	  if (!LoadTokenComment(file, &line, include))
+	  if (!LoadTokenComment(pos, end, &line, include))
 	    return false;
 	}
-      else if (isalpha(ch))
+      else if (isalpha((unsigned char)ch))
 	{
-	  ungetc(ch, file);
-	  if (!LoadTokenWord(file, &line, include))
+	  if (!LoadTokenWord(pos, end, &line, include))
 	    return false;
 	}
       else if (strchr("+-.0123456789", ch))
 	{
-	  ungetc(ch, file);
-	  if (!LoadTokenNum(file, &line, include))
+	  if (!LoadTokenNum(pos, end, &line, include))
 	    return false;
 	}
-      else if (isblank(ch))
+      else if (isblank((unsigned char)ch))
 	{
-	  ungetc(ch, file);
-	  if (!LoadTokenSpace(file, &line, include))
+	  if (!LoadTokenSpace(pos, end, &line, include))
 	    return false;
 	}
       else if (ch == '"')
 	{
-	  ungetc(ch, file);
-	  if (!LoadTokenString(file, &line, include))
+	  if (!LoadTokenString(pos, end, &line, include))
 	    return false;
 	}
-      else if (strchr("(", ch))
-	{
-	  token[0] = ch;
-	  token[1] = 0;
-	  AddToken(TokenOpenEntity, token, include);
-	}
-      else if (strchr(")", ch))
-	{
-	  token[0] = ch;
-	  token[1] = 0;
-	  AddToken(TokenCloseEntity, token, include);
-	}
-      else if (strchr("[", ch))
-	{
-	  token[0] = ch;
-	  token[1] = 0;
-	  AddToken(TokenOpenTuple, token, include);
-	}
-      else if (strchr("]", ch))
-	{
-	  token[0] = ch;
-	  token[1] = 0;
-	  AddToken(TokenCloseTuple, token, include);
-	}
+      else if (ch == '(')
+	AddToken(TokenOpenEntity, pos++, 1, include);
+      else if (ch == ')')
+	AddToken(TokenCloseEntity, pos++, 1, include);
+      else if (ch == '[')
+	AddToken(TokenOpenTuple, pos++, 1, include);
+      else if (ch == ']')
+	AddToken(TokenCloseTuple, pos++, 1, include);
       else if ( 0x0d == ch )
 	{
-	  ch = fgetc(file);
-	  if ( 0x0a != ch )
-	    ungetc(ch, file);
+	  if ( ++pos < end && 0x0a == *pos )
+	    pos++;
 	  line++;
-	  AddToken(TokenEOL, "\n", include);
+	  AddToken(TokenEOL, "\n", 1, include);
 	}
       else if ( 0x0a == ch )
 	{
-	  ch = fgetc(file);
-	  if ( 0x0d != ch )
-	    ungetc(ch, file);
+	  if ( ++pos < end && 0x0d == *pos )
+	    pos++;
 	  line++;
-	  AddToken(TokenEOL, "\n", include);
+	  AddToken(TokenEOL, "\n", 1, include);
 	}
       else
 	{
@@ -338,123 +504,72 @@ bool Worldfile::LoadTokens(FILE *file, int include)
 
 ///////////////////////////////////////////////////////////////////////////
 // Read in a comment token
-bool Worldfile::LoadTokenComment(FILE *file, int *line, int include)
+bool Worldfile::LoadTokenComment(const char *&pos, const char *end, int *line, int include)
 {
-  char token[256];
-  int len;
-  int ch;
-
-  len = 0;
-  memset(token, 0, sizeof(token));
+  const char *start = pos;
 
-  while (true)
-    {
-      ch = fgetc(file);
+  while (pos < end && 0x0a != *pos && 0x0d != *pos)
+    pos++;
 
-      if (ch == EOF)
-	{
-	  AddToken(TokenComment, token, include);
-	  return true;
-	}
-      else if ( 0x0a == ch || 0x0d == ch )
-	{
-	  ungetc(ch, file);
-	  AddToken(TokenComment, token, include);
-	  return true;
-	}
-      else
-	token[len++] = ch;
-    }
+  AddToken(TokenComment, start, pos - start, include);
   return true;
 }
 
 
 ///////////////////////////////////////////////////////////////////////////
 // Read in a word token
-bool Worldfile::LoadTokenWord(FILE *file, int *line, int include)
+bool Worldfile::LoadTokenWord(const char *&pos, const char *end, int *line, int include)
 {
-  char token[256];
-  int len;
-  int ch;
+  const char *start = pos;
 
-  len = 0;
-  memset(token, 0, sizeof(token));
+  while (pos < end &&
+	 (isalpha((unsigned char)*pos) || isdigit((unsigned char)*pos) || strchr(".-_[]", *pos)))
+    pos++;
 
-  while (true)
-    {
-      ch = fgetc(file);
+  const size_t len = pos - start;
+  AddToken(TokenWord, start, len, include);
 
-      if (ch == EOF)
-	{
-	  AddToken(TokenWord, token, include);
-	  return true;
-	}
-      else if (isalpha(ch) || isdigit(ch) || strchr(".-_[]", ch))
-	{
-	  token[len++] = ch;
-	}
-      else
-	{
-	  if (strcmp(token, "include") == 0)
-	    {
-	      ungetc(ch, file);
-	      AddToken(TokenWord, token, include);
-	      if (!LoadTokenInclude(file, line, include))
-		return false;
-	    }
-	  else
-	    {
-	      ungetc(ch, file);
-	      AddToken(TokenWord, token, include);
-	    }
-	  return true;
-	}
-    }
-  assert(false);
-  return false;
+  // a word that ends the file can't start an include statement
+  if (pos < end && len == 7 && strncmp(start, "include", 7) == 0)
+    return LoadTokenInclude(pos, end, line, include);
+
+  return true;
 }
 
 
 ///////////////////////////////////////////////////////////////////////////
 // Load an include token; this will load the include file.
-bool Worldfile::LoadTokenInclude(FILE *file, int *line, int include)
+bool Worldfile::LoadTokenInclude(const char *&pos, const char *end, int *line, int include)
 {
-  int ch;
   const char *filename;
   char *fullpath;
 
-  ch = fgetc(file);
-
-  if (ch == EOF)
+  if (pos == end)
     {
       TOKEN_ERR("incomplete include statement", *line);
       return false;
     }
-  else if (!isblank(ch))
+  else if (!isblank((unsigned char)*pos))
     {
       TOKEN_ERR("syntax error in include statement", *line);
       return false;
     }
 
-  ungetc(ch, file);
-  if (!LoadTokenSpace(file, line, include))
+  if (!LoadTokenSpace(pos, end, line, include))
     return false;
 
-  ch = fgetc(file);
-
-  if (ch == EOF)
+  if (pos == end)
     {
       TOKEN_ERR("incomplete include statement", *line);
       return false;
     }
-  else if (ch != '"')
+  else if (*pos != '"')
     {
       TOKEN_ERR("syntax error in include statement", *line);
       return false;
     }
 
-  ungetc(ch, file);
-  if (!LoadTokenString(file, line, include))
+  if (!LoadTokenString(pos, end, line, include))
     return false;
 
   // This is the basic filename
@@ -464,7 +579,9 @@ bool Worldfile::LoadTokenInclude(FILE *file, int *line, int include)
   // we append the path of the world file.
   if (filename[0] == '/' || filename[0] == '~')
     {
-      fullpath = strdup(filename);
+      fullpath = new char[PATH_MAX];
+      memset(fullpath, 0, PATH_MAX);
+      strncpy(fullpath, filename, PATH_MAX - 1);
     }
   else if (this->filename[0] == '/' || this->filename[0] == '~')
     {
@@ -512,22 +629,17 @@ bool Worldfile::LoadTokenInclude(FILE *file, int *line, int include)
     {
       PRINT_ERR2("unable to open include file %s : %s",
 		 fullpath, strerror(errno));
-      //free(fullpath);
 		delete[] fullpath;
       return false;
     }
 
   // Terminate the include line
-  AddToken(TokenEOL, "\n", include);
-
-  //DumpTokens();
+  AddToken(TokenEOL, "\n", 1, include);
 
   // Read tokens from the file
   if (!LoadTokens(infile, include + 1))
     {
 		fclose( infile );
-      //DumpTokens();
-      //free(fullpath);
 		delete[] fullpath;
       return false;
     }
@@ -537,8 +649,8 @@ bool Worldfile::LoadTokenInclude(FILE *file, int *line, int include)
 
   // consume the rest of the include line XX a bit of a hack - assumes
   // that an include is the last thing on a line
-  while ( ch != '\n' )
-    ch = fgetc(file);
+  while ( pos < end && *pos++ != '\n' )
+    ;
 
   delete[] fullpath;
   return true;
@@ -547,110 +659,51 @@ bool Worldfile::LoadTokenInclude(FILE *file, int *line, int include)
 
 ///////////////////////////////////////////////////////////////////////////
 // Read in a number token
-bool Worldfile::LoadTokenNum(FILE *file, int *line, int include)
+bool Worldfile::LoadTokenNum(const char *&pos, const char *end, int *line, int include)
 {
-  char token[256];
-  int len;
-  int ch;
-
-  len = 0;
-  memset(token, 0, sizeof(token));
+  const char *start = pos;
 
-  while (true)
-    {
-      ch = fgetc(file);
+  while (pos < end && strchr("+-.0123456789", *pos))
+    pos++;
 
-      if (ch == EOF)
-	{
-	  AddToken(TokenNum, token, include);
-	  return true;
-	}
-      else if (strchr("+-.0123456789", ch))
-	{
-	  token[len++] = ch;
-	}
-      else
-	{
-	  AddToken(TokenNum, token, include);
-	  ungetc(ch, file);
-	  return true;
-	}
-    }
-  assert(false);
-  return false;
+  AddToken(TokenNum, start, pos - start, include);
+  return true;
 }
 
 
 ///////////////////////////////////////////////////////////////////////////
 // Read in a string token
-bool Worldfile::LoadTokenString(FILE *file, int *line, int include)
+bool Worldfile::LoadTokenString(const char *&pos, const char *end, int *line, int include)
 {
-  int ch;
-  int len;
-  char token[256];
-
-  len = 0;
-  memset(token, 0, sizeof(token));
+  // skip the opening quote
+  const char *start = ++pos;
 
-  ch = fgetc(file);
+  while (pos < end && *pos != '"' && 0x0a != *pos && 0x0d != *pos)
+    pos++;
 
-  while (true)
+  if (pos == end || *pos != '"')
     {
-      ch = fgetc(file);
-
-      if ( EOF == ch || 0x0a == ch || 0x0d == ch )
-	{
-	  TOKEN_ERR("unterminated string constant", *line);
-	  return false;
-	}
-      else if (ch == '"')
-	{
-	  AddToken(TokenString, token, include);
-	  return true;
-	}
-      else
-	{
-	  token[len++] = ch;
-	}
+      TOKEN_ERR("unterminated string constant", *line);
+      return false;
     }
-  assert(false);
-  return false;
+
+  AddToken(TokenString, start, pos - start, include);
+  pos++; // skip the closing quote
+  return true;
 }
 
 
 ///////////////////////////////////////////////////////////////////////////
 // Read in a whitespace token
-bool Worldfile::LoadTokenSpace(FILE *file, int *line, int include)
+bool Worldfile::LoadTokenSpace(const char *&pos, const char *end, int *line, int include)
 {
-  int ch;
-  int len;
-  char token[256];
-
-  len = 0;
-  memset(token, 0, sizeof(token));
+  const char *start = pos;
 
-  while (true)
-    {
-      ch = fgetc(file);
+  while (pos < end && isblank((unsigned char)*pos))
+    pos++;
 
-      if (ch == EOF)
-	{
-	  AddToken(TokenSpace, token, include);
-	  return true;
-	}
-      else if (isblank(ch))
-	{
-	  token[len++] = ch;
-	}
-      else
-	{
-	  AddToken(TokenSpace, token, include);
-	  ungetc(ch, file);
-	  return true;
-	}
-    }
-  assert(false);
-  return false;
+  AddToken(TokenSpace, start, pos - start, include);
+  return true;
 }
 
 
@@ -668,9 +721,9 @@ bool Worldfile::SaveTokens(FILE *file)
       if (token->include > 0)
 	continue;
       if (token->type == TokenString)
-				fprintf(file, "\"%s\"", token->value.c_str());
+				fprintf(file, "\"%s\"", GetTokenValue(i));
       else
-				fprintf(file, "%s", token->value.c_str());
+				fprintf(file, "%s", GetTokenValue(i));
     }
   return true;
 }
@@ -681,24 +734,77 @@ bool Worldfile::SaveTokens(FILE *file)
 void Worldfile::ClearTokens()
 {
 	tokens.clear();
+	strings.clear();
+	string_slots.clear();
 }
 
 
 ///////////////////////////////////////////////////////////////////////////
 // Add a token to the token list
-bool Worldfile::AddToken(int type, const char *value, int include)
+bool Worldfile::AddToken(int type, const char *value, size_t len, int include)
 {
-	tokens.push_back( CToken( include, type, value ));
+	tokens.push_back( CToken( include, type, InternString( value, len ) ));
   return true;
 }
 
 
+///////////////////////////////////////////////////////////////////////////
+// Find or add a string in the string pool
+unsigned int Worldfile::InternString(const char *str, size_t len)
+{
+  // keep the table at most half full
+  if( 2 * (strings.size() + 1) > string_slots.size() )
+    {
+      std::vector<uint32_t> slots( std::max( (size_t)256, 2 * string_slots.size() ), 0 );
+      const size_t mask( slots.size() - 1 );
+
+      for( unsigned int i=0; i<strings.size(); i++ )
+	{
+	  size_t s( hash_string( strings[i].data(), strings[i].size() ) & mask );
+	  while( slots[s] )
+	    s = (s + 1) & mask;
+	  slots[s] = i + 1;
+	}
+      string_slots.swap( slots );
+    }
+
+  const size_t s( FindStringSlot( str, len ) );
+
+  if( string_slots[s] == 0 )
+    {
+      strings.push_back( std::string( str, len ) );
+      string_slots[s] = strings.size();
+    }
+
+  return string_slots[s] - 1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Find the slot for a string in the string pool's hash table
+size_t Worldfile::FindStringSlot(const char *str, size_t len) const
+{
+  const size_t mask( string_slots.size() - 1 );
+  size_t s( hash_string( str, len ) & mask );
+
+  while( string_slots[s] )
+    {
+      const std::string& candidate( strings[ string_slots[s] - 1 ] );
+      if( candidate.size() == len && memcmp( candidate.data(), str, len ) == 0 )
+	break;
+      s = (s + 1) & mask;
+    }
+
+  return s;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////
 // Set a token value in the token list
 bool Worldfile::SetTokenValue(int index, const char *value)
 {
   assert(index >= 0 && index < (int)this->tokens.size() );
-	tokens[index].value = value;
+	tokens[index].value = InternString( value, strlen(value) );
   return true;
 }
 
@@ -708,7 +814,7 @@ bool Worldfile::SetTokenValue(int index, const char *value)
 const char *Worldfile::GetTokenValue(int index)
 {
   assert(index >= 0 && index < (int)this->tokens.size());
-  return this->tokens[index].value.c_str();
+  return this->strings[ this->tokens[index].value ].c_str();
 }
 
 
@@ -725,10 +831,11 @@ void Worldfile::DumpTokens()
 	FOR_EACH( it, tokens )
   //for (int i = 0; i < this->token_count; i++)
     {
-      if ( it->value[0] == '\n')
+      const std::string& value( strings[it->value] );
+      if ( value[0] == '\n')
 				printf("[\\n]\n## %4d : %02d ", ++line, it->include);
       else
-				printf("[%s] ", it->value.c_str());
+				printf("[%s] ", value.c_str());
     }
   printf("\n");
   printf("## end tokens\n");
@@ -758,12 +865,12 @@ bool Worldfile::ParseTokens()
       switch (token->type)
 				{
 				case TokenWord:
-					if ( token->value == "include") 
+					if ( strings[token->value] == "include") 
 						{
 							if (!ParseTokenInclude(&i, &line))
 								return false;
 						}
-					else if ( token->value == "define" )
+					else if ( strings[token->value] == "define" )
 						{
 							if (!ParseTokenDefine(&i, &line))
 								return false;
@@ -1245,7 +1352,16 @@ void Worldfile::DumpEntities()
 {
   printf("\n## begin entities\n");
 
+	// sorted on "<entity><name>", as the test dumps expect
+	std::map<std::string,CProperty*> keyed;
 	FOR_EACH( it, properties )
+		{
+			char key[128];
+			snprintf( key, 127, "%d%s", (*it)->entity, (*it)->name.c_str() );
+			keyed[ key ] = *it;
+		}
+
+	FOR_EACH( it, keyed )
 		PrintProp( it->first.c_str(), it->second );
 
   printf("## end entities\n");
@@ -1257,8 +1373,14 @@ void Worldfile::DumpEntities()
 void Worldfile::ClearProperties()
 {
 	FOR_EACH( it, properties )
-		delete it->second;	
+		delete *it;
 	properties.clear();
+
+	FOR_EACH( it, entities )
+		{
+			it->property_slots.clear();
+			it->property_count = 0;
+		}
 }
 
 
@@ -1266,17 +1388,62 @@ void Worldfile::ClearProperties()
 // Add an property
 CProperty* Worldfile::AddProperty(int entity, const char *name, int line)
 {
-  char key[128];
-  snprintf( key, 127, "%d%s", entity, name );
+  assert( entity >= 0 && entity < (int)entities.size() );
+  CEntity& ent( entities[entity] );
+
+  // keep the table at most half full
+  if( 2 * (ent.property_count + 1) > ent.property_slots.size() )
+    {
+      std::vector<CPropertySlot> slots( std::max( (size_t)16, 2 * ent.property_slots.size() ) );
+      const size_t mask( slots.size() - 1 );
+
+      FOR_EACH( it, ent.property_slots )
+	if( it->index )
+	  {
+	    size_t s( hash_name( it->name_id ) & mask );
+	    while( slots[s].index )
+	      s = (s + 1) & mask;
+	    slots[s] = *it;
+	  }
+      ent.property_slots.swap( slots );
+    }
+
+  CProperty *property =
+    new CProperty( entity, name, InternString( name, strlen(name) ), line );
 
-  CProperty *property = new CProperty( entity, name, line );
+  CPropertySlot& slot( ent.property_slots[ FindPropertySlot( ent, property->name_id ) ] );
 
-	properties[ key ] = property;
+  if( slot.index ) // a repeated property replaces the earlier one
+    {
+      delete properties[ slot.index - 1 ];
+      properties[ slot.index - 1 ] = property;
+    }
+  else
+    {
+      properties.push_back( property );
+      slot.name_id = property->name_id;
+      slot.index = properties.size();
+      ent.property_count++;
+    }
 
 	return property;
 }
 
 
+///////////////////////////////////////////////////////////////////////////
+// Find the slot for a property in an entity's property hash table
+size_t Worldfile::FindPropertySlot(const CEntity& entity, unsigned int name_id) const
+{
+  const size_t mask( entity.property_slots.size() - 1 );
+  size_t s( hash_name( name_id ) & mask );
+
+  while( entity.property_slots[s].index && entity.property_slots[s].name_id != name_id )
+    s = (s + 1) & mask;
+
+  return s;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////
 // Add an property value
 void Worldfile::AddPropertyValue( CProperty* property, int index, int value_token)
@@ -1297,28 +1464,19 @@ void Worldfile::AddPropertyValue( CProperty* property, int index, int value_toke
 // Get an property
 CProperty* Worldfile::GetProperty(int entity, const char *name)
 {
-  char key[128];
-  snprintf( key, 127, "%d%s", entity, name );
-  
-  //printf( "looking up key %s for entity %d name %s\n", key, entity, name );
-  
-  static char cache_key[128] = { 0 }; 
-  static CProperty* cache_property = NULL;
-  
-  if( strncmp( key, cache_key, 128 ) != 0 ) // different to last time
-	 {		
-		strncpy( cache_key, key, 128 ); // remember for next time		
-		
-		std::map<std::string,CProperty*>::iterator it = properties.find( key );	
-		if( it == properties.end() ) // not found
-		  cache_property = NULL;
-		else
-		  cache_property = it->second;		
-	 }
-  //else
-  // printf( "cache hit with %s\n", cache_key );
-	
-  return cache_property;
+  // every property name is in the string pool, so a name that isn't
+  // can't be a property
+  if( entity < 0 || entity >= (int)entities.size() ||
+      entities[entity].property_slots.empty() )
+    return NULL;
+
+  const uint32_t name_slot( string_slots[ FindStringSlot( name, strlen(name) ) ] );
+  if( name_slot == 0 )
+    return NULL;
+
+  const CEntity& ent( entities[entity] );
+  const uint32_t index( ent.property_slots[ FindPropertySlot( ent, name_slot - 1 ) ].index );
+  return( index ? properties[ index - 1 ] : NULL );
 }
 
 bool Worldfile::PropertyExists( int section, const char* token )
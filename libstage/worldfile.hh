@@ -42,6 +42,9 @@ namespace Stg {
 
     /// Name of property
 	 std::string name;
+
+    /// Index of the name in the worldfile's string pool
+    unsigned int name_id;
     
     /// A list of token indexes
 	 std::vector<int> values;
@@ -52,9 +55,10 @@ namespace Stg {
     /// Flag set if property has been used
     bool used;
 		
-	 CProperty( int entity, const char* name, int line ) :
+	 CProperty( int entity, const char* name, unsigned int name_id, int line ) :
 		entity(entity), 
 		name(name),
+		name_id(name_id),
 		values(),
 		line(line),
 		used(false) {}
@@ -81,6 +85,15 @@ namespace Stg {
 
     // Save world into named file
   public: bool Save(const std::string& filename);
+
+	 // Append the tokens, entities and properties to buf in a binary
+	 // form, for a world snapshot
+  public: void SaveSnapshot(std::string& buf);
+
+	 // Replace the contents with those saved by SaveSnapshot() in the
+	 // bytes from pos to end, without parsing, and move pos past them.
+	 // Returns false if the bytes are not a valid snapshot.
+  public: bool LoadSnapshot(const uint8_t*& pos, const uint8_t* end);
     
 	 // Check for unused properties and print warnings
   public: bool WarnUnused();
@@ -141,26 +154,33 @@ namespace Stg {
 	 ////////////////////////////////////////////////////////////////////////////
 	 // Private methods used to load stuff from the world file
   
-	 // Load tokens from a file.
+	 // Load tokens from a file. The file is mapped (or failing that,
+	 // read) into memory in one go and lexed from there.
   private: bool LoadTokens(FILE *file, int include);
 
+	 // Load tokens from the len bytes at data.
+  private: bool LoadTokens(const char *data, size_t len, int include);
+
+	 // The token readers below consume the token starting at pos,
+	 // leaving pos just past it. end is the end of the buffer.
+
 	 // Read in a comment token
-  private: bool LoadTokenComment(FILE *file, int *line, int include);
+  private: bool LoadTokenComment(const char *&pos, const char *end, int *line, int include);
 
 	 // Read in a word token
-  private: bool LoadTokenWord(FILE *file, int *line, int include);
+  private: bool LoadTokenWord(const char *&pos, const char *end, int *line, int include);
 
 	 // Load an include token; this will load the include file.
-  private: bool LoadTokenInclude(FILE *file, int *line, int include);
+  private: bool LoadTokenInclude(const char *&pos, const char *end, int *line, int include);
 
 	 // Read in a number token
-  private: bool LoadTokenNum(FILE *file, int *line, int include);
+  private: bool LoadTokenNum(const char *&pos, const char *end, int *line, int include);
 
 	 // Read in a string token
-  private: bool LoadTokenString(FILE *file, int *line, int include);
+  private: bool LoadTokenString(const char *&pos, const char *end, int *line, int include);
 
 	 // Read in a whitespace token
-  private: bool LoadTokenSpace(FILE *file, int *line, int include);
+  private: bool LoadTokenSpace(const char *&pos, const char *end, int *line, int include);
 
 	 // Save tokens to a file.
   private: bool SaveTokens(FILE *file);
@@ -168,8 +188,15 @@ namespace Stg {
 	 // Clear the token list
   private: void ClearTokens();
 
-	 // Add a token to the token list
-  private: bool AddToken(int type, const char *value, int include);
+	 // Add a token with the len characters at value to the token list
+  private: bool AddToken(int type, const char *value, size_t len, int include);
+
+	 // Find or add a string in the string pool, returning its index
+  private: unsigned int InternString(const char *str, size_t len);
+
+	 // Find the slot in string_slots that holds this string, or the
+	 // empty slot where it would go. There must be at least one slot.
+  private: size_t FindStringSlot(const char *str, size_t len) const;
 
 	 // Set a token in the token list
   private: bool SetTokenValue(int index, const char *value);
@@ -245,10 +272,18 @@ namespace Stg {
 
 	 // Add an property
   private: CProperty* AddProperty(int entity, const char *name, int line);
+
+	 // Find the slot in an entity's property table that holds the
+	 // named property, or the empty slot where it would go. There must
+	 // be at least one slot.
+	 class CEntity;
+  private: size_t FindPropertySlot(const CEntity& entity, unsigned int name_id) const;
+
 	 // Add an property value.
   private: void AddPropertyValue( CProperty* property, int index, int value_token);
   
-	 // Get an property
+	 // Get an property. Lookups change nothing, so they are safe to
+	 // make from several threads at once while nothing is written.
   public: CProperty* GetProperty(int entity, const char *name);
 
 	 // returns true iff the property exists in the file, so that you can
@@ -285,10 +320,10 @@ namespace Stg {
 		// Token type (enumerated value).
 		int type;
 		
-		// Token value
-		std::string value;
+		// Token value, as an index into the string pool
+		unsigned int value;
 		
-		CToken( int include, int type, const char* value ) :
+		CToken( int include, int type, unsigned int value ) :
 		  include(include), type(type), value(value) {}
 	 };
 	 
@@ -297,6 +332,16 @@ namespace Stg {
 	 //private: int token_size, token_count;
   private:  std::vector<CToken> tokens;
 
+	 // Pool of token strings. Worldfiles repeat the same few words,
+	 // numbers and bits of punctuation over and over, so each distinct
+	 // string is kept only once. A deque never moves its elements, so
+	 // the strings stay put as the pool grows.
+  private: std::deque<std::string> strings;
+
+	 // Open-addressed hash table over the pool: each slot holds an
+	 // index into strings plus one, or zero if the slot is empty.
+  private: std::vector<uint32_t> string_slots;
+
 	 // Private macro class
   private: 
 	 class CMacro
@@ -326,6 +371,20 @@ namespace Stg {
 	 // Macro table
   private: std::map<std::string,CMacro> macros;
 	 
+	 // A slot in an entity's property hash table
+  private:
+	 class CPropertySlot
+	 {
+	 public:
+		// Index of the property's name in the string pool
+		unsigned int name_id;
+
+		// Index into properties plus one, or zero if the slot is empty
+		uint32_t index;
+
+		CPropertySlot() : name_id(0), index(0) {}
+	 };
+
 	 // Private entity class
   private: 
 	 class CEntity
@@ -336,15 +395,23 @@ namespace Stg {
 		
 		// Type of entity (i.e. position, laser, etc).
 		std::string type;
+
+		// Open-addressed hash table over the entity's properties, keyed
+		// on the index of the property name in the string pool
+		std::vector<CPropertySlot> property_slots;
+
+		// Number of properties in property_slots
+		unsigned int property_count;
 		
-		CEntity( int parent, const char* type ) : parent(parent), type(type) {} 
+		CEntity( int parent, const char* type ) :
+		  parent(parent), type(type), property_slots(), property_count(0) {} 
 	 };
 	 
 	 // Entity list
   private: std::vector<CEntity> entities;
 	 
-	 // Property list
-  private: std::map<std::string,CProperty*> properties;	
+	 // Property list, in the order the properties were added
+  private: std::vector<CProperty*> properties;
 	 
 	 // Name of the file we loaded
   public: std::string filename;
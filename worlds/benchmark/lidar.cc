@@ -0,0 +1,107 @@
+/////////////////////////////////
+// File: lidar.cc
+// Desc: Multi-layer lidar benchmark. Drives the robot around using
+//       its lidar, and reports how many points per second the lidar
+//       produces.
+// License: GPL
+/////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "stage.hh"
+using namespace Stg;
+
+typedef struct
+{
+  ModelPosition* position;
+  ModelRanger* lidar;
+  unsigned int updates;
+} robot_t;
+
+const double VSPEED = 0.3; // meters per second
+const double WGAIN = 1.0; // turn speed gain
+const double SAFE_DIST = 0.6; // meters
+
+const unsigned int WARMUP_UPDATES = 10; // lidar updates before timing
+const unsigned int TIMED_SCANS = 20; // scans timed per lidar
+
+// forward declare
+int LidarUpdate( ModelRanger* mod, robot_t* robot );
+
+// Stage calls this when the model starts up
+extern "C" int Init( Model* mod )
+{
+  robot_t* robot = new robot_t;
+  robot->position = (ModelPosition*)mod;
+  robot->updates = 0;
+
+  // skip the pioneer's sonar ring: the lidar is the second ranger
+  mod->GetUnusedModelOfType( "ranger" );
+  robot->lidar = (ModelRanger*)mod->GetUnusedModelOfType( "ranger" );
+  assert( robot->lidar );
+
+  robot->lidar->AddCallback( Model::CB_UPDATE, (model_callback_t)LidarUpdate, robot );
+
+  robot->position->Subscribe();
+  robot->lidar->Subscribe();
+
+  return 0; //ok
+}
+
+static double seconds()
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return( tv.tv_sec + tv.tv_usec / 1e6 );
+}
+
+int LidarUpdate( ModelRanger* lidar, robot_t* robot )
+{  	
+  const ModelRanger::Sensor& s = lidar->GetSensors()[0];
+
+  // head for the most open direction in front of us, using the
+  // channel nearest the horizontal
+  double best_range = 0.0, best_bearing = 0.0, front = s.range.max;
+  
+  for( unsigned int i=0; i<s.ranges.size(); i++ )
+    {
+      if( fabs( s.bearings[i] ) > M_PI/2.0 )
+	continue;
+
+      if( s.ranges[i] > best_range )
+	{
+	  best_range = s.ranges[i];
+	  best_bearing = s.bearings[i];
+	}
+      
+      if( fabs( s.bearings[i] ) < M_PI/6.0 )
+	front = std::min( front, s.ranges[i] );
+    }
+  
+  robot->position->SetSpeed( front > SAFE_DIST ? VSPEED : 0.0, 
+			     0, 
+			     WGAIN * best_bearing );
+  
+  // once things are moving, time a few scans of all our sensors
+  if( ++robot->updates == WARMUP_UPDATES )
+    {
+      std::vector<ModelRanger::Sensor>& sensors = lidar->GetSensorsMutable();
+      size_t points = 0;
+      
+      const double start = seconds();
+      for( unsigned int r=0; r<TIMED_SCANS; r++ )
+	FOR_EACH( it, sensors )
+	  {
+	    it->Update( lidar );
+	    points += it->points.size();
+	  }
+      const double elapsed = seconds() - start;
+      
+      printf( "[%s] %lu points in %.3f s: %.0f points per second\n",
+	      lidar->Token(), (unsigned long)points, elapsed, points / elapsed );
+    }
+  
+  return 0;
+}
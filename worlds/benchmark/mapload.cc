@@ -0,0 +1,153 @@
+/////////////////////////////////
+// File: mapload.cc
+// Desc: Map loading benchmark. Times the conversion of bitmaps into
+//       polygons, as done for a model's bitmap property, as traced
+//       outlines, as merged rectangles (bitmap_rects) and as a map
+//       block (bitmap_cells), and prints the polygons and vertices
+//       each gives. The controller's arguments name the images, or
+//       directories of .png images, relative to the worldfile. The
+//       default is ../bitmaps. Then prints the blocks, vertices and
+//       rendered cells of every other model in the world.
+// License: GPL
+/////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <sstream>
+
+#include "stage.hh"
+#include "worldfile.hh"
+using namespace Stg;
+
+const unsigned int REPEATS = 3; // loads of each image, the best is reported
+
+static double seconds()
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return( tv.tv_sec + tv.tv_usec / 1e6 );
+}
+
+// append path to files, or the .png files in it if it is a directory
+static void find_images( const std::string& path, std::vector<std::string>& files )
+{
+  DIR* dir = opendir( path.c_str() );
+  if( dir == NULL )
+    {
+      files.push_back( path );
+      return;
+    }
+  
+  std::vector<std::string> found;
+  while( struct dirent* ent = readdir( dir ) )
+    {
+      const size_t len = strlen( ent->d_name );
+      if( len > 4 && strcmp( ent->d_name + len - 4, ".png" ) == 0 )
+	found.push_back( path + "/" + ent->d_name );
+    }
+  closedir( dir );
+  
+  std::sort( found.begin(), found.end() );
+  files.insert( files.end(), found.begin(), found.end() );
+}
+
+// Stage calls this when the model starts up
+extern "C" int Init( Model* mod, CtrlArgs* args )
+{
+  // paths are relative to the worldfile
+  char* wf = strdup( mod->GetWorld()->GetWorldFile()->filename.c_str() );
+  const std::string base = std::string( dirname( wf ) ) + "/";
+  free( wf );
+  
+  // the first word is our own name
+  std::istringstream words( args->worldfile );
+  std::string word;
+  words >> word;
+  
+  std::vector<std::string> files;
+  while( words >> word )
+    find_images( word[0] == '/' ? word : base + word, files );
+  
+  if( files.empty() )
+    find_images( base + "../bitmaps", files );
+  
+  const char* modes[3] = { "outlines", "rects", "cells" };
+  
+  for( int m=0; m<3; m++ )
+    {
+      double total = 0.0;
+      size_t total_polys = 0, total_verts = 0;
+      
+      FOR_EACH( it, files )
+	{
+	  double best = 0.0;
+	  size_t verts = 0;
+	  std::vector<std::vector<point_t> > polys;
+	  
+	  for( unsigned int r=0; r<REPEATS; r++ )
+	    {
+	      polys.clear();
+	      const double start = seconds();
+	      int err = 0;
+	      if( m == 0 )
+		err = polys_from_image_file( *it, polys );
+	      else if( m == 1 )
+		err = rects_from_image_file( *it, polys );
+	      else
+		{
+		  // a map block is a single rectangle around its raster
+		  std::vector<uint8_t> raster;
+		  uint32_t width = 0, height = 0;
+		  err = raster_from_image_file( *it, raster, width, height );
+		  if( width && height )
+		    polys.push_back( std::vector<point_t>( 4 ) );
+		}
+	      const double elapsed = seconds() - start;
+	      
+	      if( err )
+		{
+		  printf( "\n[mapload] failed to load image file %s\n", it->c_str() );
+		  exit( -1 );
+		}
+	      
+	      if( r == 0 || elapsed < best )
+		best = elapsed;
+	    }
+	  
+	  FOR_EACH( pit, polys )
+	    verts += pit->size();
+	  
+	  printf( "\n[mapload] %s %s: %lu polygons, %lu vertices, %.2f ms",
+		  modes[m], it->substr( it->rfind( '/' ) + 1 ).c_str(),
+		  (unsigned long)polys.size(), (unsigned long)verts, best * 1e3 );
+	  
+	  total += best;
+	  total_polys += polys.size();
+	  total_verts += verts;
+	}
+      
+      printf( "\n[mapload] %s %lu images: %lu polygons, %lu vertices, %.2f ms",
+	      modes[m], (unsigned long)files.size(), (unsigned long)total_polys, 
+	      (unsigned long)total_verts, total * 1e3 );
+    }
+  
+  // the world's models have been rendered into both layers by now
+  const std::set<Model*> models = mod->GetWorld()->GetAllModels();
+  FOR_EACH( it, models )
+    if( *it != mod )
+      {
+	const BlockGroup& bg = (*it)->GetBlockGroup();
+	printf( "\n[mapload] model %s: %u blocks, %lu vertices, %lu cells",
+		(*it)->Token(), bg.GetCount(), 
+		(unsigned long)bg.GetVertexCount(),
+		(unsigned long)bg.GetCellCount(0) );
+      }
+  
+  putchar( '\n' );
+  
+  return 0; //ok
+}
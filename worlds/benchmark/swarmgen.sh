@@ -0,0 +1,101 @@
+#!/bin/bash
+# swarmgen.sh - generate a large swarm benchmark world on stdout
+#
+# usage: swarmgen.sh [robots] > swarm.world
+#
+# Places [robots] (default 10000) swarmbots on a square grid with
+# 0.25m spacing inside an empty arena that is sized to fit.
+
+N=${1:-10000}
+
+# robots per side of the grid
+S=1
+while (( S * S < N )) ; do
+  S=$(( S + 1 ))
+done
+
+# grid spacing and arena margin, in millimeters
+D=250
+M=2000
+W=$(( S * D + 2 * M ))
+
+# print millimeters as meters with 3 decimal places
+mm()
+{
+  local V=$1 G=""
+  if (( V < 0 )) ; then G="-" ; V=$(( -V )) ; fi
+  printf "%s%d.%03d" "$G" $(( V / 1000 )) $(( V % 1000 ))
+}
+
+cat <<HEADER
+# swarm.world - $N robot swarm benchmark, generated by swarmgen.sh
+
+include "../map.inc"
+
+resolution 0.02
+
+speedup -1 # as fast as possible
+
+paused 1
+
+threads 4
+
+quit_time 60
+
+window
+( 
+  size [ 800.000 800.000 ]
+  scale $(( 800000 / W )).000
+  show_data 0
+)
+
+floorplan
+( 
+  size [ $(mm $W) $(mm $W) 0.500 ]
+  bitmap "../bitmaps/rink.png"
+)
+
+define ir sensor 
+(
+  samples 1
+  range [0 2]
+  fov 30
+  color_rgba [1 0 0 0.3]
+)
+
+define swarmbot position
+(
+  size [0.100 0.100 0.100]  
+  color "random"
+
+  ranger 
+  (
+    pose [ 0 0 -0.050 0 ] 
+ 
+    ir( pose [ 0 0 0 0 ] )
+    ir( pose [ 0 0 0 30 ] )
+    ir( pose [ 0 0 0 60 ] )
+    ir( pose [ 0 0 0 90 ] )
+    ir( pose [ 0 0 0 120 ] )
+    ir( pose [ 0 0 0 150 ] )
+    ir( pose [ 0 0 0 180 ] )
+    ir( pose [ 0 0 0 210 ] )
+    ir( pose [ 0 0 0 240 ] )
+    ir( pose [ 0 0 0 270 ] )
+    ir( pose [ 0 0 0 300 ] )
+    ir( pose [ 0 0 0 330 ] ) 
+  )
+
+  ctrl "expand_swarm"
+)
+
+HEADER
+
+I=0
+O=$(( -(S - 1) * D / 2 ))
+for (( X=0 ; X < S && I < N ; X++ )) ; do
+  for (( Y=0 ; Y < S && I < N ; Y++ )) ; do
+    echo "swarmbot( name \"r$I\" pose [ $(mm $(( O + X * D ))) $(mm $(( O + Y * D ))) 0 0 ] )"
+    I=$(( I + 1 ))
+  done
+done
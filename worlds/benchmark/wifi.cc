@@ -0,0 +1,130 @@
+/////////////////////////////////
+// File: wifi.cc
+// Desc: Wifi network benchmark. Drives the robot around slowly
+//       while its radio broadcasts a message now and then, and has
+//       the first robot report the link and message counts of the
+//       whole network and the time per simulation step. With the
+//       argument "walls N" the robots stay put instead, and each
+//       checks that every link it has crosses N walls.
+// License: GPL
+/////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <sstream>
+
+#include "stage.hh"
+using namespace Stg;
+
+typedef struct
+{
+  ModelPosition* position;
+  ModelWifi* wifi;
+  unsigned int updates;
+  unsigned int id;
+  int walls; // the walls every link should cross, or -1 to drive about
+} robot_t;
+
+const double VSPEED = 0.2; // meters per second
+const double WSPEED = 0.3; // radians per second
+
+const unsigned int SEND_INTERVAL = 10; // updates between broadcasts
+const unsigned int REPORT_INTERVAL = 100; // updates between reports
+
+// totals over all the radios since the last report
+static unsigned long links = 0;
+static unsigned long messages = 0;
+static unsigned long radio_updates = 0;
+static unsigned int robots = 0;
+
+// forward declare
+int WifiUpdate( ModelWifi* mod, robot_t* robot );
+
+// Stage calls this when the model starts up
+extern "C" int Init( Model* mod, CtrlArgs* args )
+{
+  robot_t* robot = new robot_t;
+  robot->position = (ModelPosition*)mod;
+  robot->updates = 0;
+  robot->id = robots++;
+  robot->walls = -1;
+
+  // the first word is our own name
+  std::istringstream words( args->worldfile );
+  std::string word;
+  words >> word;
+  if( words >> word && word == "walls" )
+    words >> robot->walls;
+
+  robot->wifi = (ModelWifi*)mod->GetUnusedModelOfType( "wifi" );
+  assert( robot->wifi );
+
+  robot->wifi->AddCallback( Model::CB_UPDATE, (model_callback_t)WifiUpdate, robot );
+
+  // turn left or right, so the robots spread out
+  if( robot->walls < 0 )
+    robot->position->SetSpeed( VSPEED, 0, robot->id % 2 ? WSPEED : -WSPEED );
+
+  robot->position->Subscribe();
+  robot->wifi->Subscribe();
+
+  return 0; //ok
+}
+
+static double seconds()
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return( tv.tv_sec + tv.tv_usec / 1e6 );
+}
+
+int WifiUpdate( ModelWifi* wifi, robot_t* robot )
+{  	
+  links += wifi->GetLinks().size();
+  messages += wifi->GetMessages().size();
+  ++radio_updates;
+  
+  if( robot->walls >= 0 )
+    {
+      // check the links once, on our first update
+      if( ++robot->updates > 1 )
+	return 0;
+      
+      const std::vector<ModelWifi::Link>& found = wifi->GetLinks();
+      
+      if( found.empty() )
+	printf( "[wifi] %s has no links: FAILED\n", wifi->Token() );
+      
+      FOR_EACH( it, found )
+	printf( "[wifi] %s to %s crosses %u walls, expected %d: %s\n",
+		wifi->Token(), it->peer->Token(), it->walls, robot->walls,
+		(int)it->walls == robot->walls ? "ok" : "FAILED" );
+      return 0;
+    }
+  
+  // stagger the broadcasts over the send interval
+  if( (++robot->updates + robot->id) % SEND_INTERVAL == 0 )
+    {
+      char buf[32];
+      snprintf( buf, sizeof(buf), "hello from %u", robot->id );
+      wifi->Send( buf );
+    }
+
+  // the first robot reports for everyone
+  static double last = 0;
+  if( robot->id == 0 && robot->updates % REPORT_INTERVAL == 0 )
+    {
+      const double now = seconds();
+      if( last > 0 )
+	printf( "[wifi] %u radios, %.1f links per radio, %.1f messages per step, %.2f ms per step\n",
+		robots, 
+		(double)links / radio_updates, 
+		(double)messages / REPORT_INTERVAL,
+		1e3 * (now - last) / REPORT_INTERVAL );
+      last = now;
+      links = messages = radio_updates = 0;
+    }
+  
+  return 0;
+}
@@ -0,0 +1,85 @@
+#!/bin/bash
+# wifigen.sh - generate a large wifi network benchmark world on stdout
+#
+# usage: wifigen.sh [radios] > wifi.world
+#
+# Places [radios] (default 1000) robots, each with a wifi radio, on a
+# square grid with 2m spacing inside a cave that is sized to fit. The
+# radios reach about 7m in the open, less through the cave walls.
+
+N=${1:-1000}
+
+# robots per side of the grid
+S=1
+while (( S * S < N )) ; do
+  S=$(( S + 1 ))
+done
+
+# grid spacing and arena margin, in millimeters
+D=2000
+M=2000
+W=$(( S * D + 2 * M ))
+
+# print millimeters as meters with 3 decimal places
+mm()
+{
+  local V=$1 G=""
+  if (( V < 0 )) ; then G="-" ; V=$(( -V )) ; fi
+  printf "%s%d.%03d" "$G" $(( V / 1000 )) $(( V % 1000 ))
+}
+
+cat <<HEADER
+# wifi.world - $N radio wifi network benchmark, generated by wifigen.sh
+
+include "../map.inc"
+
+resolution 0.05
+
+speedup -1 # as fast as possible
+
+paused 1
+
+threads 2
+
+quit_time 60
+
+window
+( 
+  size [ 800.000 800.000 ]
+  scale $(( 800000 / W )).000
+  show_data 0
+)
+
+floorplan
+( 
+  size [ $(mm $W) $(mm $W) 0.800 ]
+  bitmap "../bitmaps/cave.png"
+)
+
+define radio wifi
+(
+  power -10
+  sensitivity -75
+)
+
+define wifibot position
+(
+  size [0.200 0.200 0.200]  
+  color "random"
+  obstacle_return 0
+
+  radio( pose [ 0 0 0 0 ] )
+
+  ctrl "wifi"
+)
+
+HEADER
+
+I=0
+O=$(( -(S - 1) * D / 2 ))
+for (( X=0 ; X < S && I < N ; X++ )) ; do
+  for (( Y=0 ; Y < S && I < N ; Y++ )) ; do
+    echo "wifibot( name \"r$I\" pose [ $(mm $(( O + X * D ))) $(mm $(( O + Y * D ))) 0 0 ] )"
+    I=$(( I + 1 ))
+  done
+done